@@ -0,0 +1,125 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_AOT_H
+#define LISPY_AOT_H
+
+#include <common.h>
+
+#include <value.h>
+#include <environment.h>
+#include <jit.h>
+
+// Ahead of time compilation of programs to C. Top-level forms and bodies of
+// lambdas, created by '\' with literal parameters and body (like in 'defun'),
+// are translated to C functions, that evaluate them like interpreter does.
+// Global names are bound to slots at start-up and looked up again only when
+// their version changes. Builtins and compiled lambdas bound to globals are
+// called directly, macros are expanded and 'cond' is inlined during
+// compilation, while the binding is the same as at compile time; otherwise the
+// form is evaluated by interpreter. Lambdas, that JIT can compile, are also
+// translated to numeric C functions.
+
+#include <stdint.h>
+
+#define AOT_STACK_EXHAUSTED()										\
+	((uintptr_t) __builtin_frame_address(0) < aotStackLimit)
+
+// Evaluates body of a lambda in a frame with bound parameters
+typedef lval* (*aot_body)(lenv* env);
+typedef lval* (*aot_file)(lenv* env);
+
+typedef struct aot_global
+{
+    const char* name;
+    lenv_watched* watch;
+    unsigned long version;
+    // Borrowed from the global environment, NULL if the name is unbound
+    lval* value;
+} aot_global;
+
+// Caches comparison of the global binding with the value seen at compile time
+typedef struct aot_guard
+{
+    unsigned long version;
+    lval* value;
+    bool holds;
+} aot_guard;
+
+// Head of a call. Builtins are called by pointers and compiled lambdas by
+// 'native', so neither is copied; otherwise 'value' is the evaluated head
+typedef struct aot_callee
+{
+    lval* value;
+    lbuiltin_func builtin;
+    lbuiltin_argv_func argvBuiltin;
+    aot_body native;
+    const char* const* formals;
+    aot_global* global;
+    unsigned long version;
+} aot_callee;
+
+// Compiled bodies give way to interpreter below this address
+extern uintptr_t aotStackLimit;
+
+// Compiler. Returns NULL on success
+lval* aot_emit_c(lenv* env, const char* fileName, const char* outName);
+lval* aot_eval(lenv* env, lval* form);
+
+// Runtime of compiled programs
+lenv* aot_init();
+void  aot_finish(lenv* env);
+lval* aot_list(unsigned count, ...);
+lval* aot_load(lenv* env, aot_file file, bool isMain);
+// Returns owned error or NULL, the result of a top-level form is deleted
+lval* aot_result(lval* res);
+void  aot_attach(lenv* env, const char* name, jit_entry entry, jit_kind result,
+				 const char* const* guards);
+
+void  aot_bind(lenv* env, aot_global* globals, unsigned count);
+// Returns borrowed value of local or global binding or NULL
+lval* aot_lookup(lenv* env, aot_global* global);
+lval* aot_get(lenv* env, aot_global* global);
+lval* aot_get_local(lenv* env, const char* name);
+
+bool  aot_holds_builtin(lenv* env, aot_global* global, lbuiltin_func builtin);
+bool  aot_holds_macro(lenv* env, aot_global* global, aot_guard* guard,
+					  lval* (*expected)(void));
+
+void  aot_head(lenv* env, aot_global* global, aot_callee* callee);
+void  aot_head_native(lenv* env, aot_global* global, aot_body native,
+					  const char* const* formals, aot_callee* callee);
+void  aot_head_value(aot_callee* callee, lval* value);
+// Takes ownership of 'callee->value' and arguments
+lval* aot_apply(lenv* env, aot_callee* callee, unsigned argc, lval** argv);
+// Takes ownership of 'macro' and 'form', that is the whole call
+lval* aot_expand(lenv* env, lval* macro, lval* form);
+
+// Test of 'cond' clause 'index': returns 1 or 0, or -1 and sets 'res' to error
+int   aot_test(lval* test, int index, lval** res);
+// Attaches compiled body to the result of '\'
+lval* aot_lambda(lval* lambda, aot_body body);
+
+#endif // LISPY_AOT_H
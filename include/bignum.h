@@ -0,0 +1,74 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_BIGNUM_H
+#define LISPY_BIGNUM_H
+
+#include <common.h>
+
+#include <stdint.h>
+
+// Arbitrary-precision integer: sign and magnitude with digits in base 10^9,
+// least significant first, so decimal conversion is linear. Zero has no digits.
+// Numbers, that fit into long, are never stored as bignums (see 'lval_num_big').
+
+#define BIGNUM_BASE 1000000000u
+#define BIGNUM_BASE_DIGITS 9
+
+// Enough digits to hold any long
+#define BIGNUM_LONG_DIGITS 3
+
+struct lbig
+{
+	bool negative;
+	unsigned count;
+	uint32_t* digits;
+};
+
+lbig* bignum_from_long(long x);
+// 'str' is a decimal number with optional sign
+lbig* bignum_parse(const char* str);
+lbig* bignum_copy(const lbig* a);
+void  bignum_free(lbig* a);
+
+// Bignum, that shares storage 'digits' with the caller, for mixed operations
+void bignum_view_long(lbig* view, uint32_t digits[BIGNUM_LONG_DIGITS], long x);
+
+// Returns false if 'a' doesn't fit into long
+bool bignum_to_long(const lbig* a, long* x);
+
+lbig* bignum_add(const lbig* a, const lbig* b);
+lbig* bignum_sub(const lbig* a, const lbig* b);
+lbig* bignum_mul(const lbig* a, const lbig* b);
+// Rounds toward zero and the remainder has sign of 'a', like C operators.
+// 'b' must be non-zero, 'quot' or 'rem' may be NULL
+void  bignum_divmod(const lbig* a, const lbig* b, lbig** quot, lbig** rem);
+
+int   bignum_cmp(const lbig* a, const lbig* b);
+
+// Returns malloc'ed decimal string
+char* bignum_to_str(const lbig* a);
+
+#endif // LISPY_BIGNUM_H
@@ -30,48 +30,151 @@
 #include <value.h>
 #include <environment.h>
 
-lval* builtin_head(lenv* e, lval* a);
-lval* builtin_tail(lenv* e, lval* a);
-lval* builtin_list(lenv* e, lval* a);
-lval* builtin_eval(lenv* e, lval* a);
-lval* builtin_join(lenv* e, lval* a);
-
-lval* builtin_headstr(lenv* e, lval* a);
-lval* builtin_tailstr(lenv* e, lval* a);
-lval* builtin_joinstr(lenv* e, lval* a);
+// Signatures of builtins with argv calling convention: C name, symbol, name
+// in error messages, minimal and maximal (-1 if unlimited) count of
+// arguments, types of arguments and type of the result. The last type of
+// arguments is repeated for the rest of them. Argument checks and
+// adapters, that unpack argument lists, are generated, builtin_<name>_unchecked
+// does the work and may be called directly, when types of arguments are known
+#define BUILTIN_ANY ((lval_type) -1)
+// String or Character
+#define BUILTIN_TEXT ((lval_type) -2)
+
+#define BUILTIN_TYPE_MATCHES(expected, got) ((expected) == BUILTIN_ANY || (expected) == (got) \
+    || ((expected) == BUILTIN_TEXT && ((got) == LVAL_STR || (got) == LVAL_CHAR)))
+
+#define BUILTIN_SIGNATURES                                                                        \
+    o(list,     "list",    "list",                0, -1, (BUILTIN_ANY),              LVAL_LIST)   \
+    o(head,     "head",    "head",                1,  1, (LVAL_LIST),                BUILTIN_ANY) \
+    o(tail,     "tail",    "tail",                1,  1, (LVAL_LIST),                LVAL_LIST)   \
+    o(join,     "join",    "join",                1, -1, (LVAL_LIST),                LVAL_LIST)   \
+    o(headstr,  "headstr", "headstr",             1,  1, (LVAL_STR),                 LVAL_CHAR)   \
+    o(tailstr,  "tailstr", "tailstr",             1,  1, (LVAL_STR),                 LVAL_STR)    \
+    o(joinstr,  "joinstr", "joinstr",             0, -1, (BUILTIN_TEXT),             LVAL_STR)    \
+    o(string_to_list, "string->list", "string->list", 1, 1, (LVAL_STR), LVAL_LIST)                \
+    o(string_length, "string-length", "string-length", 1, 1, (LVAL_STR), LVAL_NUM)                \
+    o(substring, "substring", "substring", 2, 3, (LVAL_STR, LVAL_NUM), LVAL_STR)                  \
+    o(string_index, "string-index", "string-index", 2, 3, (LVAL_STR, BUILTIN_TEXT, LVAL_NUM), LVAL_NUM) \
+    o(string_split, "string-split", "string-split", 2, 2, (LVAL_STR, BUILTIN_TEXT), LVAL_LIST)    \
+    o(string_join, "string-join", "string-join", 1, 2, (LVAL_LIST, BUILTIN_TEXT), LVAL_STR)       \
+    o(string_replace, "string-replace", "string-replace", 3, 3, (LVAL_STR, BUILTIN_TEXT), LVAL_STR) \
+    o(string_to_number, "string->number", "string->number", 1, 1, (LVAL_STR), LVAL_NUM)           \
+    o(number_to_string, "number->string", "number->string", 1, 1, (LVAL_NUM), LVAL_STR)           \
+    o(string_builder, "string-builder", "string-builder", 0, -1, (BUILTIN_ANY), LVAL_BUILDER)     \
+    o(add,      "+",       "builtin arithmetic",  1, -1, (LVAL_NUM),                 LVAL_NUM)    \
+    o(sub,      "-",       "builtin arithmetic",  1, -1, (LVAL_NUM),                 LVAL_NUM)    \
+    o(mul,      "*",       "builtin arithmetic",  1, -1, (LVAL_NUM),                 LVAL_NUM)    \
+    o(div,      "/",       "builtin arithmetic",  1, -1, (LVAL_NUM),                 LVAL_NUM)    \
+    o(mod,      "mod",     "mod",                 2,  2, (LVAL_NUM),                 LVAL_NUM)    \
+    o(lt,       "<",       "<",                   1, -1, (LVAL_NUM),                 LVAL_BOOL)   \
+    o(le,       "<=",      "<=",                  1, -1, (LVAL_NUM),                 LVAL_BOOL)   \
+    o(gt,       ">",       ">",                   1, -1, (LVAL_NUM),                 LVAL_BOOL)   \
+    o(ge,       ">=",      ">=",                  1, -1, (LVAL_NUM),                 LVAL_BOOL)   \
+    o(numeq,    "=",       "=",                   1, -1, (LVAL_NUM),                 LVAL_BOOL)   \
+    o(eq,       "eq",      "eq",                  2,  2, (BUILTIN_ANY),              LVAL_BOOL)   \
+    o(less,     "less",    "less",                2,  2, (LVAL_NUM),                 LVAL_BOOL)   \
+    o(not,      "not",     "not",                 1,  1, (LVAL_BOOL),                LVAL_BOOL)   \
+    o(typeq,    "typeq",   "typeq",               2,  2, (BUILTIN_ANY),              LVAL_BOOL)   \
+    o(show,     "show",    "show",                1,  1, (BUILTIN_ANY),              LVAL_STR)    \
+    o(print,    "print",   "print",               0, -1, (BUILTIN_ANY),              LVAL_LIST)   \
+    o(println,  "println", "println",             0, -1, (BUILTIN_ANY),              LVAL_LIST)   \
+    o(error,    "error",   "error",               1,  1, (LVAL_STR),                 BUILTIN_ANY) \
+    o(cons,     "cons",    "cons",                2,  2, (BUILTIN_ANY, LVAL_LIST),   LVAL_LIST)   \
+    o(append,   "append",  "append",              0, -1, (LVAL_LIST),                LVAL_LIST)   \
+    o(length,   "length",  "length",              1,  1, (LVAL_LIST),                LVAL_NUM)    \
+    o(nth,      "nth",     "nth",                 2,  2, (LVAL_LIST, LVAL_NUM),      BUILTIN_ANY) \
+    o(reverse,  "reverse", "reverse",             1,  1, (LVAL_LIST),                LVAL_LIST)   \
+    o(element,  "element", "element",             2,  2, (BUILTIN_ANY, LVAL_LIST),   LVAL_BOOL)   \
+    o(map,      "map",     "map",                 1,  2, (BUILTIN_ANY, LVAL_LIST),   BUILTIN_ANY) \
+    o(filter,   "filter",  "filter",              1,  2, (BUILTIN_ANY, LVAL_LIST),   BUILTIN_ANY) \
+    o(foldl, "foldl", "foldl", 1, 3, (BUILTIN_ANY, BUILTIN_ANY, LVAL_LIST), BUILTIN_ANY)          \
+    o(sort,     "sort",    "sort",                1,  2, (LVAL_LIST, BUILTIN_ANY),   LVAL_LIST)   \
+    o(sorted_insert, "sorted-insert", "sorted-insert", 2, 3, (BUILTIN_ANY, LVAL_LIST, BUILTIN_ANY), LVAL_LIST) \
+    o(binary_search, "binary-search", "binary-search", 2, 3, (BUILTIN_ANY, LVAL_LIST, BUILTIN_ANY), LVAL_NUM) \
+    o(map_get,  "map-get", "map-get",             2,  3, (LVAL_MAP, BUILTIN_ANY),    BUILTIN_ANY) \
+    o(map_put,  "map-put", "map-put",             3,  3, (LVAL_MAP, BUILTIN_ANY),    LVAL_MAP)    \
+    o(map_del,  "map-del", "map-del",             2,  2, (LVAL_MAP, BUILTIN_ANY),    LVAL_MAP)    \
+    o(map_keys, "map-keys", "map-keys", 1, 1, (LVAL_MAP), LVAL_LIST)                              \
+    o(alist_to_map, "alist->map", "alist->map", 1, 1, (LVAL_LIST), LVAL_MAP)                      \
+    o(list_to_set, "list->set", "list->set", 1, 1, (LVAL_LIST), LVAL_SET)                         \
+    o(set_to_list, "set->list", "set->list", 1, 1, (LVAL_SET), LVAL_LIST)                         \
+    o(set_contains, "set-contains?", "set-contains?", 2, 2, (LVAL_SET, BUILTIN_ANY), LVAL_BOOL)   \
+    o(set_union, "set-union", "set-union", 1, -1, (LVAL_SET), LVAL_SET)                           \
+    o(set_intersection, "set-intersection", "set-intersection", 1, -1, (LVAL_SET), LVAL_SET)      \
+    o(set_difference, "set-difference", "set-difference", 1, -1, (LVAL_SET), LVAL_SET)            \
+    o(record_make, "__record-make", "record constructor", 1, -1, (BUILTIN_ANY), LVAL_RECORD)      \
+    o(record_get, "__record-get", "record accessor", 3, 3, (BUILTIN_ANY), BUILTIN_ANY)            \
+    o(record_set, "__record-set", "record modifier", 4, 4, (BUILTIN_ANY), LVAL_RECORD)            \
+    o(record_is, "__record-is", "record predicate", 2, 2, (BUILTIN_ANY), LVAL_BOOL)
+
+#define o(name, symbol, display, min, max, types, result)                \
+    lval* builtin_##name(lenv* e, lval* a);                               \
+    lval* builtin_##name##_argv(lenv* e, int argc, lval** argv);          \
+    lval* builtin_##name##_unchecked(lenv* e, int argc, lval** argv);
+    BUILTIN_SIGNATURES
+#undef o
+
+typedef struct builtin_signature
+{
+    lbuiltin_func func;
+    lbuiltin_argv_func unchecked;
+    int min;
+    int max;
+    const lval_type* types;
+    int typeCount;
+    lval_type result;
+} builtin_signature;
+
+// Returns NULL if 'func' has no signature
+const builtin_signature* builtin_signature_of(lbuiltin_func func);
+// Declared type of argument 'i'
+lval_type builtin_signature_type(const builtin_signature* sig, int i);
 
-lval* builtin_add(lenv* e, lval* a);
-lval* builtin_sub(lenv* e, lval* a);
-lval* builtin_div(lenv* e, lval* a);
-lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_eval(lenv* e, lval* a);
 
 lval* builtin_def(lenv* e, lval* a);
 lval* builtin_let(lenv* e, lval* a);
 lval* builtin_set(lenv* e, lval* a);
 
-lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_push(lenv* e, lval* a);
+lval* builtin_pop(lenv* e, lval* a);
+lval* builtin_set_nth(lenv* e, lval* a);
+lval* builtin_list_reserve(lenv* e, lval* a);
+lval* builtin_sb_append(lenv* e, lval* a);
+lval* builtin_sb_to_string(lenv* e, lval* a);
 
-lval* builtin_eq(lenv* e, lval* a);
-lval* builtin_less(lenv* e, lval* a);
-lval* builtin_not(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_defrecord(lenv* e, lval* a);
+lval* builtin_specialize(lenv* e, lval* a);
 
 lval* builtin_cond(lenv* e, lval* a);
+lval* builtin_case(lenv* e, lval* a);
 
-lval* builtin_show(lenv* e, lval* a);
-lval* builtin_print(lenv* e, lval* a);
-lval* builtin_println(lenv* e, lval* a);
-lval* builtin_error(lenv* e, lval* a);
+lval* builtin_while(lenv* e, lval* a);
+lval* builtin_dotimes(lenv* e, lval* a);
+lval* builtin_for_each(lenv* e, lval* a);
+// Like 'case', but the last argument is a Map from keys to indices of clauses
+lval* builtin_case_jump(lenv* e, lval* a);
+// Maps keys of 'clauses' to their indices, 'else' clause has key (). Returns
+// error or NULL
+lval* builtin_case_table(lval** clauses, unsigned count, hamt_node** table);
 
 lval* builtin_load_impl(lenv* e, lval* a, bool isMain);
 lval* builtin_load(lenv* e, lval* a);
 lval* builtin_exit(lenv* e, lval* a);
 
-lval* builtin_typeq(lenv* e, lval* a);
-
 lval* builtin_macro_internal(lenv* e, lval* a);
 lval* builtin_macroexpand(lenv* e, lval* a);
 
 void add_builtin(lenv* env, const char* name, lbuiltin_func func);
+void add_builtin_argv(lenv* env, const char* name, lbuiltin_func func,
+					  lbuiltin_argv_func argvFunc);
+void add_builtin_macro(lenv* env, const char* name, const char* builtin,
+					   const char** formals, unsigned count, int evaluated);
+
+// Calls 'func' with elements of owned list 'a'
+lval* builtin_call_argv(lenv* e, lbuiltin_argv_func func, lval* a);
+
 void add_builtins(lenv* e);
 
 #endif // LISPY_BUILTINS_H
@@ -50,5 +50,12 @@
 
 typedef struct lenv lenv;
 typedef struct lval lval;
+typedef struct jit_code jit_code;
+typedef struct opt_body opt_body;
+typedef struct opt_specialization opt_specialization;
+typedef struct lbig lbig;
+typedef struct hamt_node hamt_node;
+typedef struct lset lset;
+typedef struct lrope lrope;
 
 #endif // LISPY_COMMON_H
@@ -27,10 +27,23 @@
 
 #include <common.h>
 
+// Bindings of watched names are versioned: any change of a binding of such
+// name in any environment increments its version, except bindings of
+// parameters in fresh frames. Bindings in local frames are counted in
+// 'shadows', they may hide global bindings from callees
+typedef struct lenv_watched
+{
+	char* name;
+	unsigned long version;
+	unsigned shadows;
+} lenv_watched;
+
 typedef struct lenv_entry
 {
 	char* key;
 	lval* value;
+	// Not NULL for local bindings
+	lenv_watched* shadow;
 } lenv_entry;
 
 struct lenv
@@ -45,12 +58,25 @@ void  lenv_del(lenv* env);
 lenv* lenv_copy(lenv* env);
 
 lval* lenv_get(lenv* env, lval* key);
+// Returns borrowed value or NULL
+lval* lenv_lookup(lenv* env, lval* key);
+// Like 'lenv_lookup', but the value may be changed in place, so the binding
+// counts as changed
+lval* lenv_lookup_mut(lenv* env, lval* key);
 bool  lenv_set(lenv* env, lval* key, lval* value);
 
 void  lenv_put(lenv* env, lval* key, lval* value);
+// Binds parameter in a fresh frame, the version of the name is not changed
+void  lenv_bind(lenv* env, lval* key, lval* value);
 void  lenv_def(lenv* env, lval* key, lval* value);
 
 bool  lenv_put_new(lenv* env, lval* key, lval* value);
 bool  lenv_def_new(lenv* env, lval* key, lval* value);
 
+// Returned pointer is valid until the end of the program
+lenv_watched* lenv_watch(const char* name);
+// Returns true if 'name' is bound in a local frame of 'env', that is before
+// the global environment
+bool lenv_shadowed(lenv* env, const char* name);
+
 #endif // LISPY_ENVIRONMENT_H
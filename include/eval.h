@@ -33,8 +33,12 @@
 
 //lval* eval_lval_expr(lenv* env, lval* v);
 lval* eval_lval(lenv* env, lval* v);
+lval* eval_func_call(lenv* env, lval* func, lval* args);
+// Calls borrowed 'func' with borrowed arguments
+lval* eval_call_argv(lenv* env, lval* func, int argc, lval** argv);
 
 lval* eval_macro_expand(lval* macro, lval* args);
-void  eval_macro_replace(lval* expr, lval* formal, lval* actual);
+// Returns true, if 'expr' has changed
+bool  eval_macro_replace(lval* expr, lval* formal, lval* actual);
 
 #endif // LISPY_EVAL_H
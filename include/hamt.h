@@ -0,0 +1,62 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_HAMT_H
+#define LISPY_HAMT_H
+
+#include <common.h>
+
+#include <value.h>
+
+// Persistent hash array mapped trie, that stores values of Map type. Nodes
+// are immutable and shared between maps by reference counting, so copying a
+// map is O(1) and an update copies only the path to the changed entry. Every
+// level of the trie uses 5 bits of 32-bit hash, entries with equal hashes are
+// kept in collision nodes. NULL is the empty map. Sets are maps, where all
+// values are NULL.
+
+// Returns 'node'
+hamt_node* hamt_retain(hamt_node* node);
+void       hamt_release(hamt_node* node);
+
+unsigned   hamt_count(hamt_node* node);
+
+// Returns borrowed value or NULL
+lval*      hamt_get(hamt_node* node, lval* key);
+bool       hamt_contains(hamt_node* node, lval* key);
+
+// Return new trie, 'node' is borrowed. 'key' and 'value' are owned
+hamt_node* hamt_put(hamt_node* node, lval* key, lval* value);
+// 'key' is borrowed
+hamt_node* hamt_del(hamt_node* node, lval* key);
+
+typedef void (*hamt_func)(void* data, lval* key, lval* value);
+void       hamt_each(hamt_node* node, hamt_func func, void* data);
+
+bool          hamt_eq(hamt_node* a, hamt_node* b);
+// Doesn't depend on order of entries
+unsigned long hamt_hash(hamt_node* node);
+
+#endif // LISPY_HAMT_H
@@ -0,0 +1,45 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+
+#ifndef LISPY_HASHCONS_H
+#define LISPY_HASHCONS_H
+
+#include <common.h>
+
+#include <value.h>
+
+// Table of canonical Lists and Strings, used by the reader in --hash-cons
+// mode. Values can't share nodes, because they are copied, so interning
+// marks a value and its parts as copies of the canonical value with the
+// same hash. Equality of two marked values is then decided by the hashes.
+#define HASHCONS_INITIAL_CAPACITY 64
+
+// Marks 'v' and its parts, returns 'v'
+lval* hashcons_intern(lval* v);
+void  hashcons_free();
+
+#endif // LISPY_HASHCONS_H
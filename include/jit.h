@@ -0,0 +1,118 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_JIT_H
+#define LISPY_JIT_H
+
+#include <common.h>
+
+#include <value.h>
+#include <environment.h>
+
+// Template JIT for small numeric lambdas. Compiled code handles only Numbers
+// and Booleans, so on anything unexpected it gives up (deoptimizes) and the
+// call is evaluated by the interpreter as usual.
+
+#include <stdint.h>
+
+#if defined(LISPY_COMPILE_LINUX) && defined(__x86_64__)
+#define LISPY_JIT_SUPPORTED
+#endif
+
+#define JIT_DEFAULT_THRESHOLD 50
+#define JIT_MAX_ARGS 16
+
+#define JIT_STACK_EXHAUSTED()										\
+	((uintptr_t) __builtin_frame_address(0) < jitStackLimit)
+
+// Native function sets jitDeopt, when result should be computed by interpreter
+typedef long (*jit_entry)(long* args);
+
+typedef enum
+{
+	JIT_KIND_NUM,
+	JIT_KIND_BOOL
+} jit_kind;
+
+typedef enum
+{
+	JIT_CONST,
+	JIT_ARG,
+	JIT_ADD,
+	JIT_SUB,
+	JIT_MUL,
+	JIT_DIV,
+	JIT_NEG,
+	JIT_LESS,
+	JIT_EQ,
+	JIT_NOT,
+	JIT_COND,
+	JIT_SEQ,
+	JIT_SELF
+} jit_op;
+
+typedef struct jit_node
+{
+	jit_op op;
+	jit_kind kind;
+	long value;
+	unsigned count;
+	struct jit_node** children;
+} jit_node;
+
+// Compiled code is valid only while these symbols are bound to the same values.
+// 'expected' is NULL for the function itself
+typedef struct jit_guard
+{
+	lval* key;
+	lval* expected;
+} jit_guard;
+
+typedef struct jit_function
+{
+	jit_node* body;
+	jit_kind result;
+	unsigned guardCount;
+	jit_guard* guards;
+} jit_function;
+
+// Accessed by native code
+extern volatile unsigned char jitDeopt;
+extern uintptr_t jitStackLimit;
+
+// Returns NULL if the lambda can't be compiled
+jit_function* jit_analyze_function(lenv* env, lval* func);
+void          jit_function_del(jit_function* function);
+
+// Uses code compiled ahead of time for 'func'. 'guards' is NULL-terminated
+void  jit_attach(lenv* env, lval* func, jit_entry entry, jit_kind result,
+				 const char* const* guards);
+
+// Returns NULL if the call should be interpreted.
+// Doesn't take ownership of 'func' and 'args'.
+lval* jit_try_call(lenv* env, lval* func, lval* args);
+void  jit_free(jit_code* code);
+
+#endif // LISPY_JIT_H
@@ -0,0 +1,92 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_OPTIMIZER_H
+#define LISPY_OPTIMIZER_H
+
+#include <common.h>
+
+#include <value.h>
+#include <environment.h>
+#include <recursion.h>
+
+// Lambda bodies are optimized before evaluation: macros are expanded, calls of
+// pure builtins on literals are folded, unreachable 'cond' clauses are removed
+// and small global lambdas are inlined. Keys of 'case' are compiled into jump
+// tables. Calls with constant leading arguments
+// are specialized. Optimized body depends on bindings of symbols used in it, so it is
+// guarded by versions of these bindings (see lenv_watch). Calls, where some of
+// them are shadowed by local bindings, evaluate the original body.
+
+#define OPTIMIZER_THRESHOLD 2
+#define OPTIMIZER_MAX_RETRIES 8
+#define OPTIMIZER_MAX_DEPTH 64
+#define OPTIMIZER_INLINE_THRESHOLD 16
+#define OPTIMIZER_MAX_SPECIALIZATIONS 8
+
+typedef struct opt_guard
+{
+	lenv_watched* binding;
+	unsigned long expected;
+} opt_guard;
+
+struct opt_body
+{
+	lval* body;
+	unsigned guardCount;
+	opt_guard* guards;
+	rec_loop* loop;
+	unsigned refs;
+};
+
+// Lambda with leading formals bound to constant arguments
+struct opt_specialization
+{
+	lval* args;
+	lval* residual;
+	bool useful;
+	struct opt_specialization* next;
+};
+
+// Returns borrowed body, that should be evaluated in 'env' instead of
+// 'func->body'
+lval* optimizer_body(lenv* env, lval* func);
+void  optimizer_free(opt_body* body);
+
+// Evaluates body of 'func' in 'env', linear recursion is evaluated by a loop
+lval* optimizer_eval(lenv* env, lval* func);
+
+bool optimizer_is_pure(lbuiltin_func func);
+bool optimizer_uses_env(lbuiltin_func func);
+// 'case' evaluates its clauses, but not keys
+bool optimizer_is_case(lbuiltin_func func);
+
+// Returns residual lambda of 'func' specialized on 'args' or NULL, if 'func'
+// has too many specializations. Takes ownership of 'args'. 'useful' is set if
+// constants allow to optimize the body
+lval* optimizer_specialize(lenv* env, lval* func, lval* args, bool* useful);
+void  optimizer_free_specializations(opt_specialization* spec);
+
+#endif // LISPY_OPTIMIZER_H
@@ -41,9 +41,11 @@
     middle(number, "/-?[0-9]+/")                         \
     middle(symbol, "/[a-zA-Z0-9_+\\-*\\/\\\\=<>!?&]+/")  \
     middle(string, "/\"(\\\\.|[^\"])*\"/")               \
+    middle(character, "/#\\\\(space|newline|tab|.)/")      \
     middle(list, "'(' <expr>* ')'")                      \
     middle(quote, " '\'' <expr> ")                       \
-    middle(expr, "<string> | <number> | <symbol> "       \
+    middle(expr, "<string> | <character> | <number> "   \
+                 "| <symbol> "                           \
                  "| <list> | <comment> | <quote>")       \
     last(lispy, "/^/ <expr>* /$/")
 
@@ -0,0 +1,48 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_RECURSION_H
+#define LISPY_RECURSION_H
+
+#include <common.h>
+
+#include <value.h>
+#include <environment.h>
+
+// Linear recursion, like (+ (head l) (sum (tail l))), is evaluated by a loop:
+// operands of pending operations are saved in accumulators (when operation is
+// +, *, join or joinstr) or on explicit stack, so deep recursion doesn't
+// exhaust the C stack.
+
+typedef struct rec_loop rec_loop;
+
+// Returns NULL if optimized 'body' of 'func' is not a linear recursion
+rec_loop* recursion_analyze(lenv* env, lval* func, lval* body);
+void      recursion_free(rec_loop* loop);
+
+// 'env' is the frame of the call with bound formals
+lval* recursion_run(lenv* env, rec_loop* loop);
+
+#endif // LISPY_RECURSION_H
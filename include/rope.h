@@ -0,0 +1,84 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_ROPE_H
+#define LISPY_ROPE_H
+
+#include <common.h>
+
+// Long strings built by concatenation are kept as ropes: balanced trees,
+// whose leaves refer to parts of shared texts. Concatenation and substring
+// take O(log n) and share the unchanged subtrees. Ropes are immutable and
+// shared between copies by reference counting, only flattening replaces a
+// node with one leaf of the same content.
+
+// Strings shorter than that are not made ropes
+#define ROPE_MIN_LENGTH 512
+// Adjacent leaves are merged while they fit into that
+#define ROPE_LEAF_LENGTH 128
+
+// Null-terminated text, that leaves refer to
+typedef struct rope_text
+{
+	unsigned refs;
+	size_t length;
+	char* chars;
+} rope_text;
+
+struct lrope
+{
+	unsigned refs;
+	// 0 for leaves
+	unsigned depth;
+	size_t length;
+
+	// Leaves refer to 'length' bytes of 'text' from 'offset'
+	rope_text* text;
+	size_t offset;
+
+	// Children of inner nodes
+	lrope* left;
+	lrope* right;
+};
+
+// Takes ownership of null-terminated 'chars' of 'length' bytes
+lrope* rope_new(char* chars, size_t length);
+// Copies 'length' bytes of 'chars'
+lrope* rope_new_copy(const char* chars, size_t length);
+// Returns 'rope'
+lrope* rope_retain(lrope* rope);
+void   rope_release(lrope* rope);
+
+// Takes ownership of both ropes
+lrope* rope_concat(lrope* a, lrope* b);
+// Borrows 'rope', returns bytes from 'start' to 'end'
+lrope* rope_substring(lrope* rope, size_t start, size_t end);
+
+// Copies the text into 'out' without the null terminator
+void  rope_write(lrope* rope, char* out);
+// Returns the null-terminated text, turning 'rope' into a leaf
+char* rope_flatten(lrope* rope);
+
+#endif // LISPY_ROPE_H
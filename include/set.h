@@ -0,0 +1,66 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#ifndef LISPY_SET_H
+#define LISPY_SET_H
+
+#include <common.h>
+
+#include <value.h>
+#include <hamt.h>
+
+// Immutable set of values, shared between copies by reference counting.
+// Elements are kept in a HAMT with NULL values. Numbers from 0 to 255 and
+// strings of one byte are also marked in dense bitmaps, so testing them
+// doesn't need hashing.
+#define SET_BITMAP_SIZE 256
+
+struct lset
+{
+	unsigned refs;
+	hamt_node* elements;
+	uint64_t nums[SET_BITMAP_SIZE / 64];
+	uint64_t chars[SET_BITMAP_SIZE / 64];
+};
+
+// Takes ownership of 'elements'
+lset* set_new(hamt_node* elements);
+// Returns 'set'
+lset* set_retain(lset* set);
+void  set_release(lset* set);
+
+unsigned set_count(lset* set);
+bool     set_contains(lset* set, lval* x);
+
+// Return new sets, arguments are borrowed
+lset* set_union(lset* a, lset* b);
+lset* set_intersection(lset* a, lset* b);
+lset* set_difference(lset* a, lset* b);
+
+bool          set_eq(lset* a, lset* b);
+unsigned long set_hash(lset* set);
+
+#endif // LISPY_SET_H
@@ -0,0 +1,59 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef LISPY_SORT_H
+#define LISPY_SORT_H
+
+#include <common.h>
+
+#include <value.h>
+#include <environment.h>
+
+// Stable merge sort of values. Without comparator numbers and strings are
+// sorted in ascending order: lists of fixnums and of strings compare unboxed
+// keys and are sorted by several threads when they are large. Comparator is
+// called as (less a b) and must return a Boolean.
+
+#if defined(LISPY_COMPILE_LINUX) || defined(LISPY_COMPILE_OSX)
+#define LISPY_THREADS_SUPPORTED
+#endif
+
+// Lists shorter than this are sorted by one thread
+#define SORT_PARALLEL_THRESHOLD 65536
+
+// 'less' may be NULL. Returns NULL or an error, 'name' is used in errors
+lval* sort_cells(lenv* env, lval** cells, unsigned count, lval* less, const char* name);
+// Packed lists are sorted without boxing, unless 'less' is given
+lval* sort_list(lenv* env, lval* lst, lval* less, const char* name);
+
+// Index of the first element of sorted 'lst', that is greater than 'x' when
+// 'upper' is set, or not less than 'x' otherwise. Returns NULL or an error
+lval* sort_bound(lenv* env, lval* lst, lval* x, lval* less,
+				 bool upper, const char* name, unsigned* index);
+
+// Returns NULL or an error, 'res' is set to (less a b)
+lval* sort_less(lenv* env, lval* a, lval* b, lval* less, const char* name, bool* res);
+
+#endif // LISPY_SORT_H
@@ -26,6 +26,7 @@
 #define LISPY_VALUE_H
 
 #include <common.h>
+#include <bignum.h>
 
 #include <mpc/mpc.h>
 
@@ -40,31 +41,120 @@ typedef enum
     LVAL_BUILTIN,
     LVAL_MACRO,
     LVAL_STR,
-    LVAL_BOOL
+    LVAL_BOOL,
+    LVAL_MAP,
+    LVAL_SET,
+    LVAL_RECORD,
+    LVAL_CHAR,
+    LVAL_BUILDER
 } lval_type;
 
 const char* lval_type_str(lval_type type);
 
 typedef lval* (*lbuiltin_func)(lenv* env, lval* args);
 
+// Arguments are borrowed from the evaluation stack. Builtin may take ownership
+// of an argument by replacing it with NULL
+typedef lval* (*lbuiltin_argv_func)(lenv* env, int argc, lval** argv);
+
+// Storage of list elements. Lists of fixnums and of characters may be packed, adding other values converts them to cells
+typedef enum
+{
+    LIST_CELLS,
+    LIST_NUMS,
+    LIST_BYTES
+} list_strategy;
+
+// Shared between all copies of one lambda
+typedef struct lambda_info
+{
+    unsigned refs;
+    unsigned long calls;
+    jit_code* jit;
+    bool jitFailed;
+    unsigned optCalls;
+    unsigned optRetries;
+    opt_body* optimized;
+    lval* constants;
+    opt_specialization* specializations;
+    // Body compiled ahead of time to C (see aot.h), NULL if there is none
+    lval* (*aot)(lenv* env);
+} lambda_info;
+
+lambda_info* lambda_info_new();
+lambda_info* lambda_info_retain(lambda_info* info);
+void         lambda_info_release(lambda_info* info);
+
+// Set in 'hash' of hash-consed values (see hashcons.h)
+#define LVAL_HASH_CONSED 0x80000000u
+
 struct lval
 {
     lval_type type;
+    // Cached hash of Lists and Strings, 0 until 'lval_hash' computes it.
+    // Changing a List or a String in place must reset it
+    unsigned hash;
 
     union
     {
-        long num;
+        // 'big' is set only for numbers, that don't fit into 'num'
+        struct
+        {
+            long num;
+            lbig* big;
+        };
+
         char* err;
         char* sym;
-        char* str;
+
+        // Long strings built by concatenation are ropes: 'str' is NULL until
+        // the rope is flattened and points into the rope after that
+        struct
+        {
+            char* str;
+            lrope* rope;
+        };
+
+        char ch;
         lval* quoted;
         bool boolean;
-        lbuiltin_func builtin;
+        hamt_node* map;
+        lset* set;
 
+        struct
+        {
+            lbuiltin_func builtin;
+            lbuiltin_argv_func argvBuiltin;
+        };
+
+        // 'capacity' is the count of allocated elements, it's at least 'count'
         struct
         {
             unsigned count;
-            struct lval** cells;
+            unsigned capacity;
+            union
+            {
+                struct lval** cells;
+                long* nums;
+                unsigned char* bytes;
+            };
+            list_strategy strategy;
+        };
+
+        // String builder, 'sbText' is NULL or a null-terminated buffer of
+        // 'sbCapacity' bytes
+        struct
+        {
+            char* sbText;
+            size_t sbLength;
+            size_t sbCapacity;
+        };
+
+        // Count of slots is stored in the record type
+        struct
+        {
+            unsigned recordType;
+            lval** slots;
         };
 
         struct
@@ -72,6 +162,7 @@ struct lval
             lenv* env;
             lval* formals;
             lval* body;
+            lambda_info* info;
         };
     };
 };
@@ -86,32 +177,100 @@ struct lval
 #define IS_BOOL(val)    (val->type == LVAL_BOOL)
 #define IS_QUOTE(val)   (val->type == LVAL_QUOTE)
 #define IS_MACRO(val)   (val->type == LVAL_MACRO)
+#define IS_MAP(val)     (val->type == LVAL_MAP)
+#define IS_SET(val)     (val->type == LVAL_SET)
+#define IS_RECORD(val)  (val->type == LVAL_RECORD)
+#define IS_CHAR(val)    (val->type == LVAL_CHAR)
+#define IS_BUILDER(val) (val->type == LVAL_BUILDER)
 
 lval* lval_num(long x);
+// Takes ownership of 'x', the result is a fixnum if 'x' fits into long
+lval* lval_num_big(lbig* x);
 lval* lval_bool(bool x);
 lval* lval_err(const char* fmt, ...);
 lval* lval_verr(const char* fmt, va_list lst);
 lval* lval_sym(const char* sym);
 lval* lval_str(const char* str);
 lval* lval_str_null();
+// Copies 'length' bytes of 'str'
+lval* lval_str_n(const char* str, size_t length);
+// Takes ownership of 'rope', short ropes are flattened into plain strings
+lval* lval_str_rope(lrope* rope);
 lval* lval_str_char(const char ch);
+lval* lval_char(char ch);
 lval* lval_list();
 lval* lval_quote(lval* x);
 lval* lval_lambda(lenv* env, lval* formals, lval* body);
 lval* lval_macro(lval* formals, lval* body);
 lval* lval_builtin(lbuiltin_func func);
+lval* lval_builtin_argv(lbuiltin_func func, lbuiltin_argv_func argvFunc);
+// Takes ownership of 'map'
+lval* lval_map(hamt_node* map);
+// Takes ownership of 'set'
+lval* lval_set(lset* set);
+// Slots are NULL
+lval* lval_record(unsigned recordType);
+lval* lval_builder();
 
 lval* lval_copy(lval* a);
 void  lval_del(lval* v);
+// Calls 'visit' for 'v' and values nested into it through Lists, Quotes and
+// Records, nested values are visited first
+void  lval_walk(lval* v, void (*visit)(lval*));
+
+// Strategy, that can store 'x' unboxed, or LIST_CELLS
+list_strategy list_strategy_of(lval* x);
+// Converts packed elements to cells. Code, that reads 'cells' of lists, that
+// may be built at runtime, must call it first
+lval* list_generalize(lval* v);
+// Generalizes nested lists too
+lval* list_generalize_deep(lval* v);
+size_t list_elem_size(lval* v);
 
 lval* list_add(lval* v, lval* x);
+// Unlike 'list_add' packs elements added to an empty list
+lval* list_insert(lval* v, unsigned i, lval* x);
+// Replaces element 'i' with 'x'
+lval* list_set(lval* v, unsigned i, lval* x);
+// Makes room for at least 'count' elements without reallocation
+lval* list_reserve(lval* v, unsigned count);
 lval* list_take(lval* v, unsigned i);
 lval* list_pop(lval* v, unsigned i);
 lval* list_join(lval* x, lval* y);
+lval* list_reverse(lval* v);
 lval* list_to_str(lval* v);
+lval* map_to_str(lval* v);
+lval* set_to_str(lval* v);
+lval* record_to_str(lval* v);
+
+// Capacity of string builders grows by doubling
+void  builder_append(lval* v, const char* str, size_t length);
+// Makes room for 'length' more bytes and returns the end of the text
+char* builder_reserve(lval* v, size_t length);
+// Moves the text into a new String and empties the builder
+lval* builder_take(lval* v);
 
 lval* lval_unquote(lval* a);
+// Characters are equal to one-character strings
 bool  lval_eq(lval* a, lval* b);
+// Equal values have equal hashes, hashes of Lists, Strings and Characters
+// are 31 bits, so they fit into the cache
+unsigned long lval_hash(lval* v);
+
+// Borrowed element 'i', packed elements are stored into 'view'
+lval* list_peek(lval* v, unsigned i, lval* view);
+
+int         lval_num_cmp(lval* a, lval* b);
+// Bignum value of number 'x', fixnums are stored into 'view'
+const lbig* lval_num_bignum(lval* x, lbig* view, uint32_t digits[BIGNUM_LONG_DIGITS]);
+
+// Text of a String or a Character, characters are stored into 'buf'
+const char* lval_text(lval* x, char buf[2]);
+// Text of a String, ropes are flattened in place
+char*  lval_str_flat(lval* v);
+size_t lval_str_length(lval* v);
+// Bytes from 'start' to 'end' of String 'v', substrings of ropes are ropes
+lval*  lval_str_sub(lval* v, size_t start, size_t end);
 
 lval* lval_to_str(lval* a);
 void  lval_print(lval* v);
@@ -0,0 +1,1263 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <aot.h>
+
+#include <eval.h>
+#include <builtins.h>
+#include <parser.h>
+#include <reader.h>
+#include <optimizer.h>
+
+typedef struct aot_buffer
+{
+	char* str;
+	size_t length;
+	size_t capacity;
+} aot_buffer;
+
+// Macros are expanded during compilation up to this depth
+#define AOT_MAX_EXPANSIONS 64
+// Half of the usual stack of the main thread
+#define AOT_STACK_BUDGET (4 * 1024 * 1024)
+
+uintptr_t aotStackLimit = 0;
+
+// Global environment of the compiled program
+static lenv* globalEnv = NULL;
+
+typedef struct aot_compiler
+{
+	lenv* env;
+	aot_buffer natives;
+	aot_buffer statics;
+	aot_buffer forms;
+	aot_buffer functions;
+	aot_buffer files;
+	unsigned nativeCount;
+	unsigned formCount;
+	unsigned fileCount;
+	unsigned topCount;
+	unsigned guardCount;
+	// Names of global slots
+	lval* globals;
+	// Parameters and bodies of compiled lambdas: ((formals body) ...)
+	lval* lambdas;
+	unsigned depth;
+} aot_compiler;
+
+typedef struct aot_function
+{
+	aot_buffer code;
+	unsigned values;
+	unsigned callees;
+	unsigned tests;
+	// NULL for top-level forms
+	lval* formals;
+} aot_function;
+
+typedef struct aot_native
+{
+	aot_buffer code;
+	unsigned index;
+	unsigned temps;
+	bool hasTailCall;
+} aot_native;
+
+void aot_printf(aot_buffer* b, const char* fmt, ...)
+{
+	va_list lst;
+	va_start(lst, fmt);
+	int length = vsnprintf(NULL, 0, fmt, lst);
+	va_end(lst);
+
+	if (b->length + length + 1 > b->capacity)
+	{
+		b->capacity = (b->length + length + 1) * 2;
+		b->str = realloc(b->str, b->capacity);
+		DIE_IF_NULL(b->str);
+	}
+
+	va_start(lst, fmt);
+	vsnprintf(b->str + b->length, length + 1, fmt, lst);
+	va_end(lst);
+
+	b->length += length;
+}
+
+const char* aot_buffer_str(aot_buffer* b)
+{
+	return b->str == NULL ? "" : b->str;
+}
+
+void aot_emit_string(aot_buffer* b, const char* str)
+{
+	aot_printf(b, "\"");
+
+	for (const unsigned char* c = (const unsigned char*) str; *c != '\0'; c++)
+	{
+		switch (*c)
+		{
+		case '\\': aot_printf(b, "\\\\"); break;
+		case '"':  aot_printf(b, "\\\""); break;
+		case '\n': aot_printf(b, "\\n");  break;
+		case '\t': aot_printf(b, "\\t");  break;
+		case '\r': aot_printf(b, "\\r");  break;
+		default:
+			if (*c < ' ' || *c >= 127) aot_printf(b, "\\%03o", *c);
+			else aot_printf(b, "%c", *c);
+		}
+	}
+
+	aot_printf(b, "\"");
+}
+
+void aot_emit_value(aot_buffer* b, lval* v)
+{
+	switch (v->type)
+	{
+	case LVAL_NUM:
+		if (v->big != NULL)
+		{
+			char* str = bignum_to_str(v->big);
+			aot_printf(b, "lval_num_big(bignum_parse(\"%s\"))", str);
+			free(str);
+		}
+		else if (v->num == LONG_MIN) aot_printf(b, "lval_num(LONG_MIN)");
+		else aot_printf(b, "lval_num(%ldL)", v->num);
+		break;
+	case LVAL_BOOL:
+		aot_printf(b, "lval_bool(%s)", v->boolean ? "true" : "false");
+		break;
+	case LVAL_SYM:
+		aot_printf(b, "lval_sym(");
+		aot_emit_string(b, v->sym);
+		aot_printf(b, ")");
+		break;
+	case LVAL_STR:
+		aot_printf(b, "lval_str(");
+		aot_emit_string(b, lval_str_flat(v));
+		aot_printf(b, ")");
+		break;
+	case LVAL_CHAR:
+		aot_printf(b, "lval_char(%d)", v->ch);
+		break;
+	case LVAL_ERR:
+		aot_printf(b, "lval_err(\"%%s\", ");
+		aot_emit_string(b, v->err);
+		aot_printf(b, ")");
+		break;
+	case LVAL_QUOTE:
+		aot_printf(b, "lval_quote(");
+		aot_emit_value(b, v->quoted);
+		aot_printf(b, ")");
+		break;
+	case LVAL_LIST:
+		if (v->count == 0)
+		{
+			aot_printf(b, "lval_list()");
+			break;
+		}
+
+		if (v->strategy != LIST_CELLS)
+		{
+			lval* cells = list_generalize(lval_copy(v));
+			aot_emit_value(b, cells);
+			lval_del(cells);
+			break;
+		}
+
+		aot_printf(b, "aot_list(%u", v->count);
+		for (unsigned i = 0; i < v->count; i++)
+		{
+			aot_printf(b, ", ");
+			aot_emit_value(b, v->cells[i]);
+		}
+		aot_printf(b, ")");
+		break;
+	default:
+		// Reader doesn't produce other values
+		assert(false);
+	}
+}
+
+unsigned aot_emit_node(aot_native* n, jit_node* node, bool tail);
+
+void aot_emit_arith(aot_native* n, jit_node* node, unsigned res, const char* builtin)
+{
+	unsigned a = aot_emit_node(n, node->children[0], false);
+	unsigned b = aot_emit_node(n, node->children[1], false);
+	aot_printf(&n->code, "\tif (__builtin_%s_overflow(t%u, t%u, &t%u)) goto bailout;\n",
+			   builtin, a, b, res);
+}
+
+unsigned aot_emit_node(aot_native* n, jit_node* node, bool tail)
+{
+	unsigned res = n->temps++;
+
+	switch (node->op)
+	{
+	case JIT_CONST:
+		if (node->value == LONG_MIN) aot_printf(&n->code, "\tt%u = LONG_MIN;\n", res);
+		else aot_printf(&n->code, "\tt%u = %ldL;\n", res, node->value);
+		break;
+
+	case JIT_ARG:
+		aot_printf(&n->code, "\tt%u = args[%ld];\n", res, node->value);
+		break;
+
+	case JIT_ADD: aot_emit_arith(n, node, res, "add"); break;
+	case JIT_SUB: aot_emit_arith(n, node, res, "sub"); break;
+	case JIT_MUL: aot_emit_arith(n, node, res, "mul"); break;
+
+	case JIT_DIV:
+	{
+		unsigned a = aot_emit_node(n, node->children[0], false);
+		unsigned b = aot_emit_node(n, node->children[1], false);
+		aot_printf(&n->code, "\tif (t%u == 0 || (t%u == -1 && t%u == LONG_MIN)) goto bailout;\n",
+				   b, b, a);
+		aot_printf(&n->code, "\tt%u = t%u / t%u;\n", res, a, b);
+		break;
+	}
+
+	case JIT_NEG:
+	{
+		unsigned a = aot_emit_node(n, node->children[0], false);
+		aot_printf(&n->code, "\tif (t%u == LONG_MIN) goto bailout;\n", a);
+		aot_printf(&n->code, "\tt%u = -t%u;\n", res, a);
+		break;
+	}
+
+	case JIT_LESS:
+	case JIT_EQ:
+	{
+		unsigned a = aot_emit_node(n, node->children[0], false);
+		unsigned b = aot_emit_node(n, node->children[1], false);
+		aot_printf(&n->code, "\tt%u = t%u %s t%u;\n", res, a,
+				   node->op == JIT_LESS ? "<" : "==", b);
+		break;
+	}
+
+	case JIT_NOT:
+	{
+		unsigned a = aot_emit_node(n, node->children[0], false);
+		aot_printf(&n->code, "\tt%u = !t%u;\n", res, a);
+		break;
+	}
+
+	case JIT_COND:
+		for (unsigned i = 0; i < node->count; i += 2)
+		{
+			unsigned test = aot_emit_node(n, node->children[i], false);
+			aot_printf(&n->code, "\tif (t%u)\n\t{\n", test);
+			unsigned x = aot_emit_node(n, node->children[i + 1], tail);
+			aot_printf(&n->code, "\tt%u = t%u;\n\t}\n\telse\n\t{\n", res, x);
+		}
+
+		// No clause was chosen, the result is ()
+		aot_printf(&n->code, "\tgoto bailout;\n");
+		for (unsigned i = 0; i < node->count; i += 2)
+			aot_printf(&n->code, "\t}\n");
+		break;
+
+	case JIT_SEQ:
+		for (unsigned i = 0; i < node->count; i++)
+		{
+			unsigned x = aot_emit_node(n, node->children[i], tail && i == node->count - 1);
+			if (i == node->count - 1)
+				aot_printf(&n->code, "\tt%u = t%u;\n", res, x);
+		}
+		break;
+
+	case JIT_SELF:
+	{
+		unsigned* args = malloc(sizeof(unsigned) * node->count);
+		DIE_IF_NULL(args);
+		for (unsigned i = 0; i < node->count; i++)
+			args[i] = aot_emit_node(n, node->children[i], false);
+
+		if (tail)
+		{
+			for (unsigned i = 0; i < node->count; i++)
+				aot_printf(&n->code, "\targs[%u] = t%u;\n", i, args[i]);
+			aot_printf(&n->code, "\tgoto body;\n");
+			n->hasTailCall = true;
+		}
+		else
+		{
+			aot_printf(&n->code, "\t{\n\t\tlong a[] = { ");
+			for (unsigned i = 0; i < node->count; i++)
+				aot_printf(&n->code, i == 0 ? "t%u" : ", t%u", args[i]);
+			aot_printf(&n->code, " };\n\t\tt%u = native_%u(a);\n\t}\n", res, n->index);
+			aot_printf(&n->code, "\tif (jitDeopt) goto bailout;\n");
+		}
+
+		free(args);
+		break;
+	}
+	}
+
+	return res;
+}
+
+void aot_emit_native(aot_compiler* c, aot_buffer* file, const char* name,
+					 jit_function* function)
+{
+	aot_native n;
+	n.code.str = NULL;
+	n.code.length = n.code.capacity = 0;
+	n.index = c->nativeCount++;
+	n.temps = 0;
+	n.hasTailCall = false;
+
+	unsigned res = aot_emit_node(&n, function->body, true);
+
+	aot_printf(&c->natives, "// %s\nstatic long native_%u(long* args)\n{\n", name, n.index);
+	for (unsigned i = 0; i < n.temps; i++)
+		aot_printf(&c->natives, "\tlong t%u = 0;\n", i);
+	aot_printf(&c->natives, "\n\tif (JIT_STACK_EXHAUSTED()) goto bailout;\n");
+	if (n.hasTailCall)
+		aot_printf(&c->natives, "body:\n");
+	aot_printf(&c->natives, "%s", aot_buffer_str(&n.code));
+	aot_printf(&c->natives, "\treturn t%u;\n\nbailout:\n\tjitDeopt = 1;\n\treturn 0;\n}\n\n", res);
+
+	aot_printf(&c->natives, "static const char* const guards_%u[] = { ", n.index);
+	for (unsigned i = 0; i < function->guardCount; i++)
+	{
+		aot_emit_string(&c->natives, function->guards[i].key->sym);
+		aot_printf(&c->natives, ", ");
+	}
+	aot_printf(&c->natives, "NULL };\n\n");
+
+	aot_printf(file, "\taot_attach(env, ");
+	aot_emit_string(file, name);
+	aot_printf(file, ", native_%u, %s, guards_%u);\n", n.index,
+			   function->result == JIT_KIND_BOOL ? "JIT_KIND_BOOL" : "JIT_KIND_NUM", n.index);
+
+	free(n.code.str);
+}
+
+// Returns defined symbol, if 'form' is a definition, or NULL
+lval* aot_definition(lenv* env, lval* form)
+{
+	lval* expr = lval_copy(form);
+	lval* name = NULL;
+
+	while (IS_LIST(expr) && expr->count > 1 && IS_SYM(expr->cells[0]))
+	{
+		lval* head = lenv_lookup(env, expr->cells[0]);
+		if (head == NULL) break;
+
+		if (IS_BUILTIN(head) && head->builtin == builtin_def)
+		{
+			if (expr->count == 3 && IS_QUOTE(expr->cells[1]) && IS_SYM(expr->cells[1]->quoted))
+				name = lval_copy(expr->cells[1]->quoted);
+			break;
+		}
+
+		if (!IS_MACRO(head)) break;
+
+		lval* macro = lval_copy(head);
+		lval_del(list_pop(expr, 0));
+		lval* expanded = eval_macro_expand(macro, expr);
+		lval_del(macro);
+		lval_del(expr);
+		expr = expanded;
+	}
+
+	lval_del(expr);
+	return name;
+}
+
+lval* aot_parse_file(const char* fileName)
+{
+	mpc_result_t r;
+	if (mpc_parse_contents(fileName, (mpc_parser_t*) get_parser_lispy(), &r))
+	{
+		lval* expr = read_lval(r.output);
+		mpc_ast_delete(r.output);
+		return expr;
+	}
+
+	char* errMsg = mpc_err_string(r.error);
+	mpc_err_delete(r.error);
+	errMsg[strlen(errMsg) - 1] = '\0';
+	lval* err = lval_err("could not load file '%s'", errMsg);
+	free(errMsg);
+	return err;
+}
+
+bool aot_is_load(lenv* env, lval* form)
+{
+	if (!IS_LIST(form) || form->count != 2 || !IS_SYM(form->cells[0])
+		|| !IS_STR(form->cells[1]))
+		return false;
+
+	lval* head = lenv_lookup(env, form->cells[0]);
+	return head != NULL && IS_BUILTIN(head) && head->builtin == builtin_load;
+}
+
+lval* aot_compile_file(aot_compiler* c, const char* fileName, bool isMain, unsigned* id);
+unsigned aot_compile(aot_compiler* c, aot_function* f, lval* expr);
+
+// Data of the form for interpreter, when compiled code can't be used
+unsigned aot_form(aot_compiler* c, lval* form)
+{
+	unsigned index = c->formCount++;
+	aot_printf(&c->forms, "static lval* form_%u(void)\n{\n\treturn ", index);
+	aot_emit_value(&c->forms, form);
+	aot_printf(&c->forms, ";\n}\n\n");
+	return index;
+}
+
+unsigned aot_global_slot(aot_compiler* c, const char* name)
+{
+	for (unsigned i = 0; i < c->globals->count; i++)
+		if (strcmp(c->globals->cells[i]->sym, name) == 0) return i;
+
+	list_add(c->globals, lval_sym(name));
+	return c->globals->count - 1;
+}
+
+bool aot_is_param(aot_function* f, lval* sym)
+{
+	if (f->formals == NULL) return false;
+
+	for (unsigned i = 0; i < f->formals->count; i++)
+		if (strcmp(f->formals->cells[i]->sym, sym->sym) == 0) return true;
+	return false;
+}
+
+// Values, that the reader produces, can be written as C
+bool aot_emittable(lval* v)
+{
+	switch (v->type)
+	{
+	case LVAL_NUM:
+	case LVAL_BOOL:
+	case LVAL_SYM:
+	case LVAL_STR:
+	case LVAL_CHAR:
+	case LVAL_ERR:
+		return true;
+	case LVAL_QUOTE:
+		return aot_emittable(v->quoted);
+	case LVAL_LIST:
+		if (v->strategy != LIST_CELLS) return true;
+		for (unsigned i = 0; i < v->count; i++)
+			if (!aot_emittable(v->cells[i])) return false;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Parameters of a lambda are symbols, '&' may precede the last one
+bool aot_proper_formals(lval* formals)
+{
+	if (formals->strategy != LIST_CELLS) return formals->count == 0;
+
+	for (unsigned i = 0; i < formals->count; i++)
+	{
+		if (!IS_SYM(formals->cells[i])) return false;
+		if (strcmp(formals->cells[i]->sym, "&") == 0 && !(formals->count == 3 && i == 1))
+			return false;
+	}
+	return true;
+}
+
+bool aot_has_rest(lval* formals)
+{
+	for (unsigned i = 0; i < formals->count; i++)
+		if (strcmp(formals->cells[i]->sym, "&") == 0) return true;
+	return false;
+}
+
+// Returns index of compiled body of 'func', if it can be called directly with
+// 'argc' arguments, or -1
+int aot_native_index(aot_compiler* c, lval* func, unsigned argc)
+{
+	if (!IS_LAMBDA(func) || func->env->count != 0 || func->formals->count != argc
+		|| aot_has_rest(func->formals))
+		return -1;
+
+	for (unsigned i = 0; i < c->lambdas->count; i++)
+	{
+		lval* lambda = c->lambdas->cells[i];
+		if (lval_eq(lambda->cells[0], func->formals) && lval_eq(lambda->cells[1], func->body))
+			return i;
+	}
+
+	return -1;
+}
+
+void aot_emit_function(aot_compiler* c, const char* kind, unsigned index, aot_function* f,
+					   unsigned res)
+{
+	aot_printf(&c->functions, "static lval* %s_%u(lenv* env)\n{\n", kind, index);
+
+	for (unsigned i = 0; i < f->values; i++)
+		aot_printf(&c->functions, "\tlval* v%u = NULL;\n", i);
+	for (unsigned i = 0; i < f->callees; i++)
+		aot_printf(&c->functions, "\taot_callee c%u;\n", i);
+	for (unsigned i = 0; i < f->tests; i++)
+		aot_printf(&c->functions, "\tint s%u;\n", i);
+
+	aot_printf(&c->functions, "\n%s\treturn v%u;\n}\n\n", aot_buffer_str(&f->code), res);
+	free(f->code.str);
+}
+
+unsigned aot_compile_body(aot_compiler* c, lval* formals, lval* body)
+{
+	// Registered before the body is compiled, so recursive calls are direct
+	unsigned index = c->lambdas->count;
+	lval* lambda = list_add(lval_list(), lval_copy(formals));
+	list_add(c->lambdas, list_add(lambda, lval_copy(body)));
+
+	aot_printf(&c->statics, "static lval* body_%u(lenv* env);\n", index);
+	aot_printf(&c->statics, "static const char* const formals_%u[] = { ", index);
+	for (unsigned i = 0; i < formals->count; i++)
+	{
+		aot_emit_string(&c->statics, formals->cells[i]->sym);
+		aot_printf(&c->statics, ", ");
+	}
+	aot_printf(&c->statics, "NULL };\n");
+
+	aot_function f;
+	memset(&f, 0, sizeof(f));
+	f.formals = formals;
+
+	unsigned res = aot_compile(c, &f, body);
+	aot_emit_function(c, "body", index, &f, res);
+	return index;
+}
+
+// (\ '(formals) '(body)) creates lambda with compiled body
+bool aot_compile_lambda(aot_compiler* c, aot_function* f, lval* expr, unsigned slot,
+						unsigned res)
+{
+	if (expr->count != 3) return false;
+
+	lval* formals = expr->cells[1];
+	lval* body = expr->cells[2];
+	if (!IS_QUOTE(formals) || !IS_LIST(formals->quoted) || !IS_QUOTE(body)
+		|| !IS_LIST(body->quoted) || !aot_proper_formals(formals->quoted))
+		return false;
+
+	formals = formals->quoted;
+	body = body->quoted;
+
+	unsigned index = aot_compile_body(c, formals, body);
+	unsigned form = aot_form(c, expr);
+
+	aot_printf(&f->code, "\tif (aot_holds_builtin(env, &globals[%u], builtin_lambda))\n", slot);
+	aot_printf(&f->code, "\t\tv%u = aot_lambda(builtin_lambda(env, aot_list(2, ", res);
+	aot_emit_value(&f->code, formals);
+	aot_printf(&f->code, ", ");
+	aot_emit_value(&f->code, body);
+	aot_printf(&f->code, ")), body_%u);\n", index);
+	aot_printf(&f->code, "\telse\n\t\tv%u = eval_lval(env, form_%u());\n", res, form);
+	return true;
+}
+
+// Expressions of the chosen clause, the last result is returned
+void aot_compile_exprs(aot_compiler* c, aot_function* f, lval* clause, unsigned res)
+{
+	if (clause->count == 1)
+	{
+		aot_printf(&f->code, "\tv%u = lval_list();\n", res);
+		return;
+	}
+
+	for (unsigned i = 1; i < clause->count; i++)
+	{
+		unsigned x = aot_compile(c, f, clause->cells[i]);
+		if (i != 1) aot_printf(&f->code, "\tlval_del(v%u);\n", res);
+		aot_printf(&f->code, "\tv%u = v%u;\n", res, x);
+	}
+}
+
+void aot_compile_clauses(aot_compiler* c, aot_function* f, lval* expr, unsigned i,
+						 unsigned res)
+{
+	if (i == expr->count)
+	{
+		aot_printf(&f->code, "\tv%u = lval_list();\n", res);
+		return;
+	}
+
+	lval* clause = expr->cells[i]->quoted;
+	lval* test = clause->cells[0];
+
+	// Literal tests, like 'true' of 'if', are chosen during compilation
+	if (IS_BOOL(test))
+	{
+		if (test->boolean) aot_compile_exprs(c, f, clause, res);
+		else aot_compile_clauses(c, f, expr, i + 1, res);
+		return;
+	}
+
+	unsigned t = aot_compile(c, f, test);
+	unsigned s = f->tests++;
+	aot_printf(&f->code, "\ts%u = aot_test(v%u, %u, &v%u);\n\tif (s%u > 0)\n\t{\n",
+			   s, t, i - 1, res, s);
+	aot_compile_exprs(c, f, clause, res);
+	aot_printf(&f->code, "\t}\n\telse if (s%u == 0)\n\t{\n", s);
+	aot_compile_clauses(c, f, expr, i + 1, res);
+	aot_printf(&f->code, "\t}\n");
+}
+
+// (cond '(test expr ...) ...) with literal clauses is evaluated in place
+bool aot_compile_cond(aot_compiler* c, aot_function* f, lval* expr, unsigned slot,
+					  unsigned res)
+{
+	for (unsigned i = 1; i < expr->count; i++)
+	{
+		lval* clause = expr->cells[i];
+		if (!IS_QUOTE(clause) || !IS_LIST(clause->quoted) || clause->quoted->count == 0
+			|| clause->quoted->strategy != LIST_CELLS)
+			return false;
+	}
+
+	unsigned form = aot_form(c, expr);
+	aot_printf(&f->code, "\tif (aot_holds_builtin(env, &globals[%u], builtin_cond))\n\t{\n", slot);
+	aot_compile_clauses(c, f, expr, 1, res);
+	aot_printf(&f->code, "\t}\n\telse\n\t\tv%u = eval_lval(env, form_%u());\n", res, form);
+	return true;
+}
+
+// Expansion is compiled, while the macro is the same as during compilation
+bool aot_compile_macro(aot_compiler* c, aot_function* f, lval* expr, lval* macro,
+					   unsigned slot, unsigned res)
+{
+	if (c->depth == AOT_MAX_EXPANSIONS || !IS_LIST(macro->body)
+		|| !aot_emittable(macro->formals) || !aot_emittable(macro->body))
+		return false;
+
+	lval* args = lval_copy(expr);
+	lval_del(list_pop(args, 0));
+	lval* copy = lval_copy(macro);
+	lval* expanded = eval_macro_expand(copy, args);
+	lval_del(copy);
+	lval_del(args);
+
+	if (IS_ERR(expanded) || !aot_emittable(expanded))
+	{
+		lval_del(expanded);
+		return false;
+	}
+
+	unsigned guard = c->guardCount++;
+	aot_printf(&c->statics, "static aot_guard guard_%u;\n", guard);
+	aot_printf(&c->forms, "static lval* macro_%u(void)\n{\n\treturn lval_macro(", guard);
+	aot_emit_value(&c->forms, macro->formals);
+	aot_printf(&c->forms, ", ");
+	aot_emit_value(&c->forms, macro->body);
+	aot_printf(&c->forms, ");\n}\n\n");
+
+	unsigned form = aot_form(c, expr);
+	aot_printf(&f->code, "\tif (aot_holds_macro(env, &globals[%u], &guard_%u, macro_%u))\n\t{\n",
+			   slot, guard, guard);
+
+	c->depth++;
+	unsigned x = aot_compile(c, f, expanded);
+	c->depth--;
+	lval_del(expanded);
+
+	aot_printf(&f->code, "\tv%u = v%u;\n\t}\n\telse\n\t\tv%u = eval_lval(env, form_%u());\n",
+			   res, x, res, form);
+	return true;
+}
+
+void aot_compile_call(aot_compiler* c, aot_function* f, lval* expr, unsigned res)
+{
+	lval* head = expr->cells[0];
+	unsigned argc = expr->count - 1;
+
+	// (x) is the value of x
+	if (argc == 0)
+	{
+		unsigned x = aot_compile(c, f, head);
+		aot_printf(&f->code, "\tv%u = v%u;\n", res, x);
+		return;
+	}
+
+	bool global = IS_SYM(head) && !aot_is_param(f, head);
+	unsigned slot = global ? aot_global_slot(c, head->sym) : 0;
+	lval* value = global ? lenv_lookup(c->env, head) : NULL;
+
+	if (value != NULL)
+	{
+		if (IS_MACRO(value) && aot_compile_macro(c, f, expr, value, slot, res))
+			return;
+		if (IS_BUILTIN(value) && value->builtin == builtin_cond
+			&& aot_compile_cond(c, f, expr, slot, res))
+			return;
+		if (IS_BUILTIN(value) && value->builtin == builtin_lambda
+			&& aot_compile_lambda(c, f, expr, slot, res))
+			return;
+	}
+
+	unsigned callee = f->callees++;
+	int native = value != NULL ? aot_native_index(c, value, argc) : -1;
+
+	if (native >= 0)
+		aot_printf(&f->code, "\taot_head_native(env, &globals[%u], body_%d, formals_%d, &c%u);\n",
+				   slot, native, native, callee);
+	else if (global)
+		aot_printf(&f->code, "\taot_head(env, &globals[%u], &c%u);\n", slot, callee);
+	else
+	{
+		unsigned x = aot_compile(c, f, head);
+		aot_printf(&f->code, "\taot_head_value(&c%u, v%u);\n", callee, x);
+	}
+
+	unsigned form = aot_form(c, expr);
+	aot_printf(&f->code, "\tif (c%u.value != NULL && IS_MACRO(c%u.value))\n", callee, callee);
+	aot_printf(&f->code, "\t\tv%u = aot_expand(env, c%u.value, form_%u());\n\telse\n\t{\n",
+			   res, callee, form);
+
+	unsigned* args = malloc(sizeof(unsigned) * argc);
+	DIE_IF_NULL(args);
+	for (unsigned i = 0; i < argc; i++)
+		args[i] = aot_compile(c, f, expr->cells[i + 1]);
+
+	aot_printf(&f->code, "\t{\n\t\tlval* a[] = { ");
+	for (unsigned i = 0; i < argc; i++)
+		aot_printf(&f->code, i == 0 ? "v%u" : ", v%u", args[i]);
+	aot_printf(&f->code, " };\n\t\tv%u = aot_apply(env, &c%u, %u, a);\n\t}\n\t}\n",
+			   res, callee, argc);
+
+	free(args);
+}
+
+// Emits code, that evaluates 'expr' like 'eval_lval', returns index of the
+// variable with the result
+unsigned aot_compile(aot_compiler* c, aot_function* f, lval* expr)
+{
+	unsigned res = f->values++;
+
+	if (IS_SYM(expr))
+	{
+		if (aot_is_param(f, expr))
+		{
+			aot_printf(&f->code, "\tv%u = aot_get_local(env, ", res);
+			aot_emit_string(&f->code, expr->sym);
+			aot_printf(&f->code, ");\n");
+		}
+		else
+			aot_printf(&f->code, "\tv%u = aot_get(env, &globals[%u]);\n", res,
+					   aot_global_slot(c, expr->sym));
+	}
+	else if (IS_LIST(expr) && expr->count != 0)
+	{
+		lval* cells = expr->strategy == LIST_CELLS ? expr : list_generalize(lval_copy(expr));
+		aot_compile_call(c, f, cells, res);
+		if (cells != expr) lval_del(cells);
+	}
+	else
+	{
+		aot_printf(&f->code, "\tv%u = ", res);
+		aot_emit_value(&f->code, IS_QUOTE(expr) ? expr->quoted : expr);
+		aot_printf(&f->code, ";\n");
+	}
+
+	return res;
+}
+
+lval* aot_compile_form(aot_compiler* c, lval* form, aot_buffer* file)
+{
+	if (aot_is_load(c->env, form))
+	{
+		unsigned loaded;
+		lval* err = aot_compile_file(c, form->cells[1]->str, false, &loaded);
+		if (err != NULL) return err;
+
+		aot_printf(file, "\tif ((err = aot_load(env, file_%u, false)) != NULL) return err;\n",
+				   loaded);
+		return NULL;
+	}
+
+	// Definitions are evaluated during compilation, so that later forms can
+	// use defined macros, and calls of defined lambdas are compiled to direct
+	// calls, including recursive ones in the definition itself
+	lval* name = aot_definition(c->env, form);
+	if (name != NULL)
+	{
+		lval* res = aot_eval(c->env, lval_copy(form));
+		if (res != NULL)
+		{
+			lval_del(res);
+			lval_del(name);
+			name = NULL;
+		}
+	}
+
+	aot_function f;
+	memset(&f, 0, sizeof(f));
+	unsigned index = c->topCount++;
+	unsigned res = aot_compile(c, &f, form);
+	aot_emit_function(c, "top", index, &f, res);
+	aot_printf(file, "\tif ((err = aot_result(top_%u(env))) != NULL) return err;\n", index);
+
+	if (name == NULL) return NULL;
+
+	lval* value = lenv_lookup(c->env, name);
+	if (value != NULL && IS_LAMBDA(value))
+	{
+		jit_function* function = jit_analyze_function(c->env, value);
+		if (function != NULL)
+		{
+			aot_emit_native(c, file, name->sym, function);
+			jit_function_del(function);
+		}
+	}
+
+	lval_del(name);
+	return NULL;
+}
+
+lval* aot_compile_file(aot_compiler* c, const char* fileName, bool isMain, unsigned* id)
+{
+	lval* expr = aot_parse_file(fileName);
+	if (IS_ERR(expr)) return expr;
+
+	aot_buffer file;
+	file.str = NULL;
+	file.length = file.capacity = 0;
+
+	lval nameKey; nameKey.type = LVAL_SYM; nameKey.sym = "__name__";
+	lval* oldName = lenv_get(c->env, &nameKey);
+
+	{
+		lval nameValue; nameValue.type = LVAL_SYM; nameValue.sym = isMain ? "__main__" : "__load__";
+		lenv_put(c->env, &nameKey, &nameValue);
+	}
+
+	lval* err = NULL;
+	for (unsigned i = 0; i < expr->count && err == NULL; i++)
+		err = aot_compile_form(c, expr->cells[i], &file);
+
+	lenv_put(c->env, &nameKey, oldName);
+	lval_del(oldName);
+	lval_del(expr);
+
+	if (err == NULL)
+	{
+		*id = c->fileCount++;
+		aot_printf(&c->files, "// %s\nstatic lval* file_%u(lenv* env)\n{\n\tlval* err = NULL;\n",
+				   fileName, *id);
+		aot_printf(&c->files, "%s\treturn err;\n}\n\n", aot_buffer_str(&file));
+	}
+
+	free(file.str);
+	return err;
+}
+
+void aot_write(aot_compiler* c, FILE* out, const char* fileName, unsigned prelude,
+			   bool hasPrelude, unsigned program)
+{
+	fprintf(out, "// Generated by ilispy from %s\n", fileName);
+	fprintf(out, "// %u lambdas and %u top-level forms are compiled to C, %u lambdas also to "
+			"numeric code\n\n", c->lambdas->count, c->topCount, c->nativeCount);
+	fprintf(out, "#include <aot.h>\n#include <eval.h>\n#include <builtins.h>\n\n");
+
+	fprintf(out, "#define GLOBAL_COUNT %u\n\nstatic aot_global globals[] =\n{\n", c->globals->count);
+	for (unsigned i = 0; i < c->globals->count; i++)
+	{
+		aot_buffer name;
+		memset(&name, 0, sizeof(name));
+		aot_emit_string(&name, c->globals->cells[i]->sym);
+		fprintf(out, "\t{ %s },\n", name.str);
+		free(name.str);
+	}
+	fprintf(out, "\t{ NULL }\n};\n\n");
+
+	fprintf(out, "%s\n%s%s%s%s", aot_buffer_str(&c->statics), aot_buffer_str(&c->natives),
+			aot_buffer_str(&c->forms), aot_buffer_str(&c->functions), aot_buffer_str(&c->files));
+
+	fprintf(out, "int main(int argc, char** argv)\n{\n\tlenv* env = aot_init();\n"
+			"\taot_bind(env, globals, GLOBAL_COUNT);\n\n");
+	if (hasPrelude)
+		fprintf(out, "\tlval* err = aot_load(env, file_%u, false);\n"
+				"\tif (err == NULL)\n\t\terr = aot_load(env, file_%u, true);\n",
+				prelude, program);
+	else
+		fprintf(out, "\tlval* err = aot_load(env, file_%u, true);\n", program);
+	fprintf(out, "\n\tif (err != NULL)\n\t{\n\t\tprintf(\"runtime error: %%s\\n\", err->err);\n"
+			"\t\tlval_del(err);\n\t}\n\n\taot_finish(env);\n\treturn 0;\n}\n");
+}
+
+lval* aot_emit_c(lenv* env, const char* fileName, const char* outName)
+{
+	aot_compiler c;
+	memset(&c, 0, sizeof(c));
+	c.env = env;
+	c.globals = lval_list();
+	c.lambdas = lval_list();
+
+	lval* err = NULL;
+	unsigned prelude = 0, program = 0;
+	bool hasPrelude = false;
+
+	FILE* test = fopen(PRELUDE_FILE_NAME, "r");
+	if (test != NULL)
+	{
+		fclose(test);
+		err = aot_compile_file(&c, PRELUDE_FILE_NAME, false, &prelude);
+		hasPrelude = err == NULL;
+	}
+
+	if (err == NULL)
+		err = aot_compile_file(&c, fileName, true, &program);
+
+	if (err == NULL)
+	{
+		FILE* out = fopen(outName, "w");
+		if (out == NULL)
+			err = lval_err("could not open file '%s'", outName);
+		else
+		{
+			aot_write(&c, out, fileName, prelude, hasPrelude, program);
+			fclose(out);
+		}
+	}
+
+	free(c.natives.str);
+	free(c.statics.str);
+	free(c.forms.str);
+	free(c.functions.str);
+	free(c.files.str);
+	lval_del(c.globals);
+	lval_del(c.lambdas);
+	return err;
+}
+
+lenv* aot_init()
+{
+	unsigned char marker;
+	aotStackLimit = (uintptr_t) &marker - AOT_STACK_BUDGET;
+
+	init_parsers();
+
+	lenv* env = lenv_new(NULL);
+	add_builtins(env);
+
+	lval nameKey; nameKey.type = LVAL_SYM; nameKey.sym = "__name__";
+	lval nameValue; nameValue.type = LVAL_SYM; nameValue.sym = "__main__";
+	lenv_put(env, &nameKey, &nameValue);
+
+	return env;
+}
+
+void aot_finish(lenv* env)
+{
+	lenv_del(env);
+	free_parsers();
+}
+
+lval* aot_list(unsigned count, ...)
+{
+	lval* list = lval_list();
+
+	va_list lst;
+	va_start(lst, count);
+	for (unsigned i = 0; i < count; i++)
+		list_add(list, va_arg(lst, lval*));
+	va_end(lst);
+
+	return list;
+}
+
+lval* aot_result(lval* res)
+{
+	if (IS_ERR(res)) return res;
+
+	lval_del(res);
+	return NULL;
+}
+
+lval* aot_eval(lenv* env, lval* form)
+{
+	return aot_result(eval_lval(env, form));
+}
+
+lval* aot_load(lenv* env, aot_file file, bool isMain)
+{
+	lval nameKey; nameKey.type = LVAL_SYM; nameKey.sym = "__name__";
+	lval* oldName = lenv_get(env, &nameKey);
+
+	{
+		lval nameValue; nameValue.type = LVAL_SYM; nameValue.sym = isMain ? "__main__" : "__load__";
+		lenv_put(env, &nameKey, &nameValue);
+	}
+
+	lval* err = file(env);
+
+	lenv_put(env, &nameKey, oldName);
+	lval_del(oldName);
+
+	return err;
+}
+
+void aot_attach(lenv* env, const char* name, jit_entry entry, jit_kind result,
+				const char* const* guards)
+{
+	lval* key = lval_sym(name);
+	lval* func = lenv_lookup(env, key);
+	lval_del(key);
+
+	if (func != NULL && IS_LAMBDA(func))
+		jit_attach(env, func, entry, result, guards);
+}
+
+void aot_bind(lenv* env, aot_global* globals, unsigned count)
+{
+	globalEnv = env;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		lval key; key.type = LVAL_SYM; key.sym = (char*) globals[i].name;
+		globals[i].watch = lenv_watch(globals[i].name);
+		globals[i].version = globals[i].watch->version;
+		globals[i].value = lenv_lookup(env, &key);
+	}
+}
+
+lval* aot_lookup(lenv* env, aot_global* global)
+{
+	if (global->version != global->watch->version)
+	{
+		lval key; key.type = LVAL_SYM; key.sym = (char*) global->name;
+		global->value = lenv_lookup(globalEnv, &key);
+		global->version = global->watch->version;
+	}
+
+	// Local bindings hide the global one
+	if (global->watch->shadows != 0)
+	{
+		for (; env->parent != NULL; env = env->parent)
+			for (unsigned i = 0; i < env->count; i++)
+				if (strcmp(env->entries[i].key, global->name) == 0)
+					return env->entries[i].value;
+	}
+
+	return global->value;
+}
+
+lval* aot_get(lenv* env, aot_global* global)
+{
+	lval* value = aot_lookup(env, global);
+
+	if (value != NULL) return lval_copy(value);
+	else return lval_err("symbol '%s' is not bound to anything", global->name);
+}
+
+lval* aot_get_local(lenv* env, const char* name)
+{
+	lval key; key.type = LVAL_SYM; key.sym = (char*) name;
+	return lenv_get(env, &key);
+}
+
+bool aot_holds_builtin(lenv* env, aot_global* global, lbuiltin_func builtin)
+{
+	lval* value = aot_lookup(env, global);
+	return value != NULL && IS_BUILTIN(value) && value->builtin == builtin;
+}
+
+bool aot_holds_macro(lenv* env, aot_global* global, aot_guard* guard,
+					 lval* (*expected)(void))
+{
+	lval* value = aot_lookup(env, global);
+	if (value == NULL || !IS_MACRO(value)) return false;
+
+	// The global binding is compared once for each version
+	bool cached = value == global->value;
+	if (cached && guard->value == value && guard->version == global->version)
+		return guard->holds;
+
+	lval* macro = expected();
+	bool holds = lval_eq(value, macro);
+	lval_del(macro);
+
+	if (cached)
+	{
+		guard->value = value;
+		guard->version = global->version;
+		guard->holds = holds;
+	}
+
+	return holds;
+}
+
+void aot_head_value(aot_callee* callee, lval* value)
+{
+	memset(callee, 0, sizeof(aot_callee));
+	callee->value = value;
+}
+
+void aot_head_of(aot_callee* callee, aot_global* global, lval* value)
+{
+	aot_head_value(callee, NULL);
+
+	if (value == NULL)
+		callee->value = lval_err("symbol '%s' is not bound to anything", global->name);
+	else if (IS_BUILTIN(value))
+	{
+		callee->builtin = value->builtin;
+		callee->argvBuiltin = value->argvBuiltin;
+	}
+	else callee->value = lval_copy(value);
+}
+
+void aot_head(lenv* env, aot_global* global, aot_callee* callee)
+{
+	aot_head_of(callee, global, aot_lookup(env, global));
+}
+
+void aot_head_native(lenv* env, aot_global* global, aot_body native,
+					 const char* const* formals, aot_callee* callee)
+{
+	lval* value = aot_lookup(env, global);
+
+	if (value == NULL || value != global->value || !IS_LAMBDA(value)
+		|| value->info->aot != native || value->env->count != 0)
+	{
+		aot_head_of(callee, global, value);
+		return;
+	}
+
+	aot_head_value(callee, NULL);
+	callee->native = native;
+	callee->formals = formals;
+	callee->global = global;
+	callee->version = global->version;
+}
+
+lval* aot_call_native(lenv* env, aot_callee* callee, unsigned argc, lval** argv)
+{
+	// Arguments may have redefined the lambda, then only its body is known
+	lval* func = callee->global->watch->version == callee->version
+		? callee->global->value
+		: NULL;
+
+	if (func != NULL)
+	{
+		lval args = { .type = LVAL_LIST };
+		args.count = argc;
+		args.cells = argv;
+
+		lval* res = jit_try_call(env, func, &args);
+		if (res != NULL)
+		{
+			for (unsigned i = 0; i < argc; i++)
+				lval_del(argv[i]);
+			return res;
+		}
+	}
+
+	lenv* frame = lenv_new(env);
+	for (unsigned i = 0; i < argc; i++)
+	{
+		lval key; key.type = LVAL_SYM; key.sym = (char*) callee->formals[i];
+		lenv_bind(frame, &key, argv[i]);
+		lval_del(argv[i]);
+	}
+
+	// Optimizer may run linear recursion by a loop, that is preferred
+	lval* res = func != NULL
+		? optimizer_eval(frame, func)
+		: callee->native(frame);
+
+	lenv_del(frame);
+	return res;
+}
+
+lval* aot_apply(lenv* env, aot_callee* callee, unsigned argc, lval** argv)
+{
+	// The first error of the head and arguments is returned
+	lval* err = callee->value != NULL && IS_ERR(callee->value) ? callee->value : NULL;
+	for (unsigned i = 0; i < argc && err == NULL; i++)
+		if (IS_ERR(argv[i])) err = argv[i];
+
+	if (err != NULL)
+	{
+		if (callee->value != NULL && callee->value != err) lval_del(callee->value);
+		for (unsigned i = 0; i < argc; i++)
+			if (argv[i] != err) lval_del(argv[i]);
+		return err;
+	}
+
+	if (callee->native != NULL)
+		return aot_call_native(env, callee, argc, argv);
+
+	if (callee->value == NULL && callee->argvBuiltin != NULL)
+	{
+		lval* res = callee->argvBuiltin(env, argc, argv);
+		for (unsigned i = 0; i < argc; i++)
+			if (argv[i] != NULL) lval_del(argv[i]);
+		return res;
+	}
+
+	lval* args = lval_list();
+	for (unsigned i = 0; i < argc; i++)
+		list_add(args, argv[i]);
+
+	if (callee->value == NULL) return callee->builtin(env, args);
+	return eval_func_call(env, callee->value, args);
+}
+
+lval* aot_expand(lenv* env, lval* macro, lval* form)
+{
+	lval_del(list_pop(form, 0));
+	lval* expanded = eval_macro_expand(macro, form);
+	lval_del(form);
+	lval_del(macro);
+	return eval_lval(env, expanded);
+}
+
+int aot_test(lval* test, int index, lval** res)
+{
+	if (IS_BOOL(test))
+	{
+		bool cond = test->boolean;
+		lval_del(test);
+		return cond;
+	}
+
+	if (IS_ERR(test)) *res = test;
+	else
+	{
+		lval_del(test);
+		*res = lval_err("function 'cond' test result for argument %i is not a Boolean", index);
+	}
+	return -1;
+}
+
+lval* aot_lambda(lval* lambda, aot_body body)
+{
+	if (IS_LAMBDA(lambda)) lambda->info->aot = body;
+	return lambda;
+}
@@ -0,0 +1,494 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <bignum.h>
+
+// Below this number of digits schoolbook multiplication is faster than Karatsuba
+#define KARATSUBA_THRESHOLD 32
+
+lbig* bignum_alloc(unsigned count)
+{
+	lbig* a = malloc(sizeof(lbig) + sizeof(uint32_t) * count);
+	DIE_IF_NULL(a);
+	a->negative = false;
+	a->count = count;
+	a->digits = (uint32_t*) (a + 1);
+	return a;
+}
+
+lbig* bignum_alloc_zero(unsigned count)
+{
+	lbig* a = bignum_alloc(count);
+	memset(a->digits, 0, sizeof(uint32_t) * count);
+	return a;
+}
+
+// Drops leading zero digits
+lbig* bignum_trim(lbig* a)
+{
+	while (a->count != 0 && a->digits[a->count - 1] == 0)
+		a->count--;
+
+	if (a->count == 0) a->negative = false;
+	return a;
+}
+
+void bignum_view_long(lbig* view, uint32_t digits[BIGNUM_LONG_DIGITS], long x)
+{
+	unsigned long m = x < 0 ? -(unsigned long) x : (unsigned long) x;
+
+	view->negative = x < 0;
+	view->count = 0;
+	view->digits = digits;
+
+	while (m != 0)
+	{
+		digits[view->count++] = m % BIGNUM_BASE;
+		m /= BIGNUM_BASE;
+	}
+}
+
+lbig* bignum_from_long(long x)
+{
+	uint32_t digits[BIGNUM_LONG_DIGITS];
+	lbig view;
+	bignum_view_long(&view, digits, x);
+	return bignum_copy(&view);
+}
+
+lbig* bignum_parse(const char* str)
+{
+	bool negative = *str == '-';
+	if (*str == '-' || *str == '+') str++;
+	while (*str == '0') str++;
+
+	size_t len = strlen(str);
+	lbig* res = bignum_alloc((len + BIGNUM_BASE_DIGITS - 1) / BIGNUM_BASE_DIGITS);
+	res->negative = negative;
+
+	// Every digit of the bignum is 9 decimal digits, counting from the end
+	for (unsigned i = 0; i < res->count; i++)
+	{
+		size_t end = len - i * BIGNUM_BASE_DIGITS;
+		size_t start = end > BIGNUM_BASE_DIGITS ? end - BIGNUM_BASE_DIGITS : 0;
+
+		uint32_t d = 0;
+		for (size_t j = start; j < end; j++)
+			d = d * 10 + (str[j] - '0');
+
+		res->digits[i] = d;
+	}
+
+	return bignum_trim(res);
+}
+
+lbig* bignum_copy(const lbig* a)
+{
+	lbig* res = bignum_alloc(a->count);
+	res->negative = a->negative;
+	memcpy(res->digits, a->digits, sizeof(uint32_t) * a->count);
+	return res;
+}
+
+void bignum_free(lbig* a)
+{
+	free(a);
+}
+
+bool bignum_to_long(const lbig* a, long* x)
+{
+	unsigned long m = 0;
+
+	for (unsigned i = a->count; i-- > 0;)
+	{
+		if (__builtin_mul_overflow(m, BIGNUM_BASE, &m)) return false;
+		if (__builtin_add_overflow(m, a->digits[i], &m)) return false;
+	}
+
+	if (a->negative)
+	{
+		if (m > (unsigned long) LONG_MAX + 1) return false;
+		*x = m == (unsigned long) LONG_MAX + 1 ? LONG_MIN : -(long) m;
+	}
+	else
+	{
+		if (m > LONG_MAX) return false;
+		*x = m;
+	}
+
+	return true;
+}
+
+int bignum_cmp_digits(const uint32_t* a, unsigned an, const uint32_t* b, unsigned bn)
+{
+	if (an != bn) return an < bn ? -1 : 1;
+
+	for (unsigned i = an; i-- > 0;)
+		if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+
+	return 0;
+}
+
+int bignum_cmp(const lbig* a, const lbig* b)
+{
+	if (a->negative != b->negative) return a->negative ? -1 : 1;
+
+	int res = bignum_cmp_digits(a->digits, a->count, b->digits, b->count);
+	return a->negative ? -res : res;
+}
+
+// r[0, rn) += x[0, xn), the sum must fit into rn digits
+void bignum_add_into(uint32_t* r, unsigned rn, const uint32_t* x, unsigned xn)
+{
+	uint32_t carry = 0;
+	unsigned i = 0;
+
+	for (; i < xn; i++)
+	{
+		uint32_t s = r[i] + x[i] + carry;
+		carry = s >= BIGNUM_BASE;
+		r[i] = carry ? s - BIGNUM_BASE : s;
+	}
+
+	for (; carry && i < rn; i++)
+	{
+		carry = r[i] == BIGNUM_BASE - 1;
+		r[i] = carry ? 0 : r[i] + 1;
+	}
+}
+
+// r[0, rn) -= x[0, xn), r must be not less than x
+void bignum_sub_into(uint32_t* r, unsigned rn, const uint32_t* x, unsigned xn)
+{
+	uint32_t borrow = 0;
+	unsigned i = 0;
+
+	for (; i < xn; i++)
+	{
+		uint32_t y = x[i] + borrow;
+		borrow = r[i] < y;
+		r[i] = borrow ? r[i] + BIGNUM_BASE - y : r[i] - y;
+	}
+
+	for (; borrow && i < rn; i++)
+	{
+		borrow = r[i] == 0;
+		r[i] = borrow ? BIGNUM_BASE - 1 : r[i] - 1;
+	}
+}
+
+// a + b, when 'negateB' is set a - b
+lbig* bignum_add_signed(const lbig* a, const lbig* b, bool negateB)
+{
+	bool negativeB = b->negative != negateB;
+
+	if (a->negative != negativeB
+		&& bignum_cmp_digits(a->digits, a->count, b->digits, b->count) < 0)
+	{
+		// |a| < |b|, so the result is b - a
+		lbig* res = bignum_copy(b);
+		res->negative = negativeB;
+		bignum_sub_into(res->digits, res->count, a->digits, a->count);
+		return bignum_trim(res);
+	}
+
+	lbig* res = bignum_alloc_zero((a->count > b->count ? a->count : b->count) + 1);
+	memcpy(res->digits, a->digits, sizeof(uint32_t) * a->count);
+	res->negative = a->negative;
+
+	if (a->negative == negativeB)
+		bignum_add_into(res->digits, res->count, b->digits, b->count);
+	else
+		bignum_sub_into(res->digits, res->count, b->digits, b->count);
+
+	return bignum_trim(res);
+}
+
+lbig* bignum_add(const lbig* a, const lbig* b)
+{
+	return bignum_add_signed(a, b, false);
+}
+
+lbig* bignum_sub(const lbig* a, const lbig* b)
+{
+	return bignum_add_signed(a, b, true);
+}
+
+// r[0, an + bn) = a * b, r must be zeroed
+void bignum_mul_school(uint32_t* r, const uint32_t* a, unsigned an, const uint32_t* b, unsigned bn)
+{
+	for (unsigned i = 0; i < an; i++)
+	{
+		uint64_t x = a[i];
+		uint64_t carry = 0;
+
+		for (unsigned j = 0; j < bn; j++)
+		{
+			uint64_t t = r[i + j] + x * b[j] + carry;
+			r[i + j] = t % BIGNUM_BASE;
+			carry = t / BIGNUM_BASE;
+		}
+
+		r[i + bn] = carry;
+	}
+}
+
+// r[0, an + bn) = a * b, r must be zeroed. Operands may have leading zeros
+void bignum_mul_digits(uint32_t* r, const uint32_t* a, unsigned an, const uint32_t* b, unsigned bn)
+{
+	if (an < bn)
+	{
+		const uint32_t* t = a; a = b; b = t;
+		unsigned tn = an; an = bn; bn = tn;
+	}
+
+	if (bn < KARATSUBA_THRESHOLD)
+	{
+		bignum_mul_school(r, a, an, b, bn);
+		return;
+	}
+
+	unsigned m = (an + 1) / 2;
+
+	if (bn <= m)
+	{
+		// a = a1 * B^m + a0, so a * b = a0 * b + (a1 * b) * B^m
+		uint32_t* t = calloc(an - m + bn, sizeof(uint32_t));
+		DIE_IF_NULL(t);
+
+		bignum_mul_digits(r, a, m, b, bn);
+		bignum_mul_digits(t, a + m, an - m, b, bn);
+		bignum_add_into(r + m, an + bn - m, t, an - m + bn);
+
+		free(t);
+		return;
+	}
+
+	// a = a1 * B^m + a0, b = b1 * B^m + b0, then with z0 = a0 * b0, z2 = a1 * b1
+	// and z1 = (a0 + a1) * (b0 + b1): a * b = z2 * B^2m + (z1 - z2 - z0) * B^m + z0
+	unsigned sn = m + 1;
+	uint32_t* sa = calloc(sn * 4, sizeof(uint32_t));
+	DIE_IF_NULL(sa);
+	uint32_t* sb = sa + sn;
+	uint32_t* z1 = sb + sn;
+
+	memcpy(sa, a, sizeof(uint32_t) * m);
+	bignum_add_into(sa, sn, a + m, an - m);
+	memcpy(sb, b, sizeof(uint32_t) * m);
+	bignum_add_into(sb, sn, b + m, bn - m);
+
+	bignum_mul_digits(r, a, m, b, m);
+	bignum_mul_digits(r + 2 * m, a + m, an - m, b + m, bn - m);
+	bignum_mul_digits(z1, sa, sn, sb, sn);
+
+	bignum_sub_into(z1, 2 * sn, r, 2 * m);
+	bignum_sub_into(z1, 2 * sn, r + 2 * m, an + bn - 2 * m);
+
+	unsigned zn = 2 * sn;
+	while (zn > an + bn - m && z1[zn - 1] == 0)
+		zn--;
+
+	bignum_add_into(r + m, an + bn - m, z1, zn);
+	free(sa);
+}
+
+lbig* bignum_mul(const lbig* a, const lbig* b)
+{
+	lbig* res = bignum_alloc_zero(a->count + b->count);
+	bignum_mul_digits(res->digits, a->digits, a->count, b->digits, b->count);
+	res->negative = a->negative != b->negative;
+	return bignum_trim(res);
+}
+
+void bignum_mul_small(uint32_t* a, unsigned n, uint32_t d)
+{
+	uint64_t carry = 0;
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		uint64_t t = (uint64_t) a[i] * d + carry;
+		a[i] = t % BIGNUM_BASE;
+		carry = t / BIGNUM_BASE;
+	}
+}
+
+// Returns remainder
+uint32_t bignum_div_small(uint32_t* a, unsigned n, uint32_t d)
+{
+	uint64_t rem = 0;
+
+	for (unsigned i = n; i-- > 0;)
+	{
+		uint64_t t = rem * BIGNUM_BASE + a[i];
+		a[i] = t / d;
+		rem = t % d;
+	}
+
+	return rem;
+}
+
+// Knuth's algorithm D: operands are scaled, so that the leading digit of the
+// divisor is at least B / 2 and the estimated quotient digit is exact after at
+// most two corrections
+void bignum_divmod_digits(lbig* q, lbig* r, const lbig* a, const lbig* b)
+{
+	unsigned n = b->count;
+	unsigned m = a->count - n;
+	uint32_t d = BIGNUM_BASE / (b->digits[n - 1] + 1);
+
+	uint32_t* u = calloc(a->count + 1 + n, sizeof(uint32_t));
+	DIE_IF_NULL(u);
+	uint32_t* v = u + a->count + 1;
+
+	memcpy(u, a->digits, sizeof(uint32_t) * a->count);
+	memcpy(v, b->digits, sizeof(uint32_t) * n);
+	bignum_mul_small(u, a->count + 1, d);
+	bignum_mul_small(v, n, d);
+
+	for (unsigned j = m + 1; j-- > 0;)
+	{
+		uint64_t t = (uint64_t) u[j + n] * BIGNUM_BASE + u[j + n - 1];
+		uint64_t qhat = t / v[n - 1];
+		uint64_t rhat = t % v[n - 1];
+
+		while (qhat >= BIGNUM_BASE || qhat * v[n - 2] > rhat * BIGNUM_BASE + u[j + n - 2])
+		{
+			qhat--;
+			rhat += v[n - 1];
+			if (rhat >= BIGNUM_BASE) break;
+		}
+
+		// u[j, j + n] -= qhat * v
+		uint64_t carry = 0;
+		int64_t borrow = 0;
+		for (unsigned i = 0; i < n; i++)
+		{
+			uint64_t p = qhat * v[i] + carry;
+			carry = p / BIGNUM_BASE;
+
+			int64_t s = (int64_t) u[i + j] - (int64_t) (p % BIGNUM_BASE) - borrow;
+			borrow = s < 0;
+			u[i + j] = s < 0 ? s + BIGNUM_BASE : s;
+		}
+
+		int64_t s = (int64_t) u[j + n] - (int64_t) carry - borrow;
+		if (s < 0)
+		{
+			// The estimate was one too large, divisor is added back
+			qhat--;
+			u[j + n] = s + BIGNUM_BASE;
+
+			uint32_t c = 0;
+			for (unsigned i = 0; i < n; i++)
+			{
+				uint32_t x = u[i + j] + v[i] + c;
+				c = x >= BIGNUM_BASE;
+				u[i + j] = c ? x - BIGNUM_BASE : x;
+			}
+			u[j + n] = (u[j + n] + c) % BIGNUM_BASE;
+		}
+		else u[j + n] = s;
+
+		q->digits[j] = qhat;
+	}
+
+	bignum_div_small(u, n, d);
+	memcpy(r->digits, u, sizeof(uint32_t) * n);
+	free(u);
+}
+
+void bignum_divmod(const lbig* a, const lbig* b, lbig** quot, lbig** rem)
+{
+	assert(b->count != 0);
+
+	lbig* q;
+	lbig* r;
+
+	if (bignum_cmp_digits(a->digits, a->count, b->digits, b->count) < 0)
+	{
+		q = bignum_alloc(0);
+		r = bignum_copy(a);
+	}
+	else if (b->count == 1)
+	{
+		q = bignum_copy(a);
+		r = bignum_alloc(1);
+		r->digits[0] = bignum_div_small(q->digits, q->count, b->digits[0]);
+	}
+	else
+	{
+		q = bignum_alloc(a->count - b->count + 1);
+		r = bignum_alloc(b->count);
+		bignum_divmod_digits(q, r, a, b);
+	}
+
+	q->negative = a->negative != b->negative;
+	r->negative = a->negative;
+	bignum_trim(q);
+	bignum_trim(r);
+
+	if (quot != NULL) *quot = q;
+	else bignum_free(q);
+
+	if (rem != NULL) *rem = r;
+	else bignum_free(r);
+}
+
+char* bignum_to_str(const lbig* a)
+{
+	char* str = malloc(a->count * BIGNUM_BASE_DIGITS + 2);
+	DIE_IF_NULL(str);
+	char* p = str;
+
+	if (a->count == 0)
+	{
+		strcpy(str, "0");
+		return str;
+	}
+
+	if (a->negative) *p++ = '-';
+
+	// The leading digit is printed without zeros, others are padded to 9 digits
+	char lead[BIGNUM_BASE_DIGITS];
+	unsigned leadCount = 0;
+	for (uint32_t x = a->digits[a->count - 1]; x != 0; x /= 10)
+		lead[leadCount++] = '0' + x % 10;
+	while (leadCount != 0)
+		*p++ = lead[--leadCount];
+
+	for (unsigned i = a->count - 1; i-- > 0;)
+	{
+		uint32_t x = a->digits[i];
+		for (int j = BIGNUM_BASE_DIGITS - 1; j >= 0; j--)
+		{
+			p[j] = '0' + x % 10;
+			x /= 10;
+		}
+		p += BIGNUM_BASE_DIGITS;
+	}
+
+	*p = '\0';
+	return str;
+}
@@ -28,6 +28,13 @@
 #include <environment.h>
 #include <eval.h>
 #include <parser.h>
+#include <optimizer.h>
+#include <sort.h>
+#include <hamt.h>
+#include <set.h>
+#include <record.h>
+#include <strscan.h>
+#include <rope.h>
 
 #include "reader.h"
 
@@ -82,140 +89,308 @@
 	}                 \
 	while (false)
 
+#define LASSERT_ARGV(cond, fmt, ...)  \
+	do {           \
+		if (!(cond))        \
+			return lval_err(fmt, ##__VA_ARGS__); \
+	} while (false)
+
+#define BUILTIN_TYPE_LIST(...) { __VA_ARGS__ }
+#define BUILTIN_TYPE_COUNT(types) ((int) (sizeof(types) / sizeof(types[0])))
+#define BUILTIN_ARG_TYPE(types, i) \
+	(types)[(i) < BUILTIN_TYPE_COUNT(types) ? (i) : BUILTIN_TYPE_COUNT(types) - 1]
+
+#define o(name, symbol, display, min, max, types, result) \
+	static const lval_type builtin_##name##_types[] = BUILTIN_TYPE_LIST types;
+	BUILTIN_SIGNATURES
+#undef o
+
+lval* builtin_type_error(const char* name, int i, lval_type expected, lval* got)
+{
+	return lval_err("function '%s' passed incorrect type for argument %i. Got %s, expected %s",
+					name, i + 1, lval_type_str(got->type),
+					expected == BUILTIN_TEXT ? "String or Character" : lval_type_str(expected));
+}
+
+// Argument checks and list calling convention adapters are generated from
+// signatures
+#define o(name, symbol, display, min, max, types, result)    \
+	lval* builtin_##name##_argv(lenv* e, int argc, lval** argv)  \
+	{                 \
+		LASSERT_ARGV(argc >= min,          \
+					 "function '" display "' passed not enough arguments"); \
+		LASSERT_ARGV(max == -1 || argc <= max,       \
+					 "function '" display "' passed too much arguments"); \
+		for (int i = 0; i < argc; i++)         \
+		{                 \
+			lval_type type = BUILTIN_ARG_TYPE(builtin_##name##_types, i); \
+			if (!BUILTIN_TYPE_MATCHES(type, argv[i]->type))    \
+				return builtin_type_error(display, i, type, argv[i]); \
+		}                 \
+		return builtin_##name##_unchecked(e, argc, argv);    \
+	}                 \
+	                  \
+	lval* builtin_##name(lenv* e, lval* a)        \
+	{                 \
+		return builtin_call_argv(e, builtin_##name##_argv, a);   \
+	}
+	BUILTIN_SIGNATURES
+#undef o
+
+static const builtin_signature builtinSignatures[] =
+{
+#define o(name, symbol, display, min, max, types, result) \
+	{ builtin_##name, builtin_##name##_unchecked, min, max, \
+	  builtin_##name##_types, BUILTIN_TYPE_COUNT(builtin_##name##_types), result },
+	BUILTIN_SIGNATURES
+#undef o
+};
+
+const builtin_signature* builtin_signature_of(lbuiltin_func func)
+{
+	for (unsigned i = 0; i < sizeof(builtinSignatures) / sizeof(builtinSignatures[0]); i++)
+		if (builtinSignatures[i].func == func) return &builtinSignatures[i];
+
+	return NULL;
+}
+
+lval_type builtin_signature_type(const builtin_signature* sig, int i)
+{
+	return sig->types[i < sig->typeCount ? i : sig->typeCount - 1];
+}
+
 void add_builtins(lenv* e)
 {
-	add_builtin(e, "list", builtin_list);
-	add_builtin(e, "head", builtin_head);
-	add_builtin(e, "tail", builtin_tail);
-	add_builtin(e, "eval", builtin_eval);
-	add_builtin(e, "join", builtin_join);
-	
-	add_builtin(e, "headstr", builtin_headstr);
-	add_builtin(e, "tailstr", builtin_tailstr);
-	add_builtin(e, "joinstr", builtin_joinstr);
+#define o(name, symbol, display, min, max, types, result) \
+	add_builtin_argv(e, symbol, builtin_##name, builtin_##name##_argv);
+	BUILTIN_SIGNATURES
+#undef o
 
-	add_builtin(e, "+", builtin_add);
-	add_builtin(e, "-", builtin_sub);
-	add_builtin(e, "*", builtin_mul);
-	add_builtin(e, "/", builtin_div);
+	add_builtin(e, "eval", builtin_eval);
 
 	add_builtin(e, "__def", builtin_def);
 	add_builtin(e, "__set", builtin_set);
 	add_builtin(e, "__let", builtin_let);
 
-	add_builtin(e, "eq", builtin_eq);
-	add_builtin(e, "less", builtin_less);
-	add_builtin(e, "not", builtin_not);
+	add_builtin(e, "push!", builtin_push);
+	add_builtin(e, "pop!", builtin_pop);
+	add_builtin(e, "set-nth!", builtin_set_nth);
+	add_builtin(e, "list-reserve!", builtin_list_reserve);
+	add_builtin(e, "sb-append!", builtin_sb_append);
+	add_builtin(e, "sb->string", builtin_sb_to_string);
 
 	add_builtin(e, "cond", builtin_cond);
+	add_builtin(e, "case", builtin_case);
+
+	add_builtin(e, "__while", builtin_while);
+	add_builtin(e, "__dotimes", builtin_dotimes);
+	add_builtin(e, "__for-each", builtin_for_each);
+
+	// Surface forms of loops, the prelude may redefine them
+	const char* whileFormals[] = { "__test", "__body" };
+	const char* dotimesFormals[] = { "__var", "__count", "__body" };
+	const char* forEachFormals[] = { "__var", "__list", "__body" };
+	add_builtin_macro(e, "while", "__while", whileFormals, 2, -1);
+	add_builtin_macro(e, "dotimes", "__dotimes", dotimesFormals, 3, 1);
+	add_builtin_macro(e, "for-each", "__for-each", forEachFormals, 3, 1);
 
 	add_builtin(e, "\\", builtin_lambda);
+	add_builtin(e, "specialize", builtin_specialize);
+	add_builtin(e, "__defrecord", builtin_defrecord);
 
-	add_builtin(e, "show", builtin_show);
-	add_builtin(e, "print", builtin_print);
-	add_builtin(e, "println", builtin_println);
-	add_builtin(e, "error", builtin_error);
+	// (defrecord point (x y)) -> (__defrecord 'point '(x y))
+	const char* defrecordFormals[] = { "__name", "__fields" };
+	add_builtin_macro(e, "defrecord", "__defrecord", defrecordFormals, 2, -1);
 
 	add_builtin(e, "load", builtin_load);
 	add_builtin(e, "exit", builtin_exit);
 
-	add_builtin(e, "typeq", builtin_typeq);
 	add_builtin(e, "__macro", builtin_macro_internal);
 	add_builtin(e, "macroexpand", builtin_macroexpand);
 }
 
-lval* builtin_op(lval* a, const char* op)
+// Result is stored into the first argument to avoid allocation
+lval* builtin_num_result(lval** argv, long x)
 {
-	for (unsigned i = 0; i < a->count; i++)
-		LASSERT_TYPE(a, i, LVAL_NUM, "builtin arithmetic");
+	lval* res = argv[0];
+	argv[0] = NULL;
+	res->num = x;
+	return res;
+}
 
-	lval* x = list_pop(a, 0);
+// Slow path of arithmetic, when an argument is a bignum or a fixnum operation
+// overflows: all arguments are converted to bignums and the result is demoted
+// back to fixnum when it fits
+lval* builtin_arith_big(char op, int argc, lval** argv)
+{
+	lbig view;
+	uint32_t digits[BIGNUM_LONG_DIGITS];
 
-	if ((strcmp(op, "-") == 0) && a->count == 0)
-		x->num = -(x->num);
+	lbig* x = bignum_copy(lval_num_bignum(argv[0], &view, digits));
+	if (op == '-' && argc == 1) x->negative = !x->negative && x->count != 0;
 
-	while (a->count > 0)
+	for (int i = 1; i < argc; i++)
 	{
-		lval* y = list_pop(a, 0);
+		const lbig* y = lval_num_bignum(argv[i], &view, digits);
+		lbig* res = NULL;
 
-		if (strcmp(op, "+") == 0) x->num += y->num;
-		if (strcmp(op, "-") == 0) x->num -= y->num;
-		if (strcmp(op, "*") == 0) x->num *= y->num;
-		if (strcmp(op, "/") == 0)
+		switch (op)
 		{
-			if (y->num == 0)
+		case '+': res = bignum_add(x, y); break;
+		case '-': res = bignum_sub(x, y); break;
+		case '*': res = bignum_mul(x, y); break;
+		case '/':
+		case '%':
+			if (y->count == 0)
 			{
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("division by zero");
-				break;
+				bignum_free(x);
+				return lval_err("division by zero");
 			}
-
-			x->num /= y->num;
+			bignum_divmod(x, y, op == '/' ? &res : NULL, op == '%' ? &res : NULL);
+			break;
 		}
 
-		lval_del(y);
+		bignum_free(x);
+		x = res;
 	}
 
-	lval_del(a);
-	return x;
+	return lval_num_big(x);
 }
 
-lval* builtin_add(lenv* e, lval* a)
+lval* builtin_add_unchecked(lenv* e, int argc, lval** argv)
 {
-	return builtin_op(a, "+");
+	long x = argv[0]->num;
+	if (argv[0]->big != NULL) return builtin_arith_big('+', argc, argv);
+
+	for (int i = 1; i < argc; i++)
+		if (argv[i]->big != NULL || __builtin_add_overflow(x, argv[i]->num, &x))
+			return builtin_arith_big('+', argc, argv);
+
+	return builtin_num_result(argv, x);
 }
 
-lval* builtin_sub(lenv* e, lval* a)
+lval* builtin_sub_unchecked(lenv* e, int argc, lval** argv)
 {
-	return builtin_op(a, "-");
+	long x = argv[0]->num;
+	if (argv[0]->big != NULL) return builtin_arith_big('-', argc, argv);
+
+	if (argc == 1)
+	{
+		if (__builtin_sub_overflow(0, x, &x)) return builtin_arith_big('-', argc, argv);
+		return builtin_num_result(argv, x);
+	}
+
+	for (int i = 1; i < argc; i++)
+		if (argv[i]->big != NULL || __builtin_sub_overflow(x, argv[i]->num, &x))
+			return builtin_arith_big('-', argc, argv);
+
+	return builtin_num_result(argv, x);
+}
+
+lval* builtin_mul_unchecked(lenv* e, int argc, lval** argv)
+{
+	long x = argv[0]->num;
+	if (argv[0]->big != NULL) return builtin_arith_big('*', argc, argv);
+
+	for (int i = 1; i < argc; i++)
+		if (argv[i]->big != NULL || __builtin_mul_overflow(x, argv[i]->num, &x))
+			return builtin_arith_big('*', argc, argv);
+
+	return builtin_num_result(argv, x);
 }
 
-lval* builtin_div(lenv* e, lval* a)
+lval* builtin_div_unchecked(lenv* e, int argc, lval** argv)
 {
-	return builtin_op(a, "/");
+	long x = argv[0]->num;
+	if (argv[0]->big != NULL) return builtin_arith_big('/', argc, argv);
+
+	for (int i = 1; i < argc; i++)
+	{
+		long y = argv[i]->num;
+
+		if (argv[i]->big != NULL || (x == LONG_MIN && y == -1))
+			return builtin_arith_big('/', argc, argv);
+		if (y == 0) return lval_err("division by zero");
+
+		x /= y;
+	}
+
+	return builtin_num_result(argv, x);
 }
 
-lval* builtin_mul(lenv* e, lval* a)
+lval* builtin_mod_unchecked(lenv* e, int argc, lval** argv)
 {
-	return builtin_op(a, "*");
+	if (argv[0]->big != NULL || argv[1]->big != NULL)
+		return builtin_arith_big('%', argc, argv);
+
+	long x = argv[0]->num;
+	long y = argv[1]->num;
+
+	if (y == 0) return lval_err("division by zero");
+
+	// LONG_MIN % -1 is undefined in C
+	return builtin_num_result(argv, y == -1 ? 0 : x % y);
 }
 
-lval* builtin_head(lenv* e, lval* a)
+// Comparisons are true if every pair of adjacent arguments is ordered
+#define BUILTIN_COMPARE(name, op)              \
+	lval* builtin_##name##_unchecked(lenv* e, int argc, lval** argv) \
+	{                   \
+		for (int i = 1; i < argc; i++)           \
+		{                   \
+			lval* x = argv[i - 1];             \
+			lval* y = argv[i];              \
+			if (x->big == NULL && y->big == NULL ? !(x->num op y->num) \
+				: !(lval_num_cmp(x, y) op 0)) return lval_bool(false); \
+		}                   \
+		return lval_bool(true);             \
+	}
+
+BUILTIN_COMPARE(lt, <)
+BUILTIN_COMPARE(le, <=)
+BUILTIN_COMPARE(gt, >)
+BUILTIN_COMPARE(ge, >=)
+BUILTIN_COMPARE(numeq, ==)
+
+lval* builtin_head_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 1, "head");
-	LASSERT_TYPE(a, 0, LVAL_LIST, "head");
 	
-	LASSERT(a, a->cells[0]->count != 0, "function 'head' passed ()");
+	LASSERT_ARGV(argv[0]->count != 0, "function 'head' passed ()");
 
-	lval* lst = list_take(a, 0);
-	
-	while (lst->count > 1)
-	{
-		lval_del(list_pop(lst, 1));
-	}
+	lval* lst = argv[0];
+	argv[0] = NULL;
 	
 	return list_take(lst, 0);
 }
 
-lval* builtin_tail(lenv* e, lval* a)
+lval* builtin_tail_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 1, "tail");
+	LASSERT_ARGV(argv[0]->count != 0,
+				 "function 'tail' passed {}");
 
-	LASSERT_TYPE(a, 0, LVAL_LIST, "tail");
-	LASSERT(a, a->cells[0]->count != 0,
-			"function 'tail' passed {}");
-
-	lval* v = list_take(a, 0);
+	lval* v = argv[0];
+	argv[0] = NULL;
 	lval_del(list_pop(v, 0));
 	return v;
 }
 
-lval* builtin_list(lenv* e, lval* a)
+lval* builtin_list_unchecked(lenv* e, int argc, lval** argv)
 {
-	return a;
+	lval* res = lval_list();
+	if (argc == 0) return res;
+
+	list_reserve(res, argc);
+
+	for (int i = 0; i < argc; i++)
+	{
+		list_insert(res, i, argv[i]);
+		argv[i] = NULL;
+	}
+
+	return res;
 }
 
+
 lval* builtin_eval(lenv* e, lval* a)
 {
 	LASSERT_COUNT(a, 1, "eval");
@@ -223,31 +398,496 @@ lval* builtin_eval(lenv* e, lval* a)
 	return eval_lval(e, list_take(a, 0));
 }
 
-lval* builtin_join(lenv* e, lval* a)
+lval* builtin_join_unchecked(lenv* e, int argc, lval** argv)
 {
-	for (unsigned i = 0; i < a->count; i++)
-		LASSERT_TYPE(a, i, LVAL_LIST, "join");
+	lval* x = argv[0];
+	argv[0] = NULL;
 
-	lval* x = list_pop(a, 0);
+	for (int i = 1; i < argc; i++)
+	{
+		x = list_join(x, argv[i]);
+		argv[i] = NULL;
+	}
 
-	while (a->count)
+	return x;
+}
+
+lval* builtin_cons_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* lst = argv[1];
+	argv[1] = NULL;
+
+	list_insert(lst, 0, argv[0]);
+	argv[0] = NULL;
+
+	return lst;
+}
+
+lval* builtin_append_unchecked(lenv* e, int argc, lval** argv)
+{
+	if (argc == 0) return lval_list();
+	return builtin_join_unchecked(e, argc, argv);
+}
+
+lval* builtin_length_unchecked(lenv* e, int argc, lval** argv)
+{
+	return lval_num(argv[0]->count);
+}
+
+lval* builtin_nth_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* n = argv[1];
+	LASSERT_ARGV(n->big == NULL && n->num >= 0 && n->num < argv[0]->count,
+				 "function 'nth' passed index out of range");
+
+	lval* lst = argv[0];
+	argv[0] = NULL;
+	return list_take(lst, n->num);
+}
+
+lval* builtin_reverse_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* lst = argv[0];
+	argv[0] = NULL;
+
+	return list_reverse(lst);
+}
+
+lval* builtin_element_unchecked(lenv* e, int argc, lval** argv)
+{
+	if (IS_CHAR(argv[0]) && argv[1]->strategy == LIST_BYTES)
+		return lval_bool(memchr(argv[1]->bytes, argv[0]->ch, argv[1]->count) != NULL);
+
+	for (unsigned i = 0; i < argv[1]->count; i++)
 	{
-		x = list_join(x, list_pop(a, 0));
+		lval view;
+		if (lval_eq(argv[0], list_peek(argv[1], i, &view))) return lval_bool(true);
 	}
 
-	lval_del(a);
+	return lval_bool(false);
+}
+
+// Builtins don't support partial application, so higher-order ones return a
+// lambda, that calls the builtin with bound and missing arguments
+lval* builtin_partial(lbuiltin_func func, lbuiltin_argv_func argvFunc,
+					  int count, int argc, lval** argv)
+{
+	lenv* env = lenv_new(NULL);
+	lval* formals = lval_list();
+	lval* body = list_add(lval_list(), lval_builtin_argv(func, argvFunc));
+
+	for (int i = 0; i < count; i++)
+	{
+		char name[24];
+		snprintf(name, sizeof(name), "__arg%d", i);
+		lval* sym = lval_sym(name);
+		list_add(body, lval_copy(sym));
+
+		if (i < argc)
+		{
+			lenv_bind(env, sym, argv[i]);
+			lval_del(sym);
+		}
+		else list_add(formals, sym);
+	}
+
+	return lval_lambda(env, formals, body);
+}
+
+// Results replace elements of the list in place
+lval* builtin_map_unchecked(lenv* e, int argc, lval** argv)
+{
+	if (argc < 2) return builtin_partial(builtin_map, builtin_map_argv, 2, argc, argv);
+
+	lval* lst = argv[1];
+	argv[1] = NULL;
+
+	for (unsigned i = 0; i < lst->count; i++)
+	{
+		lval view;
+		lval* arg = list_peek(lst, i, &view);
+		lval* x = eval_call_argv(e, argv[0], 1, &arg);
+		if (IS_ERR(x))
+		{
+			lval_del(lst);
+			return x;
+		}
+
+		list_set(lst, i, x);
+	}
+
+	return lst;
+}
+
+// Kept elements are moved to the beginning of the list
+lval* builtin_filter_unchecked(lenv* e, int argc, lval** argv)
+{
+	if (argc < 2) return builtin_partial(builtin_filter, builtin_filter_argv, 2, argc, argv);
+
+	lval* lst = argv[1];
+	argv[1] = NULL;
+
+	size_t size = list_elem_size(lst);
+	unsigned kept = 0;
+	lst->hash = 0;
+	for (unsigned i = 0; i < lst->count; i++)
+	{
+		lval view;
+		lval* arg = list_peek(lst, i, &view);
+		lval* keep = eval_call_argv(e, argv[0], 1, &arg);
+
+		if (!IS_BOOL(keep))
+		{
+			if (!IS_ERR(keep))
+			{
+				lval_del(keep);
+				keep = lval_err("function 'filter' predicate result is not a Boolean");
+			}
+
+			memmove(lst->bytes + size * kept, lst->bytes + size * i, size * (lst->count - i));
+			lst->count -= i - kept;
+			lval_del(lst);
+			return keep;
+		}
+
+		if (keep->boolean) memmove(lst->bytes + size * kept++, lst->bytes + size * i, size);
+		else if (lst->strategy == LIST_CELLS) lval_del(lst->cells[i]);
+
+		lval_del(keep);
+	}
+
+	lst->count = kept;
+	return lst;
+}
+
+lval* builtin_foldl_unchecked(lenv* e, int argc, lval** argv)
+{
+	if (argc < 3) return builtin_partial(builtin_foldl, builtin_foldl_argv, 3, argc, argv);
+
+	lval* acc = argv[1];
+	argv[1] = NULL;
+
+	for (unsigned i = 0; i < argv[2]->count; i++)
+	{
+		lval view;
+		lval* args[2] = { acc, list_peek(argv[2], i, &view) };
+		lval* next = eval_call_argv(e, argv[0], 2, args);
+
+		lval_del(acc);
+		if (IS_ERR(next)) return next;
+		acc = next;
+	}
+
+	return acc;
+}
+
+lval* builtin_sort_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* err = sort_list(e, argv[0], argc == 2 ? argv[1] : NULL, "sort");
+	if (err != NULL) return err;
+
+	lval* lst = argv[0];
+	argv[0] = NULL;
+	return lst;
+}
+
+// Inserts after equal elements, like stable sort would
+lval* builtin_sorted_insert_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* lst = argv[1];
+	unsigned i;
+	lval* err = sort_bound(e, lst, argv[0], argc == 3 ? argv[2] : NULL,
+						   true, "sorted-insert", &i);
+	if (err != NULL) return err;
+
+	argv[1] = NULL;
+	list_insert(lst, i, argv[0]);
+	argv[0] = NULL;
+
+	return lst;
+}
+
+// Returns index of the first element equal to the value, or -1
+lval* builtin_binary_search_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* lst = argv[1];
+	lval* less = argc == 3 ? argv[2] : NULL;
+	unsigned i;
+	lval* err = sort_bound(e, lst, argv[0], less, false, "binary-search", &i);
+	if (err != NULL) return err;
+
+	if (i == lst->count) return lval_num(-1);
+
+	bool greater;
+	lval view;
+	err = sort_less(e, argv[0], list_peek(lst, i, &view), less, "binary-search", &greater);
+	if (err != NULL) return err;
+
+	return lval_num(greater ? -1 : (long) i);
+}
+
+// Returns the default value, if it is given and there is no such key
+lval* builtin_map_get_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* value = hamt_get(argv[0]->map, argv[1]);
+	if (value != NULL) return lval_copy(value);
+
+	LASSERT_ARGV(argc == 3, "function 'map-get' passed key, that is not in the map");
+
+	value = argv[2];
+	argv[2] = NULL;
+	return value;
+}
+
+lval* builtin_map_put_unchecked(lenv* e, int argc, lval** argv)
+{
+	hamt_node* map = hamt_put(argv[0]->map, argv[1], argv[2]);
+	argv[1] = NULL;
+	argv[2] = NULL;
+	return lval_map(map);
+}
+
+lval* builtin_map_del_unchecked(lenv* e, int argc, lval** argv)
+{
+	return lval_map(hamt_del(argv[0]->map, argv[1]));
+}
+
+void builtin_map_keys_add(void* data, lval* key, lval* value)
+{
+	list_add(data, lval_copy(key));
+}
+
+lval* builtin_map_keys_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* res = lval_list();
+	hamt_each(argv[0]->map, builtin_map_keys_add, res);
+	return res;
+}
+
+// Elements are (key value) lists, later keys replace earlier ones
+lval* builtin_alist_to_map_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* lst = list_generalize(argv[0]);
+	argv[0] = NULL;
+	hamt_node* map = NULL;
+
+	for (unsigned i = 0; i < lst->count; i++)
+	{
+		lval* pair = lst->cells[i];
+		if (IS_LIST(pair)) list_generalize(pair);
+		if (!IS_LIST(pair) || pair->count != 2)
+		{
+			hamt_release(map);
+			lval_del(lst);
+			return lval_err("function 'alist->map' passed element %u, that is not (key value)", i + 1);
+		}
+
+		hamt_node* next = hamt_put(map, pair->cells[0], pair->cells[1]);
+		pair->count = 0;
+		hamt_release(map);
+		map = next;
+	}
+
+	lval_del(lst);
+	return lval_map(map);
+}
+
+lval* builtin_list_to_set_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* lst = list_generalize(argv[0]);
+	argv[0] = NULL;
+	hamt_node* elements = NULL;
+
+	for (unsigned i = 0; i < lst->count; i++)
+	{
+		hamt_node* next = hamt_put(elements, lst->cells[i], NULL);
+		hamt_release(elements);
+		elements = next;
+	}
+
+	lst->count = 0;
+	lval_del(lst);
+	return lval_set(set_new(elements));
+}
+
+lval* builtin_set_to_list_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* res = lval_list();
+	hamt_each(argv[0]->set->elements, builtin_map_keys_add, res);
+	return res;
+}
+
+lval* builtin_set_contains_unchecked(lenv* e, int argc, lval** argv)
+{
+	return lval_bool(set_contains(argv[0]->set, argv[1]));
+}
+
+// Folds the sets from left to right with 'op'
+lval* builtin_set_op(int argc, lval** argv, lset* (*op)(lset*, lset*))
+{
+	lset* res = set_retain(argv[0]->set);
+
+	for (int i = 1; i < argc; i++)
+	{
+		lset* next = op(res, argv[i]->set);
+		set_release(res);
+		res = next;
+	}
+
+	return lval_set(res);
+}
+
+lval* builtin_set_union_unchecked(lenv* e, int argc, lval** argv)
+{
+	return builtin_set_op(argc, argv, set_union);
+}
+
+lval* builtin_set_intersection_unchecked(lenv* e, int argc, lval** argv)
+{
+	return builtin_set_op(argc, argv, set_intersection);
+}
+
+lval* builtin_set_difference_unchecked(lenv* e, int argc, lval** argv)
+{
+	return builtin_set_op(argc, argv, set_difference);
+}
+
+// Lambdas generated by 'defrecord' pass index of the record type and index of
+// the slot as Numbers
+record_type* builtin_record_type(lval* id)
+{
+	return IS_NUM(id) && id->big == NULL ? record_type_get(id->num) : NULL;
+}
+
+bool builtin_record_slot(record_type* type, lval* index)
+{
+	return IS_NUM(index) && index->big == NULL && index->num >= 0 && index->num < type->count;
+}
+
+lval* builtin_record_make_unchecked(lenv* e, int argc, lval** argv)
+{
+	record_type* type = builtin_record_type(argv[0]);
+	LASSERT_ARGV(type != NULL, "function '__record-make' passed unknown record type");
+	LASSERT_ARGV(argc - 1 == type->count,
+				 "function 'make-%s' passed %d arguments, expected %u", type->name, argc - 1, type->count);
+
+	lval* res = lval_record(argv[0]->num);
+	for (int i = 1; i < argc; i++)
+	{
+		res->slots[i - 1] = argv[i];
+		argv[i] = NULL;
+	}
+
+	return res;
+}
+
+// Checks arguments of accessor and modifier, the record is the third one
+lval* builtin_record_check(lval** argv, const char* prefix, const char* name)
+{
+	record_type* type = builtin_record_type(argv[0]);
+	if (type == NULL || !builtin_record_slot(type, argv[1]))
+		return lval_err("function '%s' passed unknown record field", name);
+
+	lval* x = argv[2];
+	if (IS_RECORD(x) && x->recordType == argv[0]->num) return NULL;
+
+	// Types are registered in order, so the one with smaller index is stale
+	if (IS_RECORD(x) && strcmp(record_type_get(x->recordType)->name, type->name) == 0)
+		return x->recordType < argv[0]->num
+			? lval_err("function '%s-%s%s' passed %s of redefined record type", type->name,
+					   prefix, type->fields[argv[1]->num], type->name)
+			: lval_err("function '%s-%s%s' belongs to redefined record type '%s'", type->name,
+					   prefix, type->fields[argv[1]->num], type->name);
+
+	return lval_err("function '%s-%s%s' passed %s, expected %s", type->name, prefix,
+					type->fields[argv[1]->num],
+					IS_RECORD(x) ? record_type_get(x->recordType)->name : lval_type_str(x->type),
+					type->name);
+}
+
+// The slot is moved out of the record, that is deleted anyway
+lval* builtin_record_get_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* err = builtin_record_check(argv, "", "__record-get");
+	if (err != NULL) return err;
+
+	lval* x = argv[2]->slots[argv[1]->num];
+	argv[2]->slots[argv[1]->num] = NULL;
 	return x;
 }
 
+// Returns the record with one slot replaced
+lval* builtin_record_set_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* err = builtin_record_check(argv, "set-", "__record-set");
+	if (err != NULL) return err;
+
+	lval* res = argv[2];
+	argv[2] = NULL;
+	lval_del(res->slots[argv[1]->num]);
+	res->slots[argv[1]->num] = argv[3];
+	argv[3] = NULL;
+
+	return res;
+}
+
+lval* builtin_record_is_unchecked(lenv* e, int argc, lval** argv)
+{
+	LASSERT_ARGV(builtin_record_type(argv[0]) != NULL, "function '__record-is' passed unknown record type");
+
+	return lval_bool(IS_RECORD(argv[1]) && argv[1]->recordType == argv[0]->num);
+}
+
 void add_builtin(lenv* env, const char* name, lbuiltin_func func)
+{
+	add_builtin_argv(env, name, func, NULL);
+}
+
+void add_builtin_argv(lenv* env, const char* name, lbuiltin_func func,
+					  lbuiltin_argv_func argvFunc)
 {
 	lval* key = lval_sym(name);
-	lval* value = lval_builtin(func);
+	lval* value = lval_builtin_argv(func, argvFunc);
 	lenv_put(env, key, value);
 	lval_del(key);
 	lval_del(value);
 }
 
+// Adds macro, that calls builtin with its arguments quoted except the
+// 'evaluated' one: (dotimes var count body) -> (__dotimes 'var count 'body)
+void add_builtin_macro(lenv* env, const char* name, const char* builtin,
+					   const char** formals, unsigned count, int evaluated)
+{
+	lval* params = lval_list();
+	lval* body = list_add(lval_list(), lval_sym(builtin));
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		list_add(params, lval_sym(formals[i]));
+		list_add(body, (int) i == evaluated
+				 ? lval_sym(formals[i])
+				 : lval_quote(lval_sym(formals[i])));
+	}
+
+	lval* key = lval_sym(name);
+	lval* value = lval_macro(params, body);
+	lenv_put(env, key, value);
+	lval_del(key);
+	lval_del(value);
+}
+
+lval* builtin_call_argv(lenv* e, lbuiltin_argv_func func, lval* a)
+{
+	lval* res = func(e, a->count, a->cells);
+
+	for (unsigned i = 0; i < a->count; i++)
+		if (a->cells[i] != NULL) lval_del(a->cells[i]);
+
+	a->count = 0;
+	lval_del(a);
+	return res;
+}
+
 lval* builtin_def(lenv* env, lval* a)
 {
 	LASSERT_COUNT(a, 2, "def");
@@ -284,6 +924,153 @@ lval* builtin_set(lenv* e, lval* a)
 	return list_take(a, 1);
 }
 
+// Returns borrowed value of 'type' bound to the first argument or new error
+lval* builtin_mut_binding(lenv* e, lval* a, lval_type type, const char* name)
+{
+	lval* x = lenv_lookup_mut(e, a->cells[0]);
+
+	if (x == NULL)
+		return lval_err("symbol '%s' is not bound to anything", a->cells[0]->sym);
+	if (x->type != type)
+		return lval_err("function '%s' passed symbol '%s', that is not bound to a %s",
+						name, a->cells[0]->sym, lval_type_str(type));
+	return x;
+}
+
+lval* builtin_push(lenv* e, lval* a)
+{
+	LASSERT_COUNT(a, 2, "push!");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "push!");
+
+	lval* lst = builtin_mut_binding(e, a, LVAL_LIST, "push!");
+	if (!IS_ERR(lst)) list_insert(lst, lst->count, list_pop(a, 1));
+
+	lval_del(a);
+	return IS_ERR(lst) ? lst : lval_list();
+}
+
+lval* builtin_pop(lenv* e, lval* a)
+{
+	LASSERT_COUNT(a, 1, "pop!");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "pop!");
+
+	lval* lst = builtin_mut_binding(e, a, LVAL_LIST, "pop!");
+	lval_del(a);
+	if (IS_ERR(lst)) return lst;
+
+	if (lst->count == 0) return lval_err("function 'pop!' passed empty List");
+	return list_pop(lst, lst->count - 1);
+}
+
+lval* builtin_set_nth(lenv* e, lval* a)
+{
+	LASSERT_COUNT(a, 3, "set-nth!");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "set-nth!");
+	LASSERT_TYPE(a, 1, LVAL_NUM, "set-nth!");
+
+	lval* lst = builtin_mut_binding(e, a, LVAL_LIST, "set-nth!");
+	if (IS_ERR(lst))
+	{
+		lval_del(a);
+		return lst;
+	}
+
+	lval* n = a->cells[1];
+	LASSERT(a, n->big == NULL && n->num >= 0 && n->num < lst->count,
+			"function 'set-nth!' passed index out of range");
+
+	list_set(lst, n->num, list_pop(a, 2));
+	lval_del(a);
+	return lval_list();
+}
+
+lval* builtin_list_reserve(lenv* e, lval* a)
+{
+	LASSERT_COUNT(a, 2, "list-reserve!");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "list-reserve!");
+	LASSERT_TYPE(a, 1, LVAL_NUM, "list-reserve!");
+
+	lval* n = a->cells[1];
+	LASSERT(a, n->big == NULL && n->num >= 0 && n->num <= UINT_MAX,
+			"function 'list-reserve!' passed invalid capacity");
+
+	lval* lst = builtin_mut_binding(e, a, LVAL_LIST, "list-reserve!");
+	if (!IS_ERR(lst)) list_reserve(lst, n->num);
+
+	lval_del(a);
+	return IS_ERR(lst) ? lst : lval_list();
+}
+
+// Appends text of a String, a Character, a Number or a String builder
+lval* builtin_sb_append_value(lval* sb, lval* x, const char* name, int i)
+{
+	switch (x->type)
+	{
+	case LVAL_STR:
+		if (x->rope == NULL) builder_append(sb, x->str, strlen(x->str));
+		else
+		{
+			rope_write(x->rope, builder_reserve(sb, x->rope->length));
+			sb->sbLength += x->rope->length;
+			sb->sbText[sb->sbLength] = '\0';
+		}
+		return NULL;
+	case LVAL_CHAR:
+		builder_append(sb, &x->ch, 1);
+		return NULL;
+	case LVAL_BUILDER:
+		if (x->sbText != NULL) builder_append(sb, x->sbText, x->sbLength);
+		return NULL;
+	case LVAL_NUM:
+		if (x->big != NULL)
+		{
+			char* str = bignum_to_str(x->big);
+			builder_append(sb, str, strlen(str));
+			free(str);
+		}
+		else
+			sb->sbLength += sprintf(builder_reserve(sb, MAX_INT_STR_LENGTH), "%ld", x->num);
+		return NULL;
+	default:
+		return lval_err("function '%s' passed incorrect type for argument %i. "
+						"Got %s, expected String, Character, Number or String builder",
+						name, i + 1, lval_type_str(x->type));
+	}
+}
+
+lval* builtin_sb_append(lenv* e, lval* a)
+{
+	LASSERT(a, a->count >= 1, "function 'sb-append!' passed not enough arguments");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "sb-append!");
+
+	lval* sb = builtin_mut_binding(e, a, LVAL_BUILDER, "sb-append!");
+	for (unsigned i = 1; i < a->count && !IS_ERR(sb); i++)
+	{
+		lval view;
+		lval* err = builtin_sb_append_value(sb, list_peek(a, i, &view), "sb-append!", i);
+		if (err != NULL) sb = err;
+	}
+
+	lval_del(a);
+	return IS_ERR(sb) ? sb : lval_list();
+}
+
+// Takes the text of the builder bound to a symbol, leaving it empty, or of a
+// builder value
+lval* builtin_sb_to_string(lenv* e, lval* a)
+{
+	LASSERT_COUNT(a, 1, "sb->string");
+	LASSERT_TYPE2(a, 0, LVAL_SYM, LVAL_BUILDER, "sb->string");
+
+	lval* sb = IS_SYM(a->cells[0])
+		? builtin_mut_binding(e, a, LVAL_BUILDER, "sb->string")
+		: a->cells[0];
+
+	lval* res = IS_ERR(sb) ? sb : builder_take(sb);
+	lval_del(a);
+	return res;
+}
+
 lval* builtin_lambda(lenv* e, lval* a)
 {
 	LASSERT_COUNT(a, 2, "\\");
@@ -291,29 +1078,111 @@ lval* builtin_lambda(lenv* e, lval* a)
 	LASSERT_TYPE(a, 0, LVAL_LIST, "\\");
 	LASSERT_TYPE(a, 1, LVAL_LIST, "\\");
 
+	// Code may be built at runtime
+	list_generalize_deep(a);
+
 	for (unsigned i = 0; i < a->cells[0]->count; i++)
 		LASSERT_ELEMENT_TYPE(a, a->cells[0]->cells, i, LVAL_SYM, "\\", "parameters");
 
-	lval* formals = list_pop(a, 0);
+	lval* formals = list_pop(a, 0);
+
+	// checking for proper use of '&'
+	for (unsigned i = 0; i < formals->count; i++)
+	{
+		if (strcmp(formals->cells[i]->sym, "&") == 0)
+		{
+			if (!(formals->count == 3 && i == 1))
+			{
+				lval_del(formals);
+				lval_del(a);
+				return lval_err("inappropriate usage of '&'");
+			}
+		}
+	}
+
+	lval* body = list_pop(a, 0);
+	lval_del(a);
+
+	return lval_lambda(lenv_new(NULL), formals, body);
+}
+
+// Lambda '(\ (__arg0 ...) (<builtin> type [slot] __arg0 ...))'. The builtin is
+// called by name, so the optimizer can inline the lambda
+lval* builtin_record_lambda(const char* builtin, unsigned type, long slot, unsigned count)
+{
+	lval* formals = lval_list();
+	lval* body = list_add(lval_list(), lval_sym(builtin));
+	list_add(body, lval_num(type));
+	if (slot >= 0) list_add(body, lval_num(slot));
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		char name[24];
+		snprintf(name, sizeof(name), "__arg%u", i);
+		list_add(formals, lval_sym(name));
+		list_add(body, lval_sym(name));
+	}
+
+	return lval_lambda(lenv_new(NULL), formals, body);
+}
+
+// Defines global '<format with name and field>' as 'value', that is deleted
+void builtin_record_def(lenv* e, const char* format, const char* name, const char* field, lval* value)
+{
+	char* str = malloc(strlen(format) + strlen(name) + strlen(field) + 1);
+	DIE_IF_NULL(str);
+	sprintf(str, format, name, field);
+	lval* sym = lval_sym(str);
+	free(str);
+
+	lenv_def(e, sym, value);
+	lval_del(sym);
+	lval_del(value);
+}
+
+// (__defrecord 'point '(x y)) defines 'make-point', 'point?', accessors
+// 'point-x', 'point-y' and modifiers 'point-set-x', 'point-set-y'
+lval* builtin_defrecord(lenv* e, lval* a)
+{
+	LASSERT_COUNT(a, 2, "defrecord");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "defrecord");
+	LASSERT_TYPE(a, 1, LVAL_LIST, "defrecord");
 
-	// checking for proper use of '&'
-	for (unsigned i = 0; i < formals->count; i++)
+	lval* fields = list_generalize(a->cells[1]);
+	LASSERT(a, fields->count != 0, "function 'defrecord' passed no fields");
+
+	for (unsigned i = 0; i < fields->count; i++)
 	{
-		if (strcmp(formals->cells[i]->sym, "&") == 0)
+		LASSERT_ELEMENT_TYPE(a, fields->cells, i, LVAL_SYM, "defrecord", "fields");
+		for (unsigned j = 0; j < i; j++)
 		{
-			if (!(formals->count == 3 && i == 1))
+			if (strcmp(fields->cells[i]->sym, fields->cells[j]->sym) == 0)
 			{
-				lval_del(formals);
+				lval* err = lval_err("function 'defrecord' passed field '%s' twice", fields->cells[i]->sym);
 				lval_del(a);
-				return lval_err("inappropriate usage of '&'");
+				return err;
 			}
 		}
 	}
 
-	lval* body = list_pop(a, 0);
-	lval_del(a);
+	const char* name = a->cells[0]->sym;
+	unsigned type = record_type_add(name, fields);
 
-	return lval_lambda(lenv_new(NULL), formals, body);
+	builtin_record_def(e, "make-%s%s", name, "",
+					   builtin_record_lambda("__record-make", type, -1, fields->count));
+	builtin_record_def(e, "%s?%s", name, "",
+					   builtin_record_lambda("__record-is", type, -1, 1));
+
+	for (unsigned i = 0; i < fields->count; i++)
+	{
+		const char* field = fields->cells[i]->sym;
+		builtin_record_def(e, "%s-%s", name, field,
+						   builtin_record_lambda("__record-get", type, i, 1));
+		builtin_record_def(e, "%s-set-%s", name, field,
+						   builtin_record_lambda("__record-set", type, i, 2));
+	}
+
+	return list_take(a, 0);
 }
 
 lval* builtin_exit(lenv* e, lval* a)
@@ -341,36 +1210,48 @@ lval* builtin_exit(lenv* e, lval* a)
 	}
 }
 
-lval* builtin_eq(lenv* e, lval* a)
+lval* builtin_specialize(lenv* e, lval* a)
 {
-	LASSERT_COUNT(a, 2, "eq");
+	LASSERT(a, a->count != 0, "function 'specialize' passed not enough arguments");
+	LASSERT_TYPE(a, 0, LVAL_LAMBDA, "specialize");
 
-	lval* res = lval_bool(lval_eq(a->cells[0], a->cells[1]));
+	lval* func = list_pop(a, 0);
+	if (a->count >= func->formals->count)
+	{
+		lval_del(func);
+		LASSERT(a, false, "function 'specialize' passed too much arguments");
+	}
+
+	bool canSpecialize = func->env->count == 0;
+	for (unsigned i = 0; i < a->count; i++)
+		if (strcmp(func->formals->cells[i]->sym, "&") == 0) canSpecialize = false;
 
+	lval* res = canSpecialize ? optimizer_specialize(e, func, lval_copy(a), NULL) : NULL;
+
+	// Falling back to partial application
+	if (res == NULL) return eval_func_call(e, func, a);
+
+	lval_del(func);
 	lval_del(a);
 	return res;
 }
 
-lval* builtin_less(lenv* e, lval* a)
+lval* builtin_eq_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 2, "less");
-	LASSERT_TYPE(a, 0, LVAL_NUM, "less");
-	LASSERT_TYPE(a, 1, LVAL_NUM, "less");
-
-	lval* res = lval_bool((a->cells[0]->num < a->cells[1]->num));
-	lval_del(a);
-	return res;
+	return lval_bool(lval_eq(argv[0], argv[1]));
 }
 
-lval* builtin_not(lenv* e, lval* a)
+lval* builtin_less_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 1, "not");
-	LASSERT_TYPE(a, 0, LVAL_BOOL, "not");
+	if (argv[0]->big == NULL && argv[1]->big == NULL)
+		return lval_bool(argv[0]->num < argv[1]->num);
 
-	lval* res = lval_bool(!a->cells[0]->boolean);
-	;
-	lval_del(a);
-	return res;
+	return lval_bool(lval_num_cmp(argv[0], argv[1]) < 0);
+}
+
+lval* builtin_not_unchecked(lenv* e, int argc, lval** argv)
+{
+	return lval_bool(!argv[0]->boolean);
 }
 
 lval* builtin_cond(lenv* e, lval* a)
@@ -431,6 +1312,250 @@ lval* builtin_cond(lenv* e, lval* a)
 	return res;
 }
 
+bool builtin_case_key(lval* key)
+{
+	return IS_NUM(key) || IS_STR(key) || IS_CHAR(key) || IS_SYM(key) || IS_BOOL(key);
+}
+
+lval* builtin_case_table(lval** clauses, unsigned count, hamt_node** table)
+{
+	hamt_node* res = NULL;
+	lval* err = NULL;
+
+	for (unsigned i = 0; i < count && err == NULL; i++)
+	{
+		lval* clause = clauses[i];
+		if (!IS_LIST(clause) || clause->count == 0)
+		{
+			err = lval_err("function 'case' clause %u is not a list with keys", i + 1);
+			break;
+		}
+
+		list_generalize(clause);
+		lval* keys = clause->cells[0];
+		if (IS_SYM(keys) && strcmp(keys->sym, "else") == 0)
+		{
+			if (i + 1 != count) err = lval_err("function 'case' clause 'else' is not the last");
+			else
+			{
+				hamt_node* next = hamt_put(res, lval_list(), lval_num(i));
+				hamt_release(res);
+				res = next;
+			}
+			break;
+		}
+
+		if (IS_LIST(keys)) list_generalize(keys);
+		unsigned keyCount = IS_LIST(keys) ? keys->count : 1;
+		for (unsigned j = 0; j < keyCount && err == NULL; j++)
+		{
+			lval* key = IS_LIST(keys) ? keys->cells[j] : keys;
+			if (!builtin_case_key(key))
+				err = lval_err("function 'case' passed key of type %s, expected Number, String, Character, Symbol or Boolean",
+							   lval_type_str(key->type));
+			else if (hamt_contains(res, key))
+			{
+				lval* str = lval_to_str(key);
+				err = lval_err("function 'case' passed key '%s' twice", str->str);
+				lval_del(str);
+			}
+			else
+			{
+				hamt_node* next = hamt_put(res, lval_copy(key), lval_num(i));
+				hamt_release(res);
+				res = next;
+			}
+		}
+	}
+
+	if (err != NULL)
+	{
+		hamt_release(res);
+		return err;
+	}
+
+	*table = res;
+	return NULL;
+}
+
+// Evaluates expressions of the chosen clause, returns the last value. Value
+// () can't be a key, so it finds 'else' clause
+lval* builtin_case_dispatch(lenv* e, lval* value, lval** clauses, hamt_node* table)
+{
+	lval* index = hamt_get(table, value);
+	if (index == NULL)
+	{
+		lval* nil = lval_list();
+		index = hamt_get(table, nil);
+		lval_del(nil);
+	}
+
+	lval* res = lval_list();
+	if (index == NULL) return res;
+
+	lval* clause = clauses[index->num];
+	for (unsigned i = 1; i < clause->count && !IS_ERR(res); i++)
+	{
+		lval_del(res);
+		res = eval_lval(e, clause->cells[i]);
+		clause->cells[i] = NULL;
+	}
+
+	return res;
+}
+
+// (case value '(key exprs...) '((key key...) exprs...) '(else exprs...))
+lval* builtin_case(lenv* e, lval* a)
+{
+	LASSERT(a, a->count != 0, "function 'case' passed not enough arguments");
+
+	hamt_node* table;
+	lval* err = builtin_case_table(a->cells + 1, a->count - 1, &table);
+	if (err != NULL)
+	{
+		lval_del(a);
+		return err;
+	}
+
+	lval* res = builtin_case_dispatch(e, a->cells[0], a->cells + 1, table);
+	hamt_release(table);
+	lval_del(a);
+	return res;
+}
+
+lval* builtin_case_jump(lenv* e, lval* a)
+{
+	lval* table = list_pop(a, a->count - 1);
+	lval* res = builtin_case_dispatch(e, a->cells[0], a->cells + 1, table->map);
+	lval_del(table);
+	lval_del(a);
+	return res;
+}
+
+// Evaluates copies of loop body 'a->cells[first...]' in 'env'. Returns error
+// or NULL
+lval* builtin_loop_body(lenv* env, lval* a, unsigned first)
+{
+	for (unsigned i = first; i < a->count; i++)
+	{
+		lval* res = eval_lval(env, lval_copy(a->cells[i]));
+		if (IS_ERR(res)) return res;
+		lval_del(res);
+	}
+
+	return NULL;
+}
+
+// Loops evaluate quoted test and body in a loop without calls: (__while 'test
+// 'body...), (__dotimes 'var count 'body...), (__for-each 'var list 'body...).
+// Loop variable is bound in one frame for all iterations, other variables
+// are changed with '__set'. '__set' on the variable of '__dotimes' changes the
+// counter, '__for-each' rebinds its variable on every iteration. Result is ()
+lval* builtin_while(lenv* e, lval* a)
+{
+	LASSERT(a, a->count != 0, "function 'while' passed not enough arguments");
+
+	while (true)
+	{
+		lval* test = eval_lval(e, lval_copy(a->cells[0]));
+		if (IS_ERR(test))
+		{
+			lval_del(a);
+			return test;
+		}
+
+		if (!IS_BOOL(test))
+		{
+			lval_del(test);
+			LASSERT(a, false, "function 'while' test result is not a Boolean");
+		}
+
+		bool cond = test->boolean;
+		lval_del(test);
+		if (!cond) break;
+
+		lval* err = builtin_loop_body(e, a, 1);
+		if (err != NULL)
+		{
+			lval_del(a);
+			return err;
+		}
+	}
+
+	lval_del(a);
+	return lval_list();
+}
+
+lval* builtin_dotimes(lenv* e, lval* a)
+{
+	LASSERT(a, a->count >= 2, "function 'dotimes' passed not enough arguments");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "dotimes");
+	LASSERT_TYPE(a, 1, LVAL_NUM, "dotimes");
+	LASSERT(a, a->cells[1]->big == NULL, "function 'dotimes' passed too big count");
+
+	lenv* frame = lenv_new(e);
+	lval* zero = lval_num(0);
+	lenv_bind(frame, a->cells[0], zero);
+	lval_del(zero);
+	lval* err = NULL;
+
+	// Counter is the binding itself, so the body may change it with '__set'
+	while (err == NULL)
+	{
+		lval* i = frame->entries[0].value;
+		if (!IS_NUM(i) || i->big != NULL)
+		{
+			err = lval_err("function 'dotimes' loop variable is not a small number");
+			break;
+		}
+		if (i->num >= a->cells[1]->num) break;
+
+		err = builtin_loop_body(frame, a, 2);
+		if (err == NULL && IS_NUM(frame->entries[0].value)
+			&& frame->entries[0].value->big == NULL)
+			frame->entries[0].value->num++;
+	}
+
+	lenv_del(frame);
+	lval_del(a);
+	return err != NULL ? err : lval_list();
+}
+
+lval* builtin_for_each(lenv* e, lval* a)
+{
+	LASSERT(a, a->count >= 2, "function 'for-each' passed not enough arguments");
+	LASSERT_TYPE(a, 0, LVAL_SYM, "for-each");
+	LASSERT_TYPE2(a, 1, LVAL_LIST, LVAL_STR, "for-each");
+
+	// Strings are iterated by characters
+	if (IS_STR(a->cells[1]))
+	{
+		lval* chars = builtin_string_to_list_unchecked(e, 1, &a->cells[1]);
+		if (IS_ERR(chars))
+		{
+			lval_del(a);
+			return chars;
+		}
+		lval_del(a->cells[1]);
+		a->cells[1] = chars;
+	}
+
+	lenv* frame = lenv_new(e);
+	lval* lst = a->cells[1];
+	lval* err = NULL;
+
+	for (unsigned i = 0; i < lst->count && err == NULL; i++)
+	{
+		lval view;
+		lenv_bind(frame, a->cells[0], list_peek(lst, i, &view));
+		err = builtin_loop_body(frame, a, 2);
+	}
+
+	lenv_del(frame);
+	lval_del(a);
+	return err != NULL ? err : lval_list();
+}
+
 lval* builtin_if(lenv* e, lval* a)
 {
 	LASSERT_COUNT(a, 3, "if");
@@ -461,7 +1586,7 @@ lval* builtin_load_impl(lenv* e, lval* a, bool isMain)
 	LASSERT_TYPE(a, 0, LVAL_STR, "load");
 
 	mpc_result_t r;
-	if (mpc_parse_contents(a->cells[0]->str,
+	if (mpc_parse_contents(lval_str_flat(a->cells[0]),
 						(mpc_parser_t*) get_parser_lispy(), &r))
 	{
 		lval* expr = read_lval(r.output);
@@ -516,42 +1641,31 @@ lval* builtin_load_impl(lenv* e, lval* a, bool isMain)
 	}
 }
 
-lval* builtin_print(lenv* e, lval* a)
+lval* builtin_print_unchecked(lenv* e, int argc, lval** argv)
 {
-	for (unsigned i = 0; i < a->count; i++)
-		lval_print(a->cells[i]);
+	for (int i = 0; i < argc; i++)
+		lval_print(argv[i]);
 
-	lval_del(a);
 	return lval_list();
 }
 
-lval* builtin_println(lenv* e, lval* a)
+lval* builtin_println_unchecked(lenv* e, int argc, lval** argv)
 {
-	for (unsigned i = 0; i < a->count; i++)
-		lval_print(a->cells[i]);
+	for (int i = 0; i < argc; i++)
+		lval_print(argv[i]);
 
 	printf("\n");
-	lval_del(a);
 	return lval_list();
 }
 
-lval* builtin_error(lenv* e, lval* a)
+lval* builtin_error_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 1, "error");
-	LASSERT_TYPE(a, 0, LVAL_STR, "error");
-
-	lval* res = lval_err(a->cells[0]->str);
-	lval_del(a);
-	return res;
+	return lval_err(lval_str_flat(argv[0]));
 }
 
-lval* builtin_typeq(lenv* e, lval* a)
+lval* builtin_typeq_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 2, "typeq");
-
-	lval* res = lval_bool(a->cells[0]->type == a->cells[1]->type);
-	lval_del(a);
-	return res;
+	return lval_bool(argv[0]->type == argv[1]->type);
 }
 
 lval* builtin_macro_internal(lenv* e, lval* a)
@@ -560,6 +1674,8 @@ lval* builtin_macro_internal(lenv* e, lval* a)
 	LASSERT_TYPE(a, 0, LVAL_LIST, "__macro");
 	LASSERT_TYPE(a, 1, LVAL_LIST, "__macro");
 
+	list_generalize_deep(a);
+
 	for (unsigned i = 0; i < a->cells[0]->count; i++)
 		LASSERT_ELEMENT_TYPE(a, a->cells[0]->cells, i, LVAL_SYM, "__macro", "parameters");
 
@@ -602,74 +1718,291 @@ lval* builtin_macroexpand(lenv* e, lval* a)
 	return builtin_println(e, list_add(lval_list(), expanded));
 }
 
-lval* builtin_headstr(lenv* e, lval* a)
+lval* builtin_headstr_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 1, "headstr");
-	LASSERT_TYPE(a, 0, LVAL_STR, "headstr");
+	const char* str = lval_str_flat(argv[0]);
+	
+	LASSERT_ARGV(str[0] != '\0', "function 'headstr' passed empty string");
 	
-	LASSERT(a, a->cells[0]->str[0] != '\0', "function 'headstr' passed empty string");
+	return lval_char(str[0]);
+}
+
+lval* builtin_tailstr_unchecked(lenv* e, int argc, lval** argv)
+{
 	
-	lval* v = list_take(a, 0);
+	LASSERT_ARGV(lval_str_length(argv[0]) != 0, "function 'tailstr' passed empty string");
 	
-	char r = v->str[0];
-	lval_del(v);
+	// Text of ropes is shared
+	if (argv[0]->rope != NULL) return lval_str_sub(argv[0], 1, lval_str_length(argv[0]));
+
+	// Moving the rest of the string in place
+	lval* str = argv[0];
+	argv[0] = NULL;
+	memmove(str->str, str->str + 1, strlen(str->str));
+	str->hash = 0;
 	
-	return lval_str_char(r);
+	return str;
 }
 
-lval* builtin_tailstr(lenv* e, lval* a)
+// Long results are ropes, so appending to them copies only the short pieces
+lval* builtin_joinstr_rope(int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 1, "tailstr");
-	LASSERT_TYPE(a, 0, LVAL_STR, "tailstr");
-	
-	LASSERT(a, a->cells[0]->str[0] != '\0', "function 'tailstr' passed empty string");
+	lrope* rope = NULL;
+	for (int i = 0; i < argc; i++)
+	{
+		lval* x = argv[i];
+		lrope* piece;
+
+		if (IS_CHAR(x)) piece = rope_new_copy(&x->ch, 1);
+		else if (x->rope != NULL) piece = rope_retain(x->rope);
+		else
+		{
+			// Taking the text of the argument
+			argv[i] = NULL;
+			piece = rope_new(x->str, strlen(x->str));
+			x->str = NULL;
+			lval_del(x);
+		}
+
+		rope = rope == NULL ? piece : rope_concat(rope, piece);
+	}
+
+	return lval_str_rope(rope);
+}
+
+// Characters are joined like one-character strings
+lval* builtin_joinstr_unchecked(lenv* e, int argc, lval** argv)
+{
+	size_t length = 0;
+	for (int i = 0; i < argc; i++)
+		length += IS_STR(argv[i]) ? lval_str_length(argv[i]) : 1;
+
+	if (length >= ROPE_MIN_LENGTH) return builtin_joinstr_rope(argc, argv);
 	
-	lval* str = list_take(a, 0);
 	lval* res = lval_str_null();
-	
-	res->str = malloc(strlen(str->str));
+	res->str = malloc(length + 1);
 	DIE_IF_NULL(res->str);
 	
-	strcpy(res->str, str->str + 1);
+	char* end = res->str;
+	for (int i = 0; i < argc; i++)
+	{
+		if (IS_CHAR(argv[i]))
+		{
+			*end++ = argv[i]->ch;
+			continue;
+		}
+
+		size_t size = strlen(argv[i]->str);
+		memcpy(end, argv[i]->str, size);
+		end += size;
+	}
+	*end = '\0';
 	
-	lval_del(str);
 	return res;
 }
 
-lval* builtin_joinstr(lenv* e, lval* a)
+lval* builtin_string_to_list_unchecked(lenv* e, int argc, lval** argv)
 {
-	for (unsigned i = 0; i < a->count; i++)
-		LASSERT_TYPE(a, i, LVAL_STR, "joinstr");
-	
-	lval* res = lval_str("");
-	
-	while (a->count)
+	const char* str = lval_str_flat(argv[0]);
+	size_t length = strlen(str);
+	LASSERT_ARGV(length <= UINT_MAX, "function 'string->list' passed too long string");
+
+	lval* res = lval_list();
+	if (length == 0) return res;
+
+	res->strategy = LIST_BYTES;
+	list_reserve(res, length);
+	memcpy(res->bytes, str, length);
+	res->count = length;
+	return res;
+}
+
+lval* builtin_string_length_unchecked(lenv* e, int argc, lval** argv)
+{
+	return lval_num(lval_str_length(argv[0]));
+}
+
+// Strings and characters are accepted, where a piece of text is expected
+// Converts Number argument 'i' to a position in a string of 'length' bytes
+#define LASSERT_ARGV_POS(argv, i, length, pos, funcname)           \
+	do {                                                           \
+		LASSERT_ARGV(argv[i]->big == NULL && argv[i]->num >= 0     \
+					 && (size_t) argv[i]->num <= length,           \
+					 "function '" funcname "' passed index out of range"); \
+		pos = argv[i]->num;                                        \
+	} while (false)
+
+lval* builtin_substring_unchecked(lenv* e, int argc, lval** argv)
+{
+	size_t length = lval_str_length(argv[0]);
+	size_t start, end = length;
+	LASSERT_ARGV_POS(argv, 1, length, start, "substring");
+	if (argc == 3) LASSERT_ARGV_POS(argv, 2, length, end, "substring");
+	LASSERT_ARGV(start <= end, "function 'substring' passed end before start");
+
+	return lval_str_sub(argv[0], start, end);
+}
+
+lval* builtin_string_index_unchecked(lenv* e, int argc, lval** argv)
+{
+	const char* str = lval_str_flat(argv[0]);
+	size_t length = strlen(str);
+	size_t start = 0;
+	if (argc == 3) LASSERT_ARGV_POS(argv, 2, length, start, "string-index");
+
+	char buf[2];
+	const char* needle = lval_text(argv[1], buf);
+	const char* found = strscan_find(str + start, length - start, needle, strlen(needle));
+
+	return lval_num(found != NULL ? found - str : -1);
+}
+
+// Empty fields are kept: (string-split ",a," ",") is ("" "a" "")
+lval* builtin_string_split_unchecked(lenv* e, int argc, lval** argv)
+{
+	char buf[2];
+	const char* sep = lval_text(argv[1], buf);
+	size_t sepLength = strlen(sep);
+	LASSERT_ARGV(sepLength != 0, "function 'string-split' passed empty separator");
+
+	const char* str = lval_str_flat(argv[0]);
+	const char* end = str + strlen(str);
+
+	lval* res = lval_list();
+	while (true)
 	{
-		lval* str = list_pop(a, 0);
-		
-		if (str->str[0] == '\0')
+		const char* found = strscan_find(str, end - str, sep, sepLength);
+		if (found == NULL) break;
+
+		list_add(res, lval_str_n(str, found - str));
+		str = found + sepLength;
+	}
+
+	return list_add(res, lval_str_n(str, end - str));
+}
+
+lval* builtin_string_join_unchecked(lenv* e, int argc, lval** argv)
+{
+	char sepBuf[2];
+	const char* sep = "";
+	if (argc == 2) sep = lval_text(argv[1], sepBuf);
+
+	lval* lst = argv[0];
+	size_t sepLength = strlen(sep);
+	size_t length = 0;
+	for (unsigned i = 0; i < lst->count; i++)
+	{
+		lval view;
+		lval* x = list_peek(lst, i, &view);
+		LASSERT_ARGV(IS_STR(x) || IS_CHAR(x),
+					 "function 'string-join' passed list with incorrect element %u. "
+					 "Got %s, expected String or Character", i + 1, lval_type_str(x->type));
+		length += (IS_STR(x) ? lval_str_length(x) : 1) + (i != 0 ? sepLength : 0);
+	}
+
+	lval* res = lval_str_null();
+	res->str = malloc(length + 1);
+	DIE_IF_NULL(res->str);
+
+	char* end = res->str;
+	for (unsigned i = 0; i < lst->count; i++)
+	{
+		if (i != 0)
 		{
-			lval_del(str);
-			continue;
+			memcpy(end, sep, sepLength);
+			end += sepLength;
 		}
-		
-		res->str = realloc(res->str, strlen(res->str) + strlen(str->str) + 1);
-		DIE_IF_NULL(res->str);
-		strcat(res->str, str->str);
-		lval_del(str);
+
+		lval view;
+		char buf[2];
+		const char* text = lval_text(list_peek(lst, i, &view), buf);
+		size_t size = strlen(text);
+		memcpy(end, text, size);
+		end += size;
 	}
-	
-	lval_del(a);
+	*end = '\0';
+
 	return res;
 }
 
-lval* builtin_show(lenv* e, lval* a)
+lval* builtin_string_replace_unchecked(lenv* e, int argc, lval** argv)
 {
-	LASSERT_COUNT(a, 1, "show");
+	char fromBuf[2], toBuf[2];
+	const char* from = lval_text(argv[1], fromBuf);
+	const char* to = lval_text(argv[2], toBuf);
+	size_t fromLength = strlen(from), toLength = strlen(to);
+	LASSERT_ARGV(fromLength != 0, "function 'string-replace' passed empty pattern");
+
+	const char* str = lval_str_flat(argv[0]);
+	const char* end = str + strlen(str);
+
+	// Counting occurrences first, so the result is allocated once
+	size_t count = 0;
+	for (const char* p = str; (p = strscan_find(p, end - p, from, fromLength)) != NULL; p += fromLength)
+		count++;
+
+	if (count == 0)
+	{
+		lval* res = argv[0];
+		argv[0] = NULL;
+		return res;
+	}
+
+	lval* res = lval_str_null();
+	res->str = malloc(end - str - count * fromLength + count * toLength + 1);
+	DIE_IF_NULL(res->str);
+
+	char* out = res->str;
+	const char* found;
+	while ((found = strscan_find(str, end - str, from, fromLength)) != NULL)
+	{
+		memcpy(out, str, found - str);
+		out += found - str;
+		memcpy(out, to, toLength);
+		out += toLength;
+		str = found + fromLength;
+	}
+	memcpy(out, str, end - str);
+	out[end - str] = '\0';
 
-	lval* x = list_take(a, 0);
-	lval* res = lval_to_str(x);
-	lval_del(x);
-	
 	return res;
 }
+
+// Accepts the syntax of number literals
+lval* builtin_string_to_number_unchecked(lenv* e, int argc, lval** argv)
+{
+	const char* str = lval_str_flat(argv[0]);
+	const char* digits = str[0] == '-' ? str + 1 : str;
+	LASSERT_ARGV(digits[0] != '\0' && strspn(digits, "0123456789") == strlen(digits),
+				 "function 'string->number' passed string, that is not a number");
+
+	errno = 0;
+	long x = strtol(str, NULL, 10);
+	return errno != ERANGE ? lval_num(x) : lval_num_big(bignum_parse(str));
+}
+
+lval* builtin_number_to_string_unchecked(lenv* e, int argc, lval** argv)
+{
+	return lval_to_str(argv[0]);
+}
+
+lval* builtin_string_builder_unchecked(lenv* e, int argc, lval** argv)
+{
+	lval* sb = lval_builder();
+	for (int i = 0; i < argc; i++)
+	{
+		lval* err = builtin_sb_append_value(sb, argv[i], "string-builder", i);
+		if (err != NULL)
+		{
+			lval_del(sb);
+			return err;
+		}
+	}
+
+	return sb;
+}
+
+lval* builtin_show_unchecked(lenv* e, int argc, lval** argv)
+{
+	return lval_to_str(argv[0]);
+}
@@ -26,6 +26,69 @@
 
 #include <value.h>
 
+static lenv_watched** watched = NULL;
+static unsigned watchedCount = 0;
+static unsigned watchedCapacity = 0;
+
+unsigned long lenv_hash_name(const char* name)
+{
+	unsigned long hash = 14695981039346656037UL;
+	for (; *name != '\0'; name++)
+	{
+		hash ^= (unsigned char) *name;
+		hash *= 1099511628211UL;
+	}
+	return hash;
+}
+
+lenv_watched** lenv_find_watched(const char* name)
+{
+	unsigned i = lenv_hash_name(name) & (watchedCapacity - 1);
+	while (watched[i] != NULL && strcmp(watched[i]->name, name) != 0)
+		i = (i + 1) & (watchedCapacity - 1);
+	return &watched[i];
+}
+
+lenv_watched* lenv_watch(const char* name)
+{
+	if ((watchedCount + 1) * 2 > watchedCapacity)
+	{
+		lenv_watched** old = watched;
+		unsigned oldCapacity = watchedCapacity;
+
+		watchedCapacity = watchedCapacity == 0 ? 64 : watchedCapacity * 2;
+		watched = calloc(watchedCapacity, sizeof(lenv_watched*));
+		DIE_IF_NULL(watched);
+
+		for (unsigned i = 0; i < oldCapacity; i++)
+			if (old[i] != NULL) *lenv_find_watched(old[i]->name) = old[i];
+		free(old);
+	}
+
+	lenv_watched** slot = lenv_find_watched(name);
+	if (*slot == NULL)
+	{
+		*slot = malloc(sizeof(lenv_watched));
+		DIE_IF_NULL(*slot);
+		(*slot)->name = malloc(strlen(name) + 1);
+		DIE_IF_NULL((*slot)->name);
+		strcpy((*slot)->name, name);
+		(*slot)->version = 0;
+		(*slot)->shadows = 0;
+		watchedCount++;
+	}
+
+	return *slot;
+}
+
+void lenv_touch(const char* name)
+{
+	if (watchedCount == 0) return;
+
+	lenv_watched* w = *lenv_find_watched(name);
+	if (w != NULL) w->version++;
+}
+
 lenv* lenv_new(lenv* parent)
 {
 	lenv* env = malloc(sizeof(lenv));
@@ -44,6 +107,7 @@ void lenv_del(lenv* env)
 	{
 		for (unsigned i = 0; i < env->count; i++)
 		{
+			if (env->entries[i].shadow != NULL) env->entries[i].shadow->shadows--;
 			free(env->entries[i].key);
 			lval_del(env->entries[i].value);
 		}
@@ -64,28 +128,54 @@ lenv* lenv_copy(lenv* env)
 		lval key;
 		key.type = LVAL_SYM;
 		key.sym = env->entries[i].key;
-		lenv_put(res, &key, env->entries[i].value);
+		lenv_bind(res, &key, env->entries[i].value);
 	}
 
 	return res;
 }
 
 lval* lenv_get(lenv* env, lval* key)
+{
+	lval* value = lenv_lookup(env, key);
+
+	if (value != NULL) return lval_copy(value);
+	else return lval_err("symbol '%s' is not bound to anything",
+						 key->sym);
+}
+
+lval* lenv_lookup(lenv* env, lval* key)
 {
 	assert(env != NULL);
 	assert(IS_SYM(key));
 
-	for (unsigned i = 0; i < env->count; i++)
+	for (; env != NULL; env = env->parent)
 	{
-		if (strcmp(env->entries[i].key, key->sym) == 0)
+		for (unsigned i = 0; i < env->count; i++)
 		{
-			return lval_copy(env->entries[i].value);
+			if (strcmp(env->entries[i].key, key->sym) == 0)
+			{
+				return env->entries[i].value;
+			}
 		}
 	}
-	
-	if (env->parent != NULL) return lenv_get(env->parent, key);
-	else return lval_err("symbol '%s' is not bound to anything",
-						 key->sym);
+
+	return NULL;
+}
+
+bool lenv_shadowed(lenv* env, const char* name)
+{
+	for (; env != NULL && env->parent != NULL; env = env->parent)
+		for (unsigned i = 0; i < env->count; i++)
+			if (strcmp(env->entries[i].key, name) == 0) return true;
+
+	return false;
+}
+
+lval* lenv_lookup_mut(lenv* env, lval* key)
+{
+	lval* value = lenv_lookup(env, key);
+	if (value != NULL) lenv_touch(key->sym);
+	return value;
 }
 
 bool lenv_set(lenv* env, lval* key, lval* value)
@@ -97,6 +187,7 @@ bool lenv_set(lenv* env, lval* key, lval* value)
 	{
 		if (strcmp(env->entries[i].key, key->sym) == 0)
 		{
+			lenv_touch(key->sym);
 			lval_del(env->entries[i].value);
 			env->entries[i].value = lval_copy(value);
 			return true;
@@ -107,7 +198,7 @@ bool lenv_set(lenv* env, lval* key, lval* value)
 	else return false;
 }
 
-void lenv_internal_put(lenv* env, lval* key, lval* value)
+void lenv_internal_put(lenv* env, lval* key, lval* value, bool local)
 {
 	env->count++;
 
@@ -118,6 +209,13 @@ void lenv_internal_put(lenv* env, lval* key, lval* value)
 	DIE_IF_NULL(env->entries[env->count - 1].key);
 	strcpy(env->entries[env->count - 1].key, key->sym);
 	env->entries[env->count - 1].value = lval_copy(value);
+	env->entries[env->count - 1].shadow = NULL;
+
+	if (local)
+	{
+		env->entries[env->count - 1].shadow = lenv_watch(key->sym);
+		env->entries[env->count - 1].shadow->shadows++;
+	}
 }
 
 void lenv_put(lenv* env, lval* key, lval* value)
@@ -125,6 +223,26 @@ void lenv_put(lenv* env, lval* key, lval* value)
 	assert(env != NULL);
 	assert(IS_SYM(key));
 
+	for (unsigned i = 0; i < env->count; i++)
+	{
+		if (strcmp(env->entries[i].key, key->sym) == 0)
+		{
+			lenv_touch(key->sym);
+			lval_del(env->entries[i].value);
+			env->entries[i].value = lval_copy(value);
+			return;
+		}
+	}
+
+	lenv_touch(key->sym);
+	lenv_internal_put(env, key, value, env->parent != NULL);
+}
+
+void lenv_bind(lenv* env, lval* key, lval* value)
+{
+	assert(env != NULL);
+	assert(IS_SYM(key));
+
 	for (unsigned i = 0; i < env->count; i++)
 	{
 		if (strcmp(env->entries[i].key, key->sym) == 0)
@@ -135,7 +253,7 @@ void lenv_put(lenv* env, lval* key, lval* value)
 		}
 	}
 
-	lenv_internal_put(env, key, value);
+	lenv_internal_put(env, key, value, true);
 }
 
 void lenv_def(lenv* env, lval* key, lval* value)
@@ -160,7 +278,8 @@ bool lenv_put_new(lenv* env, lval* key, lval* value)
 		}
 	}
 
-	lenv_internal_put(env, key, value);
+	lenv_touch(key->sym);
+	lenv_internal_put(env, key, value, env->parent != NULL);
 
 	return true;
 }
@@ -24,10 +24,99 @@
 
 #include <eval.h>
 #include <builtins.h>
+#include <jit.h>
+#include <optimizer.h>
 
-lval* eval_func_call(lenv* env, lval* func, lval* args);
 lval* eval_lval_expr(lenv* env, lval* v);
 
+#define EVAL_STACK_BLOCK 1024
+
+// Blocks of the evaluation stack are never moved, so arguments stay valid
+// while builtin evaluates other expressions
+typedef struct eval_block
+{
+	struct eval_block* prev;
+	unsigned count;
+	unsigned capacity;
+	lval* cells[];
+} eval_block;
+
+static eval_block* evalStack = NULL;
+static eval_block* evalSpare = NULL;
+
+lval** eval_stack_push(unsigned count)
+{
+	if (evalStack == NULL || evalStack->capacity - evalStack->count < count)
+	{
+		eval_block* block = evalSpare;
+		evalSpare = NULL;
+
+		if (block == NULL || block->capacity < count)
+		{
+			free(block);
+			unsigned capacity = count > EVAL_STACK_BLOCK ? count : EVAL_STACK_BLOCK;
+			block = malloc(sizeof(eval_block) + sizeof(lval*) * capacity);
+			DIE_IF_NULL(block);
+			block->capacity = capacity;
+		}
+
+		block->count = 0;
+		block->prev = evalStack;
+		evalStack = block;
+	}
+
+	lval** res = evalStack->cells + evalStack->count;
+	evalStack->count += count;
+	return res;
+}
+
+void eval_stack_pop(unsigned count)
+{
+	evalStack->count -= count;
+
+	if (evalStack->count == 0 && evalStack->prev != NULL)
+	{
+		eval_block* block = evalStack;
+		evalStack = block->prev;
+		free(evalSpare);
+		evalSpare = block;
+	}
+}
+
+lval* eval_builtin_argv(lenv* env, lval* v)
+{
+	lbuiltin_argv_func argvFunc = v->cells[0]->argvBuiltin;
+	int argc = v->count - 1;
+	lval** argv = eval_stack_push(argc);
+
+	for (int i = 0; i < argc; i++)
+	{
+		argv[i] = eval_lval(env, v->cells[i + 1]);
+		v->cells[i + 1] = NULL;
+	}
+
+	v->count = 1;
+	lval_del(v);
+
+	lval* res = NULL;
+	for (int i = 0; i < argc && res == NULL; i++)
+	{
+		if (IS_ERR(argv[i]))
+		{
+			res = argv[i];
+			argv[i] = NULL;
+		}
+	}
+
+	if (res == NULL) res = argvFunc(env, argc, argv);
+
+	for (int i = 0; i < argc; i++)
+		if (argv[i] != NULL) lval_del(argv[i]);
+
+	eval_stack_pop(argc);
+	return res;
+}
+
 lval* eval_lval(lenv* env, lval* v)
 {
 	if (IS_SYM(v))
@@ -50,7 +139,12 @@ lval* eval_lval_expr(lenv* env, lval* v)
 {
 	assert(IS_LIST(v));
 	
+	list_generalize(v);
+	v->hash = 0;
 	v->cells[0] = eval_lval(env, v->cells[0]);
+	if (IS_BUILTIN(v->cells[0]) && v->cells[0]->argvBuiltin != NULL && v->count != 1)
+		return eval_builtin_argv(env, v);
+
 	if (IS_MACRO(v->cells[0]) && v->count != 1)
 	{
 		lval* macro = list_pop(v, 0);
@@ -94,12 +188,23 @@ lval* eval_func_call(lenv* env, lval* func, lval* args)
 	if (IS_BUILTIN(func))
 	{
 		lbuiltin_func builtin = func->builtin;
+		lbuiltin_argv_func argvBuiltin = func->argvBuiltin;
 		lval_del(func);
-		return builtin(env, args);
+		return argvBuiltin != NULL
+			? builtin_call_argv(env, argvBuiltin, args)
+			: builtin(env, args);
 	}
 
 	if (IS_LAMBDA(func))
 	{
+		lval* native = jit_try_call(env, func, args);
+		if (native != NULL)
+		{
+			lval_del(func);
+			lval_del(args);
+			return native;
+		}
+
 		while (args->count)
 		{
 			if (func->formals->count == 0)
@@ -117,13 +222,13 @@ lval* eval_func_call(lenv* env, lval* func, lval* args)
 				// builtin "lambda" should guarantee this safety
 				lval_del(formal);
 				lval* rest = list_pop(func->formals, 0);
-				lenv_put(func->env, rest, builtin_list(env, args));
+				lenv_bind(func->env, rest, args);
 				lval_del(rest);
 				break;
 			}
 			
 			lval* actual = list_pop(args, 0);
-			lenv_put(func->env, formal, actual);
+			lenv_bind(func->env, formal, actual);
 			lval_del(formal);
 			lval_del(actual);
 		}
@@ -135,7 +240,7 @@ lval* eval_func_call(lenv* env, lval* func, lval* args)
 			lval* key = list_pop(func->formals, 0);
 			lval* val = lval_list();
 
-			lenv_put(func->env, key, val);
+			lenv_bind(func->env, key, val);
 
 			lval_del(key);
 			lval_del(val);
@@ -150,8 +255,7 @@ lval* eval_func_call(lenv* env, lval* func, lval* args)
 		}
 		else
 		{
-			lval* bodyCopy = lval_copy(func->body);
-			lval* res = eval_lval(func->env, bodyCopy);
+			lval* res = optimizer_eval(func->env, func);
 			lval_del(func);
 			return res;
 		}
@@ -160,6 +264,58 @@ lval* eval_func_call(lenv* env, lval* func, lval* args)
 	assert(false && "Unreachable");
 }
 
+bool eval_has_rest(lval* formals)
+{
+	for (unsigned i = 0; i < formals->count; i++)
+		if (strcmp(formals->cells[i]->sym, "&") == 0) return true;
+	return false;
+}
+
+// Lambdas without bound formals and rest parameter are evaluated in a new frame
+// directly, so neither the lambda nor an argument list is built for the call
+lval* eval_call_argv(lenv* env, lval* func, int argc, lval** argv)
+{
+	if (IS_BUILTIN(func) && func->argvBuiltin != NULL)
+	{
+		lval** args = eval_stack_push(argc);
+		for (int i = 0; i < argc; i++)
+			args[i] = lval_copy(argv[i]);
+
+		lval* res = func->argvBuiltin(env, argc, args);
+
+		for (int i = 0; i < argc; i++)
+			if (args[i] != NULL) lval_del(args[i]);
+
+		eval_stack_pop(argc);
+		return res;
+	}
+
+	if (IS_LAMBDA(func) && func->env->count == 0 && func->formals->count == argc
+		&& !eval_has_rest(func->formals))
+	{
+		lval args = { .type = LVAL_LIST };
+		args.count = argc;
+		args.cells = argv;
+
+		lval* native = jit_try_call(env, func, &args);
+		if (native != NULL) return native;
+
+		lenv* frame = lenv_new(env);
+		for (int i = 0; i < argc; i++)
+			lenv_bind(frame, func->formals->cells[i], argv[i]);
+
+		lval* res = optimizer_eval(frame, func);
+		lenv_del(frame);
+		return res;
+	}
+
+	lval* args = lval_list();
+	for (int i = 0; i < argc; i++)
+		list_add(args, lval_copy(argv[i]));
+
+	return eval_func_call(env, lval_copy(func), args);
+}
+
 lval* eval_macro_expand(lval* macro, lval* args)
 {
 	if (macro->formals->count < args->count)
@@ -182,7 +338,7 @@ lval* eval_macro_expand(lval* macro, lval* args)
 	return expr;
 }
 
-void eval_macro_replace(lval* expr, lval* formal, lval* actual)
+bool eval_macro_replace(lval* expr, lval* formal, lval* actual)
 {
 	assert(expr != NULL);
 	assert(formal != NULL);
@@ -202,12 +358,26 @@ void eval_macro_replace(lval* expr, lval* formal, lval* actual)
 	case LVAL_STR:
 	case LVAL_MACRO: // TODO: Is this possible?
 	case LVAL_BOOL:
-		break;
+	case LVAL_MAP:
+	case LVAL_SET:
+	case LVAL_RECORD:
+	case LVAL_CHAR:
+	case LVAL_BUILDER:
+		return false;
 	case LVAL_LAMBDA:
-		eval_macro_replace(expr->formals, formal, actual);
-		eval_macro_replace(expr->body, formal, actual);
-		break;
+	{
+		bool changed = eval_macro_replace(expr->formals, formal, actual);
+		changed |= eval_macro_replace(expr->body, formal, actual);
+		// The body has changed, so this is not the same function anymore
+		lambda_info_release(expr->info);
+		expr->info = lambda_info_new();
+		return changed;
+	}
 	case LVAL_LIST:
+	{
+		// Packed lists contain no symbols
+		if (expr->strategy != LIST_CELLS) return false;
+		bool changed = false;
 		for (unsigned i = 0; i < expr->count; i++)
 		{
 			if (IS_SYM(expr->cells[i]) 
@@ -215,22 +385,28 @@ void eval_macro_replace(lval* expr, lval* formal, lval* actual)
 			{
 				lval_del(expr->cells[i]);
 				expr->cells[i] = lval_copy(actual);
+				changed = true;
 			}
-			else eval_macro_replace(expr->cells[i], formal, actual);
+			else changed |= eval_macro_replace(expr->cells[i], formal, actual);
 		}
-		break;
+		// Cached hash of unchanged parts is kept
+		if (changed) expr->hash = 0;
+		return changed;
+	}
 	case LVAL_QUOTE:
 		if (IS_SYM(expr->quoted) 
 				&& strcmp(expr->quoted->sym, formal->sym) == 0)
 		{
 			lval_del(expr->quoted);
 			expr->quoted = lval_copy(actual);
+			return true;
 		}
-		else eval_macro_replace(expr->quoted, formal, actual);
-		break;
+		return eval_macro_replace(expr->quoted, formal, actual);
 	case LVAL_SYM:
 		if(strcmp(expr->sym, formal->sym) == 0)
 			assert(false && "Got uncaught symbol. It should be replaced in upper call frame");
-		break;
+		return false;
 	}
+
+	return false;
 }
\ No newline at end of file
@@ -0,0 +1,401 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <hamt.h>
+
+#define HAMT_BITS 5
+#define HAMT_MASK ((1u << HAMT_BITS) - 1)
+#define HAMT_HASH_BITS 32
+
+typedef struct hamt_entry
+{
+	unsigned refs;
+	uint32_t hash;
+	lval* key;
+	lval* value;
+} hamt_entry;
+
+// Either a subtrie or an entry
+typedef struct hamt_slot
+{
+	hamt_node* child;
+	hamt_entry* entry;
+} hamt_slot;
+
+// Bit of 'bitmap' is set for every used 5-bit chunk of hash, slots are sorted
+// by the chunk. Nodes below all bits of hash are collision nodes: their slots
+// are entries with equal hashes and 'bitmap' is not used
+struct hamt_node
+{
+	unsigned refs;
+	unsigned count;
+	uint32_t bitmap;
+	unsigned slotCount;
+	hamt_slot slots[];
+};
+
+hamt_node* hamt_node_new(unsigned slotCount)
+{
+	hamt_node* node = malloc(sizeof(hamt_node) + sizeof(hamt_slot) * slotCount);
+	DIE_IF_NULL(node);
+	node->refs = 1;
+	node->count = 0;
+	node->bitmap = 0;
+	node->slotCount = slotCount;
+	return node;
+}
+
+hamt_node* hamt_retain(hamt_node* node)
+{
+	if (node != NULL) node->refs++;
+	return node;
+}
+
+void hamt_entry_release(hamt_entry* entry)
+{
+	if (--entry->refs != 0) return;
+
+	lval_del(entry->key);
+	lval_del(entry->value);
+	free(entry);
+}
+
+void hamt_release(hamt_node* node)
+{
+	if (node == NULL || --node->refs != 0) return;
+
+	for (unsigned i = 0; i < node->slotCount; i++)
+	{
+		if (node->slots[i].child != NULL) hamt_release(node->slots[i].child);
+		else hamt_entry_release(node->slots[i].entry);
+	}
+
+	free(node);
+}
+
+unsigned hamt_count(hamt_node* node)
+{
+	return node == NULL ? 0 : node->count;
+}
+
+unsigned hamt_index(uint32_t bitmap, uint32_t bit)
+{
+	return __builtin_popcount(bitmap & (bit - 1));
+}
+
+void hamt_slot_retain(hamt_slot slot)
+{
+	if (slot.child != NULL) slot.child->refs++;
+	else slot.entry->refs++;
+}
+
+unsigned hamt_slot_count(hamt_slot slot)
+{
+	return slot.child != NULL ? slot.child->count : 1;
+}
+
+// Copies of 'node' with one slot replaced, inserted or removed. New slot is
+// owned, others are shared
+hamt_node* hamt_node_set(hamt_node* node, unsigned index, hamt_slot slot)
+{
+	hamt_node* res = hamt_node_new(node->slotCount);
+	res->bitmap = node->bitmap;
+	res->count = node->count - hamt_slot_count(node->slots[index]) + hamt_slot_count(slot);
+
+	for (unsigned i = 0; i < node->slotCount; i++)
+	{
+		if (i == index) continue;
+		res->slots[i] = node->slots[i];
+		hamt_slot_retain(res->slots[i]);
+	}
+
+	res->slots[index] = slot;
+	return res;
+}
+
+hamt_node* hamt_node_insert(hamt_node* node, unsigned index, uint32_t bit, hamt_slot slot)
+{
+	hamt_node* res = hamt_node_new(node->slotCount + 1);
+	res->bitmap = node->bitmap | bit;
+	res->count = node->count + hamt_slot_count(slot);
+
+	for (unsigned i = 0; i < node->slotCount; i++)
+	{
+		res->slots[i < index ? i : i + 1] = node->slots[i];
+		hamt_slot_retain(node->slots[i]);
+	}
+
+	res->slots[index] = slot;
+	return res;
+}
+
+hamt_node* hamt_node_remove(hamt_node* node, unsigned index, uint32_t bit)
+{
+	if (node->slotCount == 1) return NULL;
+
+	hamt_node* res = hamt_node_new(node->slotCount - 1);
+	res->bitmap = node->bitmap & ~bit;
+	res->count = node->count - hamt_slot_count(node->slots[index]);
+
+	for (unsigned i = 0; i < node->slotCount; i++)
+	{
+		if (i == index) continue;
+		res->slots[i < index ? i : i - 1] = node->slots[i];
+		hamt_slot_retain(node->slots[i]);
+	}
+
+	return res;
+}
+
+hamt_node* hamt_node_single(hamt_slot slot, uint32_t bit)
+{
+	hamt_node* res = hamt_node_new(1);
+	res->bitmap = bit;
+	res->count = 1;
+	res->slots[0] = slot;
+	return res;
+}
+
+uint32_t hamt_hash_key(lval* key)
+{
+	return (uint32_t) lval_hash(key);
+}
+
+hamt_entry* hamt_find(hamt_node* node, lval* key)
+{
+	uint32_t hash = hamt_hash_key(key);
+
+	for (unsigned shift = 0; node != NULL; shift += HAMT_BITS)
+	{
+		if (shift >= HAMT_HASH_BITS)
+		{
+			for (unsigned i = 0; i < node->slotCount; i++)
+				if (lval_eq(node->slots[i].entry->key, key)) return node->slots[i].entry;
+			return NULL;
+		}
+
+		uint32_t bit = 1u << ((hash >> shift) & HAMT_MASK);
+		if ((node->bitmap & bit) == 0) return NULL;
+
+		hamt_slot* slot = &node->slots[hamt_index(node->bitmap, bit)];
+		if (slot->entry != NULL)
+		{
+			hamt_entry* entry = slot->entry;
+			return entry->hash == hash && lval_eq(entry->key, key) ? entry : NULL;
+		}
+
+		node = slot->child;
+	}
+
+	return NULL;
+}
+
+lval* hamt_get(hamt_node* node, lval* key)
+{
+	hamt_entry* entry = hamt_find(node, key);
+	return entry != NULL ? entry->value : NULL;
+}
+
+bool hamt_contains(hamt_node* node, lval* key)
+{
+	return hamt_find(node, key) != NULL;
+}
+
+// Takes ownership of 'entry'
+hamt_node* hamt_put_node(hamt_node* node, hamt_entry* entry, unsigned shift)
+{
+	hamt_slot slot = { NULL, entry };
+
+	if (shift >= HAMT_HASH_BITS)
+	{
+		if (node == NULL) return hamt_node_single(slot, 0);
+
+		for (unsigned i = 0; i < node->slotCount; i++)
+			if (lval_eq(node->slots[i].entry->key, entry->key))
+				return hamt_node_set(node, i, slot);
+
+		return hamt_node_insert(node, node->slotCount, 0, slot);
+	}
+
+	uint32_t bit = 1u << ((entry->hash >> shift) & HAMT_MASK);
+	if (node == NULL) return hamt_node_single(slot, bit);
+
+	unsigned index = hamt_index(node->bitmap, bit);
+	if ((node->bitmap & bit) == 0) return hamt_node_insert(node, index, bit, slot);
+
+	hamt_slot old = node->slots[index];
+	if (old.child != NULL)
+	{
+		hamt_slot child = { hamt_put_node(old.child, entry, shift + HAMT_BITS), NULL };
+		return hamt_node_set(node, index, child);
+	}
+
+	if (old.entry->hash == entry->hash && lval_eq(old.entry->key, entry->key))
+		return hamt_node_set(node, index, slot);
+
+	// Both entries are moved one level deeper
+	old.entry->refs++;
+	hamt_node* first = hamt_put_node(NULL, old.entry, shift + HAMT_BITS);
+	hamt_slot both = { hamt_put_node(first, entry, shift + HAMT_BITS), NULL };
+	hamt_release(first);
+
+	return hamt_node_set(node, index, both);
+}
+
+hamt_node* hamt_put(hamt_node* node, lval* key, lval* value)
+{
+	hamt_entry* entry = malloc(sizeof(hamt_entry));
+	DIE_IF_NULL(entry);
+	entry->refs = 1;
+	entry->hash = hamt_hash_key(key);
+	entry->key = key;
+	entry->value = value;
+
+	return hamt_put_node(node, entry, 0);
+}
+
+hamt_entry* hamt_first_entry(hamt_node* node)
+{
+	while (node->slots[0].child != NULL)
+		node = node->slots[0].child;
+
+	return node->slots[0].entry;
+}
+
+// Returns retained 'node' if there is no such key
+hamt_node* hamt_del_node(hamt_node* node, lval* key, uint32_t hash, unsigned shift)
+{
+	if (shift >= HAMT_HASH_BITS)
+	{
+		for (unsigned i = 0; i < node->slotCount; i++)
+			if (lval_eq(node->slots[i].entry->key, key))
+				return hamt_node_remove(node, i, 0);
+
+		return hamt_retain(node);
+	}
+
+	uint32_t bit = 1u << ((hash >> shift) & HAMT_MASK);
+	if ((node->bitmap & bit) == 0) return hamt_retain(node);
+
+	unsigned index = hamt_index(node->bitmap, bit);
+	hamt_slot slot = node->slots[index];
+
+	if (slot.entry != NULL)
+	{
+		if (slot.entry->hash == hash && lval_eq(slot.entry->key, key))
+			return hamt_node_remove(node, index, bit);
+
+		return hamt_retain(node);
+	}
+
+	hamt_node* child = hamt_del_node(slot.child, key, hash, shift + HAMT_BITS);
+	if (child == slot.child)
+	{
+		hamt_release(child);
+		return hamt_retain(node);
+	}
+
+	if (child == NULL) return hamt_node_remove(node, index, bit);
+
+	// Subtrie with one entry is replaced by the entry
+	if (child->count == 1)
+	{
+		hamt_slot single = { NULL, hamt_first_entry(child) };
+		single.entry->refs++;
+		hamt_release(child);
+		return hamt_node_set(node, index, single);
+	}
+
+	hamt_slot replaced = { child, NULL };
+	return hamt_node_set(node, index, replaced);
+}
+
+hamt_node* hamt_del(hamt_node* node, lval* key)
+{
+	if (node == NULL) return NULL;
+	return hamt_del_node(node, key, hamt_hash_key(key), 0);
+}
+
+void hamt_each(hamt_node* node, hamt_func func, void* data)
+{
+	if (node == NULL) return;
+
+	for (unsigned i = 0; i < node->slotCount; i++)
+	{
+		if (node->slots[i].child != NULL) hamt_each(node->slots[i].child, func, data);
+		else func(data, node->slots[i].entry->key, node->slots[i].entry->value);
+	}
+}
+
+// Every entry of 'a' is in 'b'
+bool hamt_contains_all(hamt_node* a, hamt_node* b)
+{
+	for (unsigned i = 0; i < a->slotCount; i++)
+	{
+		if (a->slots[i].child != NULL)
+		{
+			if (!hamt_contains_all(a->slots[i].child, b)) return false;
+			continue;
+		}
+
+		hamt_entry* entry = a->slots[i].entry;
+		hamt_entry* other = hamt_find(b, entry->key);
+		if (other == NULL) return false;
+		if (entry->value == NULL || other->value == NULL)
+		{
+			if (entry->value != other->value) return false;
+		}
+		else if (!lval_eq(entry->value, other->value)) return false;
+	}
+
+	return true;
+}
+
+bool hamt_eq(hamt_node* a, hamt_node* b)
+{
+	if (a == b) return true;
+	if (hamt_count(a) != hamt_count(b)) return false;
+
+	return hamt_contains_all(a, b);
+}
+
+unsigned long hamt_hash(hamt_node* node)
+{
+	if (node == NULL) return 0;
+
+	unsigned long hash = 0;
+	for (unsigned i = 0; i < node->slotCount; i++)
+	{
+		hamt_slot slot = node->slots[i];
+		if (slot.child != NULL) hash += hamt_hash(slot.child);
+		else
+		{
+			hamt_entry* entry = slot.entry;
+			hash += (entry->hash * 0x9e3779b97f4a7c15UL) ^ (entry->value != NULL ? lval_hash(entry->value) : 0);
+		}
+	}
+
+	return hash;
+}
@@ -0,0 +1,99 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <hashcons.h>
+
+typedef struct hashcons_entry
+{
+	unsigned hash;
+	lval* value;
+} hashcons_entry;
+
+static hashcons_entry* table = NULL;
+static unsigned tableCount = 0;
+static unsigned tableCapacity = 0;
+
+// Returns the entry of 'hash' or the empty entry, where it should be
+hashcons_entry* hashcons_find(hashcons_entry* entries, unsigned capacity, unsigned hash)
+{
+	unsigned i = hash & (capacity - 1);
+	while (entries[i].value != NULL && entries[i].hash != hash)
+		i = (i + 1) & (capacity - 1);
+	return &entries[i];
+}
+
+void hashcons_grow()
+{
+	unsigned capacity = tableCapacity == 0 ? HASHCONS_INITIAL_CAPACITY : tableCapacity * 2;
+	hashcons_entry* entries = calloc(capacity, sizeof(hashcons_entry));
+	DIE_IF_NULL(entries);
+
+	for (unsigned i = 0; i < tableCapacity; i++)
+		if (table[i].value != NULL)
+			*hashcons_find(entries, capacity, table[i].hash) = table[i];
+
+	free(table);
+	table = entries;
+	tableCapacity = capacity;
+}
+
+// Parts of 'v' are interned before it
+void hashcons_intern_one(lval* v)
+{
+	if (!IS_LIST(v) && !IS_STR(v)) return;
+
+	unsigned hash = lval_hash(v);
+
+	if (2 * (tableCount + 1) > tableCapacity) hashcons_grow();
+	hashcons_entry* entry = hashcons_find(table, tableCapacity, hash);
+
+	if (entry->value == NULL)
+	{
+		v->hash |= LVAL_HASH_CONSED;
+		entry->hash = hash;
+		entry->value = lval_copy(v);
+		tableCount++;
+	}
+	// Values with colliding hashes are left unmarked
+	else if (lval_eq(entry->value, v)) v->hash |= LVAL_HASH_CONSED;
+}
+
+lval* hashcons_intern(lval* v)
+{
+	lval_walk(v, hashcons_intern_one);
+	return v;
+}
+
+void hashcons_free()
+{
+	for (unsigned i = 0; i < tableCapacity; i++)
+		if (table[i].value != NULL) lval_del(table[i].value);
+
+	free(table);
+	table = NULL;
+	tableCount = 0;
+	tableCapacity = 0;
+}
@@ -0,0 +1,867 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#define _DEFAULT_SOURCE
+
+#include <jit.h>
+
+#include <eval.h>
+#include <builtins.h>
+#include <options.h>
+
+#ifdef LISPY_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+#define JIT_MAX_EXPAND_DEPTH 64
+#define JIT_STACK_BUDGET (256 * 1024)
+
+struct jit_code
+{
+	void* memory; // NULL for code compiled ahead of time
+	size_t size;
+	jit_entry entry;
+	jit_kind result;
+	unsigned guardCount;
+	jit_guard* guards;
+};
+
+typedef struct jit_context
+{
+	lenv* env;
+	lambda_info* self;
+	lval* formals;
+	jit_kind result;
+	unsigned depth;
+	unsigned guardCount;
+	jit_guard* guards;
+} jit_context;
+
+volatile unsigned char jitDeopt;
+uintptr_t jitStackLimit;
+
+static bool jitSuspended = false;
+
+jit_node* jit_analyze(jit_context* ctx, lval* expr);
+
+jit_node* jit_node_new(jit_op op, jit_kind kind, long value)
+{
+	jit_node* node = malloc(sizeof(jit_node));
+	DIE_IF_NULL(node);
+	node->op = op;
+	node->kind = kind;
+	node->value = value;
+	node->count = 0;
+	node->children = NULL;
+	return node;
+}
+
+void jit_node_del(jit_node* node)
+{
+	if (node == NULL) return;
+
+	for (unsigned i = 0; i < node->count; i++)
+		jit_node_del(node->children[i]);
+
+	free(node->children);
+	free(node);
+}
+
+jit_node* jit_node_add(jit_node* node, jit_node* child)
+{
+	node->count++;
+	node->children = realloc(node->children, sizeof(jit_node*) * node->count);
+	DIE_IF_NULL(node->children);
+	node->children[node->count - 1] = child;
+	return node;
+}
+
+jit_node* jit_node_binary(jit_op op, jit_kind kind, jit_node* a, jit_node* b)
+{
+	return jit_node_add(jit_node_add(jit_node_new(op, kind, 0), a), b);
+}
+
+int jit_formal_index(jit_context* ctx, lval* sym)
+{
+	for (unsigned i = 0; i < ctx->formals->count; i++)
+		if (strcmp(ctx->formals->cells[i]->sym, sym->sym) == 0)
+			return i;
+
+	return -1;
+}
+
+void jit_guard_add(jit_context* ctx, lval* key, lval* value)
+{
+	for (unsigned i = 0; i < ctx->guardCount; i++)
+		if (strcmp(ctx->guards[i].key->sym, key->sym) == 0)
+			return;
+
+	ctx->guardCount++;
+	ctx->guards = realloc(ctx->guards, sizeof(jit_guard) * ctx->guardCount);
+	DIE_IF_NULL(ctx->guards);
+	ctx->guards[ctx->guardCount - 1].key = lval_copy(key);
+	ctx->guards[ctx->guardCount - 1].expected = value == NULL ? NULL : lval_copy(value);
+}
+
+void jit_guards_del(jit_guard* guards, unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+	{
+		lval_del(guards[i].key);
+		lval_del(guards[i].expected);
+	}
+
+	free(guards);
+}
+
+jit_node* jit_analyze_kind(jit_context* ctx, lval* expr, jit_kind kind)
+{
+	jit_node* node = jit_analyze(ctx, expr);
+	if (node != NULL && node->kind != kind)
+	{
+		jit_node_del(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+jit_node* jit_analyze_arith(jit_context* ctx, lval* expr, jit_op op)
+{
+	jit_node* acc = jit_analyze_kind(ctx, expr->cells[1], JIT_KIND_NUM);
+	if (acc == NULL) return NULL;
+
+	if (op == JIT_SUB && expr->count == 2)
+		return jit_node_add(jit_node_new(JIT_NEG, JIT_KIND_NUM, 0), acc);
+
+	for (unsigned i = 2; i < expr->count; i++)
+	{
+		jit_node* y = jit_analyze_kind(ctx, expr->cells[i], JIT_KIND_NUM);
+		if (y == NULL)
+		{
+			jit_node_del(acc);
+			return NULL;
+		}
+
+		acc = jit_node_binary(op, JIT_KIND_NUM, acc, y);
+	}
+
+	return acc;
+}
+
+jit_node* jit_analyze_compare(jit_context* ctx, lval* expr, jit_op op)
+{
+	if (expr->count != 3) return NULL;
+
+	jit_node* a = jit_analyze(ctx, expr->cells[1]);
+	jit_node* b = jit_analyze(ctx, expr->cells[2]);
+
+	if (a == NULL || b == NULL || a->kind != b->kind
+		|| (op == JIT_LESS && a->kind != JIT_KIND_NUM))
+	{
+		jit_node_del(a);
+		jit_node_del(b);
+		return NULL;
+	}
+
+	return jit_node_binary(op, JIT_KIND_BOOL, a, b);
+}
+
+// Binary numeric comparison, 'swap' exchanges operands and 'negate' inverts
+// the result, so (>= a b) becomes (not (less a b))
+jit_node* jit_analyze_order(jit_context* ctx, lval* expr, jit_op op, bool swap, bool negate)
+{
+	if (expr->count != 3) return NULL;
+
+	jit_node* a = jit_analyze_kind(ctx, expr->cells[1], JIT_KIND_NUM);
+	jit_node* b = jit_analyze_kind(ctx, expr->cells[2], JIT_KIND_NUM);
+
+	if (a == NULL || b == NULL)
+	{
+		jit_node_del(a);
+		jit_node_del(b);
+		return NULL;
+	}
+
+	jit_node* node = swap
+		? jit_node_binary(op, JIT_KIND_BOOL, b, a)
+		: jit_node_binary(op, JIT_KIND_BOOL, a, b);
+
+	return negate ? jit_node_add(jit_node_new(JIT_NOT, JIT_KIND_BOOL, 0), node) : node;
+}
+
+jit_node* jit_analyze_cond(jit_context* ctx, lval* expr)
+{
+	jit_node* node = jit_node_new(JIT_COND, JIT_KIND_NUM, 0);
+
+	for (unsigned i = 1; i < expr->count; i++)
+	{
+		lval* clause = expr->cells[i];
+
+		// Clause without body returns (), which is not supported
+		if (!IS_QUOTE(clause) || !IS_LIST(clause->quoted) || clause->quoted->count < 2)
+			goto fail;
+
+		jit_node* test = jit_analyze_kind(ctx, clause->quoted->cells[0], JIT_KIND_BOOL);
+		if (test == NULL) goto fail;
+		jit_node_add(node, test);
+
+		jit_node* body = jit_node_new(JIT_SEQ, JIT_KIND_NUM, 0);
+		jit_node_add(node, body);
+
+		for (unsigned j = 1; j < clause->quoted->count; j++)
+		{
+			jit_node* x = jit_analyze(ctx, clause->quoted->cells[j]);
+			if (x == NULL) goto fail;
+			jit_node_add(body, x);
+			body->kind = x->kind;
+		}
+
+		if (i == 1)
+			node->kind = body->kind;
+		else if (node->kind != body->kind)
+			goto fail;
+	}
+
+	return node;
+
+fail:
+	jit_node_del(node);
+	return NULL;
+}
+
+jit_node* jit_analyze_self(jit_context* ctx, lval* expr)
+{
+	if (expr->count - 1 != ctx->formals->count) return NULL;
+
+	jit_node* node = jit_node_new(JIT_SELF, ctx->result, 0);
+
+	for (unsigned i = 1; i < expr->count; i++)
+	{
+		jit_node* x = jit_analyze_kind(ctx, expr->cells[i], JIT_KIND_NUM);
+		if (x == NULL)
+		{
+			jit_node_del(node);
+			return NULL;
+		}
+
+		jit_node_add(node, x);
+	}
+
+	return node;
+}
+
+jit_node* jit_analyze_macro(jit_context* ctx, lval* expr, lval* macro)
+{
+	if (ctx->depth >= JIT_MAX_EXPAND_DEPTH) return NULL;
+
+	lval* args = lval_copy(expr);
+	lval_del(list_pop(args, 0));
+	lval* copy = lval_copy(macro);
+	lval* expanded = eval_macro_expand(copy, args);
+	lval_del(copy);
+	lval_del(args);
+
+	if (IS_ERR(expanded))
+	{
+		lval_del(expanded);
+		return NULL;
+	}
+
+	ctx->depth++;
+	jit_node* node = jit_analyze(ctx, expanded);
+	ctx->depth--;
+
+	lval_del(expanded);
+	return node;
+}
+
+jit_node* jit_analyze_call(jit_context* ctx, lval* expr)
+{
+	lval* head = expr->cells[0];
+	if (!IS_SYM(head) || jit_formal_index(ctx, head) >= 0) return NULL;
+
+	lval* func = lenv_lookup(ctx->env, head);
+	if (func == NULL) return NULL;
+
+	if (IS_MACRO(func))
+	{
+		jit_guard_add(ctx, head, func);
+		return jit_analyze_macro(ctx, expr, func);
+	}
+
+	if (IS_LAMBDA(func))
+	{
+		if (func->info != ctx->self) return NULL;
+
+		jit_guard_add(ctx, head, NULL);
+		return jit_analyze_self(ctx, expr);
+	}
+
+	if (!IS_BUILTIN(func)) return NULL;
+	jit_guard_add(ctx, head, func);
+
+	lbuiltin_func builtin = func->builtin;
+
+	if (builtin == builtin_add) return jit_analyze_arith(ctx, expr, JIT_ADD);
+	if (builtin == builtin_sub) return jit_analyze_arith(ctx, expr, JIT_SUB);
+	if (builtin == builtin_mul) return jit_analyze_arith(ctx, expr, JIT_MUL);
+	if (builtin == builtin_div) return jit_analyze_arith(ctx, expr, JIT_DIV);
+
+	if (builtin == builtin_less) return jit_analyze_compare(ctx, expr, JIT_LESS);
+	if (builtin == builtin_eq)   return jit_analyze_compare(ctx, expr, JIT_EQ);
+
+	if (builtin == builtin_lt)    return jit_analyze_order(ctx, expr, JIT_LESS, false, false);
+	if (builtin == builtin_gt)    return jit_analyze_order(ctx, expr, JIT_LESS, true, false);
+	if (builtin == builtin_le)    return jit_analyze_order(ctx, expr, JIT_LESS, true, true);
+	if (builtin == builtin_ge)    return jit_analyze_order(ctx, expr, JIT_LESS, false, true);
+	if (builtin == builtin_numeq) return jit_analyze_order(ctx, expr, JIT_EQ, false, false);
+
+	if (builtin == builtin_not)
+	{
+		if (expr->count != 2) return NULL;
+
+		jit_node* x = jit_analyze_kind(ctx, expr->cells[1], JIT_KIND_BOOL);
+		return x == NULL ? NULL : jit_node_add(jit_node_new(JIT_NOT, JIT_KIND_BOOL, 0), x);
+	}
+
+	if (builtin == builtin_cond) return jit_analyze_cond(ctx, expr);
+
+	return NULL;
+}
+
+jit_node* jit_analyze(jit_context* ctx, lval* expr)
+{
+	switch (expr->type)
+	{
+	case LVAL_NUM:
+		if (expr->big != NULL) return NULL;
+		return jit_node_new(JIT_CONST, JIT_KIND_NUM, expr->num);
+	case LVAL_BOOL:
+		return jit_node_new(JIT_CONST, JIT_KIND_BOOL, expr->boolean);
+	case LVAL_SYM:
+	{
+		int i = jit_formal_index(ctx, expr);
+		return i < 0 ? NULL : jit_node_new(JIT_ARG, JIT_KIND_NUM, i);
+	}
+	case LVAL_LIST:
+		if (expr->count == 0) return NULL;
+		if (expr->count == 1) return jit_analyze(ctx, expr->cells[0]);
+		return jit_analyze_call(ctx, expr);
+	default:
+		return NULL;
+	}
+}
+
+jit_function* jit_analyze_function(lenv* env, lval* func)
+{
+	if (func->formals->count > JIT_MAX_ARGS) return NULL;
+
+	for (unsigned i = 0; i < func->formals->count; i++)
+		if (strcmp(func->formals->cells[i]->sym, "&") == 0)
+			return NULL;
+
+	jit_context ctx;
+	ctx.env = env;
+	ctx.self = func->info;
+	ctx.formals = func->formals;
+	ctx.depth = 0;
+
+	// The kind of the result isn't known before analysis of self calls,
+	// so both are tried
+	jit_node* body = NULL;
+	jit_kind kinds[] = { JIT_KIND_NUM, JIT_KIND_BOOL };
+	for (unsigned i = 0; i < 2 && body == NULL; i++)
+	{
+		ctx.result = kinds[i];
+		ctx.guardCount = 0;
+		ctx.guards = NULL;
+
+		body = jit_analyze_kind(&ctx, func->body, ctx.result);
+		if (body == NULL) jit_guards_del(ctx.guards, ctx.guardCount);
+	}
+
+	if (body == NULL) return NULL;
+
+	jit_function* function = malloc(sizeof(jit_function));
+	DIE_IF_NULL(function);
+	function->body = body;
+	function->result = ctx.result;
+	function->guardCount = ctx.guardCount;
+	function->guards = ctx.guards;
+	return function;
+}
+
+void jit_function_del(jit_function* function)
+{
+	jit_node_del(function->body);
+	jit_guards_del(function->guards, function->guardCount);
+	free(function);
+}
+
+jit_code* jit_code_new(jit_entry entry, jit_kind result, jit_guard* guards, unsigned guardCount)
+{
+	jit_code* code = malloc(sizeof(jit_code));
+	DIE_IF_NULL(code);
+	code->memory = NULL;
+	code->size = 0;
+	code->entry = entry;
+	code->result = result;
+	code->guardCount = guardCount;
+	code->guards = guards;
+	return code;
+}
+
+void jit_free(jit_code* code)
+{
+#ifdef LISPY_JIT_SUPPORTED
+	if (code->memory != NULL) munmap(code->memory, code->size);
+#endif
+	jit_guards_del(code->guards, code->guardCount);
+	free(code);
+}
+
+void jit_attach(lenv* env, lval* func, jit_entry entry, jit_kind result,
+				const char* const* guards)
+{
+	if (func->info->jit != NULL) return;
+
+	unsigned count = 0;
+	while (guards[count] != NULL) count++;
+
+	jit_guard* resolved = malloc(sizeof(jit_guard) * (count + 1));
+	DIE_IF_NULL(resolved);
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		lval* key = lval_sym(guards[i]);
+		lval* value = lenv_lookup(env, key);
+		if (value == NULL)
+		{
+			lval_del(key);
+			jit_guards_del(resolved, i);
+			return;
+		}
+
+		resolved[i].key = key;
+		resolved[i].expected = IS_LAMBDA(value) && value->info == func->info
+			? NULL
+			: lval_copy(value);
+	}
+
+	func->info->jit = jit_code_new(entry, result, resolved, count);
+}
+
+#ifdef LISPY_JIT_SUPPORTED
+
+typedef struct jit_buffer
+{
+	unsigned char* bytes;
+	size_t count;
+	size_t capacity;
+	size_t bodyStart;
+	size_t* bailouts;
+	unsigned bailoutCount;
+} jit_buffer;
+
+void jit_emit_bytes(jit_buffer* b, const unsigned char* bytes, size_t n)
+{
+	if (b->count + n > b->capacity)
+	{
+		b->capacity = (b->count + n) * 2;
+		b->bytes = realloc(b->bytes, b->capacity);
+		DIE_IF_NULL(b->bytes);
+	}
+
+	memcpy(b->bytes + b->count, bytes, n);
+	b->count += n;
+}
+
+#define EMIT(b, ...) do {											\
+		static const unsigned char bytes_[] = { __VA_ARGS__ };		\
+		jit_emit_bytes(b, bytes_, sizeof(bytes_));					\
+	} while (false)
+
+void jit_emit_u32(jit_buffer* b, uint32_t x)
+{
+	jit_emit_bytes(b, (unsigned char*) &x, sizeof(x));
+}
+
+void jit_emit_u64(jit_buffer* b, uint64_t x)
+{
+	jit_emit_bytes(b, (unsigned char*) &x, sizeof(x));
+}
+
+// Emits rel32 placeholder after already emitted opcode, returns its position
+size_t jit_emit_rel32(jit_buffer* b)
+{
+	size_t at = b->count;
+	jit_emit_u32(b, 0);
+	return at;
+}
+
+void jit_patch_rel32(jit_buffer* b, size_t at, size_t target)
+{
+	int32_t rel = (int32_t) ((long) target - (long) (at + 4));
+	memcpy(b->bytes + at, &rel, sizeof(rel));
+}
+
+void jit_emit_bailout_rel32(jit_buffer* b)
+{
+	b->bailoutCount++;
+	b->bailouts = realloc(b->bailouts, sizeof(size_t) * b->bailoutCount);
+	DIE_IF_NULL(b->bailouts);
+	b->bailouts[b->bailoutCount - 1] = jit_emit_rel32(b);
+}
+
+// Evaluates a into rax, b into rcx
+void jit_emit_operands(jit_buffer* b, jit_node* node);
+
+void jit_emit_node(jit_buffer* b, jit_node* node, bool tail)
+{
+	switch (node->op)
+	{
+	case JIT_CONST:
+		EMIT(b, 0x48, 0xb8);                     // mov rax, imm64
+		jit_emit_u64(b, node->value);
+		break;
+
+	case JIT_ARG:
+		EMIT(b, 0x48, 0x8b, 0x83);               // mov rax, [rbx + disp32]
+		jit_emit_u32(b, node->value * 8);
+		break;
+
+	case JIT_ADD:
+		jit_emit_operands(b, node);
+		EMIT(b, 0x48, 0x01, 0xc8);               // add rax, rcx
+		EMIT(b, 0x0f, 0x80);                     // jo bailout
+		jit_emit_bailout_rel32(b);
+		break;
+
+	case JIT_SUB:
+		jit_emit_operands(b, node);
+		EMIT(b, 0x48, 0x29, 0xc8);               // sub rax, rcx
+		EMIT(b, 0x0f, 0x80);                     // jo bailout
+		jit_emit_bailout_rel32(b);
+		break;
+
+	case JIT_MUL:
+		jit_emit_operands(b, node);
+		EMIT(b, 0x48, 0x0f, 0xaf, 0xc1);         // imul rax, rcx
+		EMIT(b, 0x0f, 0x80);                     // jo bailout
+		jit_emit_bailout_rel32(b);
+		break;
+
+	case JIT_DIV:
+	{
+		jit_emit_operands(b, node);
+		EMIT(b, 0x48, 0x85, 0xc9);               // test rcx, rcx
+		EMIT(b, 0x0f, 0x84);                     // je bailout
+		jit_emit_bailout_rel32(b);
+		EMIT(b, 0x48, 0x83, 0xf9, 0xff);         // cmp rcx, -1
+		EMIT(b, 0x0f, 0x85);                     // jne divide
+		size_t divide = jit_emit_rel32(b);
+		EMIT(b, 0x48, 0xf7, 0xd8);               // neg rax
+		EMIT(b, 0x0f, 0x80);                     // jo bailout
+		jit_emit_bailout_rel32(b);
+		EMIT(b, 0xe9);                           // jmp done
+		size_t done = jit_emit_rel32(b);
+		jit_patch_rel32(b, divide, b->count);
+		EMIT(b, 0x48, 0x99);                     // cqo
+		EMIT(b, 0x48, 0xf7, 0xf9);               // idiv rcx
+		jit_patch_rel32(b, done, b->count);
+		break;
+	}
+
+	case JIT_NEG:
+		jit_emit_node(b, node->children[0], false);
+		EMIT(b, 0x48, 0xf7, 0xd8);               // neg rax
+		EMIT(b, 0x0f, 0x80);                     // jo bailout
+		jit_emit_bailout_rel32(b);
+		break;
+
+	case JIT_LESS:
+		jit_emit_operands(b, node);
+		EMIT(b, 0x48, 0x39, 0xc8);               // cmp rax, rcx
+		EMIT(b, 0x0f, 0x9c, 0xc0);               // setl al
+		EMIT(b, 0x0f, 0xb6, 0xc0);               // movzx eax, al
+		break;
+
+	case JIT_EQ:
+		jit_emit_operands(b, node);
+		EMIT(b, 0x48, 0x39, 0xc8);               // cmp rax, rcx
+		EMIT(b, 0x0f, 0x94, 0xc0);               // sete al
+		EMIT(b, 0x0f, 0xb6, 0xc0);               // movzx eax, al
+		break;
+
+	case JIT_NOT:
+		jit_emit_node(b, node->children[0], false);
+		EMIT(b, 0x83, 0xf0, 0x01);               // xor eax, 1
+		break;
+
+	case JIT_COND:
+	{
+		size_t* ends = malloc(sizeof(size_t) * (node->count / 2 + 1));
+		DIE_IF_NULL(ends);
+
+		for (unsigned i = 0; i < node->count; i += 2)
+		{
+			jit_emit_node(b, node->children[i], false);
+			EMIT(b, 0x48, 0x85, 0xc0);           // test rax, rax
+			EMIT(b, 0x0f, 0x84);                 // je next
+			size_t next = jit_emit_rel32(b);
+			jit_emit_node(b, node->children[i + 1], tail);
+			EMIT(b, 0xe9);                       // jmp end
+			ends[i / 2] = jit_emit_rel32(b);
+			jit_patch_rel32(b, next, b->count);
+		}
+
+		// No clause was chosen, the result is ()
+		EMIT(b, 0xe9);                           // jmp bailout
+		jit_emit_bailout_rel32(b);
+
+		for (unsigned i = 0; i < node->count; i += 2)
+			jit_patch_rel32(b, ends[i / 2], b->count);
+
+		free(ends);
+		break;
+	}
+
+	case JIT_SEQ:
+		for (unsigned i = 0; i < node->count; i++)
+			jit_emit_node(b, node->children[i], tail && i == node->count - 1);
+		break;
+
+	case JIT_SELF:
+		// Arguments are pushed in reverse, so they form an array on the stack
+		for (unsigned i = node->count; i-- > 0;)
+		{
+			jit_emit_node(b, node->children[i], false);
+			EMIT(b, 0x50);                       // push rax
+		}
+
+		if (tail)
+		{
+			for (unsigned i = 0; i < node->count; i++)
+			{
+				EMIT(b, 0x58);                   // pop rax
+				EMIT(b, 0x48, 0x89, 0x83);       // mov [rbx + disp32], rax
+				jit_emit_u32(b, i * 8);
+			}
+
+			EMIT(b, 0xe9);                       // jmp body
+			jit_patch_rel32(b, jit_emit_rel32(b), b->bodyStart);
+		}
+		else
+		{
+			EMIT(b, 0x48, 0x89, 0xe7);           // mov rdi, rsp
+			EMIT(b, 0xe8);                       // call self
+			jit_patch_rel32(b, jit_emit_rel32(b), 0);
+			EMIT(b, 0x48, 0x81, 0xc4);           // add rsp, imm32
+			jit_emit_u32(b, node->count * 8);
+			EMIT(b, 0x48, 0xb9);                 // mov rcx, &jitDeopt
+			jit_emit_u64(b, (uint64_t) (uintptr_t) &jitDeopt);
+			EMIT(b, 0x80, 0x39, 0x00);           // cmp byte [rcx], 0
+			EMIT(b, 0x0f, 0x85);                 // jne bailout
+			jit_emit_bailout_rel32(b);
+		}
+		break;
+	}
+}
+
+void jit_emit_operands(jit_buffer* b, jit_node* node)
+{
+	jit_emit_node(b, node->children[0], false);
+	EMIT(b, 0x50);                               // push rax
+	jit_emit_node(b, node->children[1], false);
+	EMIT(b, 0x48, 0x89, 0xc1);                   // mov rcx, rax
+	EMIT(b, 0x58);                               // pop rax
+}
+
+// long f(long* args), sets jitDeopt when result should be computed by interpreter
+void jit_emit_function(jit_buffer* b, jit_node* body)
+{
+	EMIT(b, 0x55);                               // push rbp
+	EMIT(b, 0x48, 0x89, 0xe5);                   // mov rbp, rsp
+	EMIT(b, 0x53);                               // push rbx
+	EMIT(b, 0x48, 0x89, 0xfb);                   // mov rbx, rdi
+	EMIT(b, 0x48, 0xb9);                         // mov rcx, &jitStackLimit
+	jit_emit_u64(b, (uint64_t) (uintptr_t) &jitStackLimit);
+	EMIT(b, 0x48, 0x3b, 0x21);                   // cmp rsp, [rcx]
+	EMIT(b, 0x0f, 0x82);                         // jb bailout
+	jit_emit_bailout_rel32(b);
+
+	b->bodyStart = b->count;
+	jit_emit_node(b, body, true);
+
+	EMIT(b, 0x48, 0x8b, 0x5d, 0xf8);             // mov rbx, [rbp - 8]
+	EMIT(b, 0xc9);                               // leave
+	EMIT(b, 0xc3);                               // ret
+
+	for (unsigned i = 0; i < b->bailoutCount; i++)
+		jit_patch_rel32(b, b->bailouts[i], b->count);
+
+	EMIT(b, 0x48, 0xb9);                         // mov rcx, &jitDeopt
+	jit_emit_u64(b, (uint64_t) (uintptr_t) &jitDeopt);
+	EMIT(b, 0xc6, 0x01, 0x01);                   // mov byte [rcx], 1
+	EMIT(b, 0x48, 0x8b, 0x5d, 0xf8);             // mov rbx, [rbp - 8]
+	EMIT(b, 0xc9);                               // leave
+	EMIT(b, 0xc3);                               // ret
+}
+
+jit_code* jit_compile(lenv* env, lval* func)
+{
+	jit_function* function = jit_analyze_function(env, func);
+	if (function == NULL) return NULL;
+
+	jit_buffer b = { NULL, 0, 0, 0, NULL, 0 };
+	jit_emit_function(&b, function->body);
+	free(b.bailouts);
+
+	void* memory = mmap(NULL, b.count, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		free(b.bytes);
+		jit_function_del(function);
+		return NULL;
+	}
+
+	memcpy(memory, b.bytes, b.count);
+	free(b.bytes);
+	if (mprotect(memory, b.count, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, b.count);
+		jit_function_del(function);
+		return NULL;
+	}
+
+	jit_code* code = jit_code_new((jit_entry) memory, function->result,
+								  function->guards, function->guardCount);
+	code->memory = memory;
+	code->size = b.count;
+
+	function->guards = NULL;
+	function->guardCount = 0;
+	jit_function_del(function);
+
+	return code;
+}
+
+#endif
+
+bool jit_guards_hold(lenv* env, lambda_info* info, jit_code* code)
+{
+	for (unsigned i = 0; i < code->guardCount; i++)
+	{
+		lval* got = lenv_lookup(env, code->guards[i].key);
+		if (got == NULL) return false;
+
+		if (code->guards[i].expected == NULL)
+		{
+			if (!IS_LAMBDA(got) || got->info != info) return false;
+		}
+		else if (!lval_eq(got, code->guards[i].expected)) return false;
+	}
+
+	return true;
+}
+
+lval* jit_verify(lenv* env, lval* func, lval* args, lval* res)
+{
+	jitSuspended = true;
+	lval* expected = eval_func_call(env, lval_copy(func), lval_copy(args));
+	jitSuspended = false;
+
+	if (lval_eq(res, expected))
+	{
+		lval_del(expected);
+		return res;
+	}
+
+	lval* got = lval_to_str(res);
+	lval* want = lval_to_str(expected);
+	fprintf(stderr, "jit: verification failed, got %s, interpreter returned %s\n",
+			got->str, want->str);
+	lval_del(got);
+	lval_del(want);
+
+	func->info->jitFailed = true;
+	lval_del(res);
+	return expected;
+}
+
+lval* jit_try_call(lenv* env, lval* func, lval* args)
+{
+	lambda_info* info = func->info;
+
+	if (!lispyOptions.jitEnabled || jitSuspended || info->jitFailed)
+		return NULL;
+
+	// Partial application is left to the interpreter
+	if (func->env->count != 0 || args->count != func->formals->count)
+		return NULL;
+
+	if (info->jit == NULL)
+	{
+#ifdef LISPY_JIT_SUPPORTED
+		if (++info->calls < lispyOptions.jitThreshold) return NULL;
+
+		info->jit = jit_compile(env, func);
+		if (info->jit == NULL)
+		{
+			info->jitFailed = true;
+			return NULL;
+		}
+#else
+		return NULL;
+#endif
+	}
+
+	long native[JIT_MAX_ARGS];
+	for (unsigned i = 0; i < args->count; i++)
+	{
+		if (!IS_NUM(args->cells[i]) || args->cells[i]->big != NULL) return NULL;
+		native[i] = args->cells[i]->num;
+	}
+
+	if (!jit_guards_hold(env, info, info->jit)) return NULL;
+
+	unsigned char marker;
+	jitStackLimit = (uintptr_t) &marker - JIT_STACK_BUDGET;
+	jitDeopt = 0;
+
+	long result = info->jit->entry(native);
+	if (jitDeopt) return NULL;
+
+	lval* res = info->jit->result == JIT_KIND_BOOL
+		? lval_bool(result != 0)
+		: lval_num(result);
+
+	if (lispyOptions.jitVerify)
+		res = jit_verify(env, func, args, res);
+
+	return res;
+}
@@ -33,6 +33,9 @@
 #include <builtins.h>
 #include <parser.h>
 #include <reader.h>
+#include <options.h>
+#include <hashcons.h>
+#include <aot.h>
 
 #define MAX_INPUT_LENGTH 2048
 
@@ -62,7 +65,9 @@ void clear_history() {}
 
 #endif
 
-void read_file(int argc, char** argv);
+int  parse_options(int argc, char** argv);
+void read_file(const char* fileName);
+void emit_c(const char* fileName);
 void repl();
 bool load_prelude(bool isSilence);
 
@@ -70,6 +75,9 @@ static lenv* globalEnv;
 
 int main(int argc, char** argv)
 {
+	int fileIndex = parse_options(argc, argv);
+	bool hasFile = fileIndex < argc;
+
 	init_parsers();
 	
 	globalEnv = lenv_new(NULL);
@@ -81,21 +89,71 @@ int main(int argc, char** argv)
 		lenv_put(globalEnv, &nameKey, &nameValue);
 	}
 	
-	if (!load_prelude(argc != 1) && argc == 1)
-		printf("warning: proceeding without prelude\n\n");
-	
-	if (argc != 1)
-		read_file(argc, argv);
+	if (lispyOptions.emitC && !hasFile)
+	{
+		printf("error: no file to compile\n");
+		exit(1);
+	}
+
+	if (lispyOptions.emitC)
+		emit_c(argv[fileIndex]);
 	else
-		repl();
+	{
+		if (!load_prelude(hasFile) && !hasFile)
+			printf("warning: proceeding without prelude\n\n");
+
+		if (hasFile)
+			read_file(argv[fileIndex]);
+		else
+			repl();
+	}
 
 	lenv_del(globalEnv);
+	hashcons_free();
 	clear_history();
 	free_parsers();
 	
 	return 0;
 }
 
+int parse_options(int argc, char** argv)
+{
+	int i = 1;
+
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+	{
+		const char* option = argv[i] + 2;
+
+		if (strcmp(option, "no-jit") == 0)
+			lispyOptions.jitEnabled = false;
+		else if (strcmp(option, "jit-verify") == 0)
+			lispyOptions.jitVerify = true;
+		else if (strcmp(option, "no-optimize") == 0)
+			lispyOptions.optimize = false;
+		else if (strcmp(option, "assume-builtins-fixed") == 0)
+			lispyOptions.assumeBuiltinsFixed = true;
+		else if (strcmp(option, "fold-report") == 0)
+			lispyOptions.foldReport = true;
+		else if (strncmp(option, "inline-threshold=", 17) == 0)
+			lispyOptions.inlineThreshold = strtoul(option + 17, NULL, 10);
+		else if (strcmp(option, "loop-report") == 0)
+			lispyOptions.loopReport = true;
+		else if (strcmp(option, "hash-cons") == 0)
+			lispyOptions.hashCons = true;
+		else if (strcmp(option, "emit-c") == 0)
+			lispyOptions.emitC = true;
+		else if (strncmp(option, "jit-threshold=", 14) == 0)
+			lispyOptions.jitThreshold = strtoul(option + 14, NULL, 10);
+		else
+		{
+			printf("error: unknown option '%s'\n", argv[i]);
+			exit(1);
+		}
+	}
+
+	return i;
+}
+
 void repl()
 {
 	printf("Ilispy v0.1.0\n");
@@ -137,12 +195,12 @@ void repl()
 	free(input);
 }
 
-void read_file(int argc, char** argv)
+void read_file(const char* fileName)
 {
 	// TODO: argv, argc into lisp
 	
 	lval* args = lval_list();
-	list_add(args, lval_str(argv[1]));
+	list_add(args, lval_str(fileName));
 	lval* res = builtin_load_impl(globalEnv, args, true);
 	if (IS_ERR(res))
 		printf("runtime error: %s\n", res->err);
@@ -165,3 +223,24 @@ bool load_prelude(bool isSilence)
 	
 	return true;
 }
+
+void emit_c(const char* fileName)
+{
+	size_t length = strlen(fileName);
+	bool hasExtension = length > 3 && strcmp(fileName + length - 3, ".ls") == 0;
+	if (hasExtension) length -= 3;
+
+	char* outName = malloc(length + 3);
+	DIE_IF_NULL(outName);
+	memcpy(outName, fileName, length);
+	strcpy(outName + length, ".c");
+
+	lval* err = aot_emit_c(globalEnv, fileName, outName);
+	if (err != NULL)
+	{
+		printf("error: %s\n", err->err);
+		lval_del(err);
+	}
+
+	free(outName);
+}
@@ -0,0 +1,916 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <optimizer.h>
+
+#include <eval.h>
+#include <builtins.h>
+#include <options.h>
+#include <aot.h>
+
+typedef struct opt_context
+{
+	lenv* env;
+	// Local names are either bound in 'frame' or listed in 'formals'
+	lenv* frame;
+	lval* formals;
+	// Names of frame bindings, that are the same in every call
+	lval* constants;
+	bool usesEnv;
+	unsigned changes;
+	unsigned depth;
+	unsigned guardCount;
+	opt_guard* guards;
+	unsigned inliningCount;
+	lambda_info* inlining[OPTIMIZER_MAX_DEPTH];
+} opt_context;
+
+// Formal usage in lambda body, that is going to be inlined
+typedef struct opt_usage
+{
+	unsigned count;
+	bool conditional;
+} opt_usage;
+
+// Builtins without side effects, their calls on literals can be folded
+static const lbuiltin_func pureBuiltins[] =
+{
+	builtin_list, builtin_head, builtin_tail, builtin_join,
+	builtin_headstr, builtin_tailstr, builtin_joinstr,
+	builtin_string_length, builtin_substring, builtin_string_index,
+	builtin_string_split, builtin_string_join, builtin_string_replace,
+	builtin_string_to_number, builtin_number_to_string,
+	builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod,
+	builtin_eq, builtin_less, builtin_not, builtin_typeq,
+	builtin_lt, builtin_le, builtin_gt, builtin_ge, builtin_numeq,
+	builtin_cons, builtin_append, builtin_length, builtin_nth,
+	builtin_reverse, builtin_element,
+	builtin_record_get, builtin_record_set, builtin_record_is
+};
+
+bool optimizer_is_pure(lbuiltin_func func)
+{
+	for (unsigned i = 0; i < sizeof(pureBuiltins) / sizeof(pureBuiltins[0]); i++)
+		if (pureBuiltins[i] == func) return true;
+	return false;
+}
+
+// Literal evaluates to itself or to its quoted value
+bool optimizer_is_literal(lval* v)
+{
+	return IS_NUM(v) || IS_BOOL(v) || IS_STR(v) || IS_CHAR(v) || IS_QUOTE(v)
+		|| (IS_LIST(v) && v->count == 0);
+}
+
+// Builtins that evaluate or bind something in the environment of the call.
+// Higher-order builtins call lambdas with it as a parent
+static const lbuiltin_func envBuiltins[] =
+{
+	builtin_eval, builtin_load, builtin_def, builtin_let, builtin_set,
+	builtin_lambda, builtin_macro_internal, builtin_macroexpand, builtin_defrecord,
+	builtin_while, builtin_dotimes, builtin_for_each,
+	builtin_push, builtin_pop, builtin_set_nth, builtin_list_reserve,
+	builtin_sb_append, builtin_sb_to_string,
+	builtin_map, builtin_filter, builtin_foldl,
+	builtin_sort, builtin_sorted_insert, builtin_binary_search
+};
+
+bool optimizer_uses_env(lbuiltin_func func)
+{
+	for (unsigned i = 0; i < sizeof(envBuiltins) / sizeof(envBuiltins[0]); i++)
+		if (envBuiltins[i] == func) return true;
+	return false;
+}
+
+bool optimizer_is_case(lbuiltin_func func)
+{
+	return func == builtin_case || func == builtin_case_jump;
+}
+
+int optimizer_formal_index(lval* formals, lval* sym)
+{
+	for (unsigned i = 0; i < formals->count; i++)
+		if (strcmp(formals->cells[i]->sym, sym->sym) == 0) return i;
+	return -1;
+}
+
+// Bindings of callers are local too, they are not resolved, so the body
+// doesn't depend on them
+bool optimizer_is_local(opt_context* ctx, lval* sym)
+{
+	if (ctx->formals != NULL && optimizer_formal_index(ctx->formals, sym) != -1)
+		return true;
+
+	if (ctx->frame != NULL)
+		for (unsigned i = 0; i < ctx->frame->count; i++)
+			if (strcmp(ctx->frame->entries[i].key, sym->sym) == 0) return true;
+
+	return lenv_shadowed(ctx->env, sym->sym);
+}
+
+// Returns code that evaluates to 'value' or NULL. Quoted lists in code may be
+// read as clauses, so they are not packed
+lval* optimizer_literal(lval* value)
+{
+	if (IS_SYM(value) || IS_QUOTE(value) || (IS_LIST(value) && value->count != 0))
+		return lval_quote(list_generalize_deep(lval_copy(value)));
+
+	if (IS_ERR(value) || IS_MACRO(value)) return NULL;
+
+	return lval_copy(value);
+}
+
+// Returns literal for a specialized constant or NULL
+lval* optimizer_constant(opt_context* ctx, lval* sym)
+{
+	if (ctx->constants == NULL || optimizer_formal_index(ctx->constants, sym) == -1)
+		return NULL;
+
+	for (unsigned i = 0; i < ctx->frame->count; i++)
+		if (strcmp(ctx->frame->entries[i].key, sym->sym) == 0)
+			return optimizer_literal(ctx->frame->entries[i].value);
+
+	return NULL;
+}
+
+void optimizer_guard(opt_context* ctx, lval* sym)
+{
+	if (lispyOptions.assumeBuiltinsFixed)
+	{
+		lval* value = lenv_lookup(ctx->env, sym);
+		if (value != NULL && (IS_BUILTIN(value) || IS_MACRO(value))) return;
+	}
+
+	lenv_watched* binding = lenv_watch(sym->sym);
+	for (unsigned i = 0; i < ctx->guardCount; i++)
+		if (ctx->guards[i].binding == binding) return;
+
+	ctx->guardCount++;
+	ctx->guards = realloc(ctx->guards, sizeof(opt_guard) * ctx->guardCount);
+	DIE_IF_NULL(ctx->guards);
+	ctx->guards[ctx->guardCount - 1].binding = binding;
+	ctx->guards[ctx->guardCount - 1].expected = binding->version;
+}
+
+void optimizer_report(const char* what, lval* from, lval* to)
+{
+	if (!lispyOptions.foldReport) return;
+
+	lval* fromStr = lval_to_str(from);
+	if (to == NULL)
+		fprintf(stderr, "fold: %s %s\n", what, fromStr->str);
+	else
+	{
+		lval* toStr = lval_to_str(to);
+		fprintf(stderr, "fold: %s %s -> %s\n", what, fromStr->str, toStr->str);
+		lval_del(toStr);
+	}
+	lval_del(fromStr);
+}
+
+lval* optimizer_expr(opt_context* ctx, lval* expr);
+lval* optimizer_inline(opt_context* ctx, lval* expr, lval* func);
+opt_body* optimizer_optimize(lenv* env, lval* func, unsigned* changes);
+
+lval* optimizer_fold(opt_context* ctx, lval* expr, lbuiltin_func builtin)
+{
+	lval* args = lval_list();
+	for (unsigned i = 1; i < expr->count; i++)
+	{
+		lval* x = expr->cells[i];
+		list_add(args, lval_copy(IS_QUOTE(x) ? x->quoted : x));
+	}
+
+	// Errors are left to run time
+	lval* res = builtin(ctx->env, args);
+	if (IS_LIST(res) && res->count != 0)
+		res = lval_quote(list_generalize_deep(res));
+	else if (!optimizer_is_literal(res))
+	{
+		lval_del(res);
+		return expr;
+	}
+
+	ctx->changes++;
+	optimizer_report("folded", expr, res);
+	lval_del(expr);
+	return res;
+}
+
+lval* optimizer_cond(opt_context* ctx, lval* expr)
+{
+	for (unsigned i = 1; i < expr->count; i++)
+	{
+		lval* x = expr->cells[i];
+		if (!IS_QUOTE(x) || !IS_LIST(x->quoted) || x->quoted->count == 0)
+			return expr;
+	}
+
+	unsigned i = 1;
+	while (i < expr->count)
+	{
+		lval* test = expr->cells[i]->quoted->cells[0];
+		if (!IS_BOOL(test)) i++;
+		else if (!test->boolean)
+		{
+			ctx->changes++;
+			optimizer_report("removed unreachable clause", expr->cells[i]->quoted, NULL);
+			lval_del(list_pop(expr, i));
+		}
+		else
+		{
+			while (expr->count > i + 1)
+			{
+				ctx->changes++;
+				optimizer_report("removed unreachable clause", expr->cells[i + 1]->quoted, NULL);
+				lval_del(list_pop(expr, i + 1));
+			}
+			break;
+		}
+	}
+
+	// No clause can be chosen
+	if (expr->count == 1)
+	{
+		lval_del(expr);
+		return lval_list();
+	}
+
+	lval* first = expr->cells[1]->quoted;
+	if (IS_BOOL(first->cells[0]) && first->cells[0]->boolean && first->count <= 2)
+	{
+		lval* res = first->count == 1 ? lval_list() : list_pop(first, 1);
+		lval_del(expr);
+		return res;
+	}
+
+	return expr;
+}
+
+// Keys of 'case' are hashed once: the call is replaced with a call of
+// builtin_case_jump with a Map from keys to clauses
+lval* optimizer_case(opt_context* ctx, lval* expr)
+{
+	unsigned count = expr->count - 2;
+	lval** clauses = malloc(sizeof(lval*) * count);
+	if (count != 0) DIE_IF_NULL(clauses);
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		lval* x = expr->cells[i + 2];
+		if (!IS_QUOTE(x) || !IS_LIST(x->quoted))
+		{
+			free(clauses);
+			return expr;
+		}
+		clauses[i] = x->quoted;
+	}
+
+	hamt_node* table;
+	lval* err = builtin_case_table(clauses, count, &table);
+	free(clauses);
+
+	// Errors are left to run time
+	if (err != NULL)
+	{
+		lval_del(err);
+		return expr;
+	}
+
+	ctx->changes++;
+	optimizer_report("compiled jump table of", expr, NULL);
+
+	lval_del(expr->cells[0]);
+	expr->cells[0] = lval_builtin(builtin_case_jump);
+	return list_add(expr, lval_map(table));
+}
+
+// Counts nodes and checks that evaluation of 'body' doesn't depend on the
+// frame of the lambda: only builtins, that don't touch environment, are called
+bool optimizer_inlinable(opt_context* ctx, lval* body, lval* formals,
+						 opt_usage* usage, bool conditional, unsigned* size)
+{
+	(*size)++;
+
+	if (IS_SYM(body))
+	{
+		int i = optimizer_formal_index(formals, body);
+		if (i != -1)
+		{
+			usage[i].count++;
+			usage[i].conditional |= conditional;
+		}
+		return true;
+	}
+
+	if (!IS_LIST(body)) return true;
+	if (body->count == 1)
+		return optimizer_inlinable(ctx, body->cells[0], formals, usage, conditional, size);
+	if (body->count == 0) return true;
+
+	lval* head = body->cells[0];
+	if (!IS_SYM(head) || optimizer_formal_index(formals, head) != -1
+		|| optimizer_is_local(ctx, head))
+		return false;
+
+	// Clauses of 'case' are not substituted
+	lval* value = lenv_lookup(ctx->env, head);
+	if (value == NULL || !IS_BUILTIN(value) || optimizer_uses_env(value->builtin)
+		|| optimizer_is_case(value->builtin))
+		return false;
+
+	bool isCond = value->builtin == builtin_cond;
+
+	for (unsigned i = 1; i < body->count; i++)
+	{
+		lval* x = body->cells[i];
+
+		if (!isCond)
+		{
+			if (!optimizer_inlinable(ctx, x, formals, usage, conditional, size))
+				return false;
+			continue;
+		}
+
+		if (!IS_QUOTE(x) || !IS_LIST(x->quoted)) return false;
+
+		// Only the first test is always evaluated
+		for (unsigned j = 0; j < x->quoted->count; j++)
+			if (!optimizer_inlinable(ctx, x->quoted->cells[j], formals, usage,
+									 conditional || i != 1 || j != 0, size))
+				return false;
+	}
+
+	return true;
+}
+
+// Pure expressions can be moved, their evaluation has no side effects
+bool optimizer_is_pure_expr(opt_context* ctx, lval* expr)
+{
+	if (!IS_LIST(expr)) return IS_SYM(expr) || optimizer_is_literal(expr);
+	if (expr->count == 0) return true;
+	if (expr->count == 1) return optimizer_is_pure_expr(ctx, expr->cells[0]);
+
+	if (!IS_SYM(expr->cells[0]) || optimizer_is_local(ctx, expr->cells[0])) return false;
+
+	lval* value = lenv_lookup(ctx->env, expr->cells[0]);
+	if (value == NULL || !IS_BUILTIN(value) || !optimizer_is_pure(value->builtin))
+		return false;
+
+	for (unsigned i = 1; i < expr->count; i++)
+		if (!optimizer_is_pure_expr(ctx, expr->cells[i])) return false;
+
+	return true;
+}
+
+lval* optimizer_substitute(opt_context* ctx, lval* expr, lval* formals, lval* args,
+						   bool inClauses)
+{
+	if (IS_SYM(expr))
+	{
+		int i = optimizer_formal_index(formals, expr);
+		if (i == -1) return expr;
+
+		lval_del(expr);
+		return lval_copy(args->cells[i]);
+	}
+
+	if (IS_QUOTE(expr) && inClauses && IS_LIST(expr->quoted))
+	{
+		expr->quoted = optimizer_substitute(ctx, expr->quoted, formals, args, false);
+		return expr;
+	}
+
+	if (!IS_LIST(expr)) return expr;
+	expr->hash = 0;
+
+	// Body was checked by optimizer_inlinable, so every quote in a call of
+	// 'cond' contains a clause
+	lval* value = expr->count > 1 && IS_SYM(expr->cells[0])
+		? lenv_lookup(ctx->env, expr->cells[0])
+		: NULL;
+	bool isCond = value != NULL && IS_BUILTIN(value) && value->builtin == builtin_cond;
+
+	for (unsigned i = 0; i < expr->count; i++)
+		expr->cells[i] = optimizer_substitute(ctx, expr->cells[i], formals, args,
+											  isCond && i != 0);
+
+	return expr;
+}
+
+// Returns NULL if the call was not inlined
+lval* optimizer_inline(opt_context* ctx, lval* expr, lval* func)
+{
+	if (lispyOptions.inlineThreshold == 0 || func->env->count != 0
+		|| func->formals->count != expr->count - 1
+		|| ctx->inliningCount == OPTIMIZER_MAX_DEPTH)
+		return NULL;
+
+	for (unsigned i = 0; i < func->formals->count; i++)
+		if (strcmp(func->formals->cells[i]->sym, "&") == 0) return NULL;
+
+	// Recursion
+	for (unsigned i = 0; i < ctx->inliningCount; i++)
+		if (ctx->inlining[i] == func->info) return NULL;
+
+	lval* formals = func->formals;
+	lenv* savedFrame = ctx->frame;
+	lval* savedFormals = ctx->formals;
+	lval* savedConstants = ctx->constants;
+	bool savedUsesEnv = ctx->usesEnv;
+	ctx->frame = NULL;
+	ctx->formals = formals;
+	ctx->constants = NULL;
+	ctx->inlining[ctx->inliningCount++] = func->info;
+
+	lval* body = optimizer_expr(ctx, lval_copy(func->body));
+
+	ctx->inliningCount--;
+	ctx->frame = savedFrame;
+	ctx->formals = savedFormals;
+	ctx->constants = savedConstants;
+	ctx->usesEnv = savedUsesEnv;
+
+	opt_usage* usage = calloc(formals->count + 1, sizeof(opt_usage));
+	DIE_IF_NULL(usage);
+
+	unsigned size = 0;
+	bool ok = optimizer_inlinable(ctx, body, formals, usage, false, &size)
+		&& size <= lispyOptions.inlineThreshold;
+
+	// Arguments are evaluated before the call, so only simple or pure
+	// arguments, that are evaluated exactly once, can be substituted
+	for (unsigned i = 0; ok && i < formals->count; i++)
+	{
+		lval* arg = expr->cells[i + 1];
+		if (IS_SYM(arg) || optimizer_is_literal(arg)) continue;
+
+		ok = usage[i].count == 1 && !usage[i].conditional
+			&& optimizer_is_pure_expr(ctx, arg);
+	}
+
+	free(usage);
+
+	if (!ok)
+	{
+		lval_del(body);
+		return NULL;
+	}
+
+	lval* args = lval_list();
+	for (unsigned i = 1; i < expr->count; i++)
+		list_add(args, lval_copy(expr->cells[i]));
+
+	lval* res = optimizer_substitute(ctx, body, formals, args, false);
+	lval_del(args);
+
+	ctx->changes++;
+	optimizer_report("inlined", expr, res);
+	lval_del(expr);
+
+	return optimizer_expr(ctx, res);
+}
+
+// Specializes called lambda on leading arguments, that are literals or
+// global bindings, if this allows to optimize its body
+lval* optimizer_specialize_call(opt_context* ctx, lval* expr, lval* func)
+{
+	if (func->env->count != 0) return expr;
+
+	lenv* root = ctx->env;
+	while (root->parent != NULL) root = root->parent;
+
+	lval* args = lval_list();
+	for (unsigned i = 1; i < expr->count && i < func->formals->count; i++)
+	{
+		lval* x = expr->cells[i];
+		if (strcmp(func->formals->cells[i - 1]->sym, "&") == 0) break;
+
+		if (IS_SYM(x))
+		{
+			if (optimizer_is_local(ctx, x)) break;
+
+			lval* global = lenv_lookup(root, x);
+			if (global == NULL || global != lenv_lookup(ctx->env, x)
+				|| IS_MACRO(global) || IS_ERR(global))
+				break;
+
+			list_add(args, lval_copy(global));
+		}
+		else if (optimizer_is_literal(x))
+			list_add(args, lval_copy(IS_QUOTE(x) ? x->quoted : x));
+		else break;
+	}
+
+	if (args->count == 0)
+	{
+		lval_del(args);
+		return expr;
+	}
+
+	bool useful;
+	lval* residual = optimizer_specialize(ctx->env, func, args, &useful);
+	if (residual == NULL || !useful)
+	{
+		if (residual != NULL) lval_del(residual);
+		return expr;
+	}
+
+	for (unsigned i = 1; i <= residual->info->constants->count; i++)
+		if (IS_SYM(expr->cells[i])) optimizer_guard(ctx, expr->cells[i]);
+
+	ctx->changes++;
+	optimizer_report("specialized", expr, NULL);
+
+	lval* res = lval_list();
+	list_add(res, residual);
+	for (unsigned i = residual->info->constants->count + 1; i < expr->count; i++)
+		list_add(res, lval_copy(expr->cells[i]));
+
+	lval_del(expr);
+	return res;
+}
+
+lval* optimizer_call(opt_context* ctx, lval* expr)
+{
+	lval* constant = IS_SYM(expr->cells[0]) ? optimizer_constant(ctx, expr->cells[0]) : NULL;
+	if (constant != NULL)
+	{
+		lval_del(expr->cells[0]);
+		expr->cells[0] = constant;
+	}
+
+	lval* head = expr->cells[0];
+	lval* value = NULL;
+
+	if (IS_LAMBDA(head) || IS_BUILTIN(head)) value = head;
+	else if (!IS_SYM(head))
+	{
+		// Value of computed function may be a macro, so its arguments are
+		// left as is
+		expr->cells[0] = optimizer_expr(ctx, head);
+		return expr;
+	}
+	else if (optimizer_is_local(ctx, head)) return expr;
+	else
+	{
+		optimizer_guard(ctx, head);
+		value = lenv_lookup(ctx->env, head);
+	}
+
+	if (value != NULL && IS_MACRO(value))
+	{
+		lval* macro = lval_copy(value);
+		lval* args = lval_copy(expr);
+		lval_del(list_pop(args, 0));
+
+		lval* expanded = eval_macro_expand(macro, args);
+		lval_del(macro);
+		lval_del(args);
+
+		if (IS_ERR(expanded))
+		{
+			lval_del(expanded);
+			return expr;
+		}
+
+		lval_del(expr);
+		return optimizer_expr(ctx, expanded);
+	}
+
+	bool isBuiltin = value != NULL && IS_BUILTIN(value);
+	bool isCond = isBuiltin && value->builtin == builtin_cond;
+	bool isCase = isBuiltin && optimizer_is_case(value->builtin);
+
+	if (isBuiltin && optimizer_uses_env(value->builtin)) ctx->usesEnv = true;
+
+	for (unsigned i = 1; i < expr->count; i++)
+	{
+		lval* x = expr->cells[i];
+
+		// Clauses of 'cond' are evaluated by it
+		if ((isCond || (isCase && i != 1)) && IS_QUOTE(x) && IS_LIST(x->quoted))
+		{
+			x->quoted->hash = 0;
+			for (unsigned j = isCase ? 1 : 0; j < x->quoted->count; j++)
+				x->quoted->cells[j] = optimizer_expr(ctx, x->quoted->cells[j]);
+		}
+		else expr->cells[i] = optimizer_expr(ctx, x);
+	}
+
+	if (isCond) return optimizer_cond(ctx, expr);
+	if (isCase && value->builtin == builtin_case) return optimizer_case(ctx, expr);
+
+	if (value != NULL && IS_LAMBDA(value))
+	{
+		lval* inlined = optimizer_inline(ctx, expr, value);
+		return inlined != NULL ? inlined : optimizer_specialize_call(ctx, expr, value);
+	}
+
+	if (!isBuiltin || !optimizer_is_pure(value->builtin)) return expr;
+
+	for (unsigned i = 1; i < expr->count; i++)
+		if (!optimizer_is_literal(expr->cells[i])) return expr;
+
+	return optimizer_fold(ctx, expr, value->builtin);
+}
+
+lval* optimizer_expr(opt_context* ctx, lval* expr)
+{
+	if (IS_SYM(expr))
+	{
+		lval* constant = optimizer_constant(ctx, expr);
+		if (constant == NULL) return expr;
+
+		lval_del(expr);
+		return constant;
+	}
+
+	if (!IS_LIST(expr) || expr->count == 0 || ctx->depth >= OPTIMIZER_MAX_DEPTH)
+		return expr;
+
+	// Calls are changed in place
+	expr->hash = 0;
+	ctx->depth++;
+
+	if (expr->count == 1)
+	{
+		expr->cells[0] = optimizer_expr(ctx, expr->cells[0]);
+		if (optimizer_is_literal(expr->cells[0]))
+			expr = list_take(expr, 0);
+	}
+	else expr = optimizer_call(ctx, expr);
+
+	ctx->depth--;
+	return expr;
+}
+
+// Replaces builtins in calls, whose arguments are known to have right types,
+// with versions without checks. Returns type of the value of 'expr' or
+// BUILTIN_ANY if it is unknown. Erroneous arguments never reach builtins
+lval_type optimizer_unchecked(opt_context* ctx, lval* expr)
+{
+	if (IS_NUM(expr) || IS_STR(expr) || IS_CHAR(expr) || IS_BOOL(expr)) return expr->type;
+	if (IS_QUOTE(expr)) return expr->quoted->type;
+	if (!IS_LIST(expr)) return BUILTIN_ANY;
+
+	if (expr->count == 0) return LVAL_LIST;
+	if (expr->count == 1) return optimizer_unchecked(ctx, expr->cells[0]);
+	expr->hash = 0;
+
+	lval* head = expr->cells[0];
+	lval* value = NULL;
+
+	if (IS_BUILTIN(head) || IS_LAMBDA(head)) value = head;
+	else if (IS_SYM(head) && !optimizer_is_local(ctx, head)) value = lenv_lookup(ctx->env, head);
+
+	// Arguments of macros are not evaluated
+	if (value == NULL || !(IS_BUILTIN(value) || IS_LAMBDA(value))) return BUILTIN_ANY;
+
+	bool isCase = IS_BUILTIN(value) && optimizer_is_case(value->builtin);
+	if (IS_BUILTIN(value) && (value->builtin == builtin_cond || isCase))
+	{
+		if (isCase) optimizer_unchecked(ctx, expr->cells[1]);
+
+		for (unsigned i = isCase ? 2 : 1; i < expr->count; i++)
+		{
+			lval* x = expr->cells[i];
+			if (!IS_QUOTE(x) || !IS_LIST(x->quoted)) continue;
+
+			for (unsigned j = isCase ? 1 : 0; j < x->quoted->count; j++)
+				optimizer_unchecked(ctx, x->quoted->cells[j]);
+		}
+
+		return BUILTIN_ANY;
+	}
+
+	const builtin_signature* sig = IS_BUILTIN(value) ? builtin_signature_of(value->builtin) : NULL;
+	int argc = expr->count - 1;
+	bool known = sig != NULL && argc >= sig->min && (sig->max == -1 || argc <= sig->max);
+
+	for (unsigned i = 1; i < expr->count; i++)
+	{
+		lval_type type = optimizer_unchecked(ctx, expr->cells[i]);
+		if (sig != NULL && !BUILTIN_TYPE_MATCHES(builtin_signature_type(sig, i - 1), type))
+			known = false;
+	}
+
+	if (sig == NULL) return BUILTIN_ANY;
+
+	if (known && value->argvBuiltin != sig->unchecked)
+	{
+		lval* unchecked = lval_builtin_argv(sig->func, sig->unchecked);
+		lval_del(expr->cells[0]);
+		expr->cells[0] = unchecked;
+	}
+
+	return sig->result;
+}
+
+// Returns false if bindings, that the body depends on, were changed. Sets
+// 'shadowed', if some of them are shadowed by local bindings in 'env'
+bool optimizer_guards_hold(lenv* env, opt_body* body, bool* shadowed)
+{
+	*shadowed = false;
+
+	for (unsigned i = 0; i < body->guardCount; i++)
+	{
+		lenv_watched* binding = body->guards[i].binding;
+		if (binding->version != body->guards[i].expected) return false;
+
+		if (binding->shadows != 0 && lenv_shadowed(env, binding->name))
+			*shadowed = true;
+	}
+
+	return true;
+}
+
+opt_body* optimizer_optimize(lenv* env, lval* func, unsigned* changes)
+{
+	opt_context ctx;
+	ctx.env = env;
+	ctx.frame = func->env;
+	ctx.formals = func->formals;
+	ctx.constants = func->info->constants;
+	ctx.usesEnv = false;
+	ctx.changes = 0;
+	ctx.depth = 0;
+	ctx.inliningCount = 0;
+	ctx.guardCount = 0;
+	ctx.guards = NULL;
+
+	lval* body = optimizer_expr(&ctx, lval_copy(func->body));
+
+	// Constants may be rebound in the frame
+	if (ctx.usesEnv && ctx.constants != NULL)
+	{
+		lval_del(body);
+		free(ctx.guards);
+		ctx.constants = NULL;
+		ctx.usesEnv = false;
+		ctx.changes = 0;
+		ctx.guardCount = 0;
+		ctx.guards = NULL;
+		body = optimizer_expr(&ctx, lval_copy(func->body));
+	}
+
+	// Local bindings may shadow builtins
+	if (!ctx.usesEnv) optimizer_unchecked(&ctx, body);
+
+	if (changes != NULL) *changes = ctx.changes;
+
+	opt_body* res = malloc(sizeof(opt_body));
+	DIE_IF_NULL(res);
+	res->body = body;
+	res->guardCount = ctx.guardCount;
+	res->guards = ctx.guards;
+	res->loop = recursion_analyze(env, func, body);
+	res->refs = 1;
+	return res;
+}
+
+lval* optimizer_body(lenv* env, lval* func)
+{
+	lambda_info* info = func->info;
+
+	if (!lispyOptions.optimize) return func->body;
+
+	if (info->optimized != NULL)
+	{
+		bool shadowed;
+		if (optimizer_guards_hold(env, info->optimized, &shadowed))
+			return shadowed ? func->body : info->optimized->body;
+
+		optimizer_free(info->optimized);
+		info->optimized = NULL;
+		info->optRetries++;
+	}
+
+	// Bindings change too often
+	if (info->optRetries >= OPTIMIZER_MAX_RETRIES) return func->body;
+
+	if (++info->optCalls < OPTIMIZER_THRESHOLD) return func->body;
+
+	info->optimized = optimizer_optimize(env, func, NULL);
+	return info->optimized->body;
+}
+
+lval* optimizer_eval(lenv* env, lval* func)
+{
+	lval* body = optimizer_body(env, func);
+	opt_body* optimized = func->info->optimized;
+
+	if (optimized == NULL || optimized->body != body || optimized->loop == NULL)
+	{
+		// Compiled body doesn't loop, so deep recursion is left to the interpreter
+		if (func->info->aot != NULL && !AOT_STACK_EXHAUSTED())
+			return func->info->aot(env);
+
+		return eval_lval(env, lval_copy(body));
+	}
+
+	// Body may be reoptimized while the loop runs
+	optimized->refs++;
+	lval* res = recursion_run(env, optimized->loop);
+	optimizer_free(optimized);
+	return res;
+}
+
+void optimizer_free(opt_body* body)
+{
+	if (--body->refs != 0) return;
+
+	if (body->loop != NULL) recursion_free(body->loop);
+	lval_del(body->body);
+	free(body->guards);
+	free(body);
+}
+
+lval* optimizer_specialize(lenv* env, lval* func, lval* args, bool* useful)
+{
+	lambda_info* info = func->info;
+
+	unsigned count = 0;
+	for (opt_specialization* spec = info->specializations; spec != NULL; spec = spec->next)
+	{
+		if (lval_eq(spec->args, args))
+		{
+			lval_del(args);
+			if (useful != NULL) *useful = spec->useful;
+			return lval_copy(spec->residual);
+		}
+		count++;
+	}
+
+	if (count == OPTIMIZER_MAX_SPECIALIZATIONS)
+	{
+		lval_del(args);
+		return NULL;
+	}
+
+	lval* residual = lval_copy(func);
+	lambda_info_release(residual->info);
+	residual->info = lambda_info_new();
+	residual->info->constants = lval_list();
+
+	for (unsigned i = 0; i < args->count; i++)
+	{
+		lval* formal = list_pop(residual->formals, 0);
+		lenv_bind(residual->env, formal, args->cells[i]);
+		list_add(residual->info->constants, formal);
+	}
+
+	opt_specialization* spec = malloc(sizeof(opt_specialization));
+	DIE_IF_NULL(spec);
+	spec->args = args;
+	spec->residual = residual;
+	spec->next = info->specializations;
+	info->specializations = spec;
+
+	// Residual is optimized once here to find out if specialization is useful
+	unsigned changes = 0;
+	if (lispyOptions.optimize)
+	{
+		residual->env->parent = env;
+		residual->info->optimized = optimizer_optimize(env, residual, &changes);
+		residual->env->parent = NULL;
+	}
+	spec->useful = changes != 0;
+
+	if (useful != NULL) *useful = spec->useful;
+	return lval_copy(residual);
+}
+
+void optimizer_free_specializations(opt_specialization* spec)
+{
+	while (spec != NULL)
+	{
+		opt_specialization* next = spec->next;
+		lval_del(spec->args);
+		lval_del(spec->residual);
+		free(spec);
+		spec = next;
+	}
+}
@@ -25,11 +25,14 @@
 
 #include <reader.h>
 
+#include <options.h>
+#include <hashcons.h>
+
 lval* read_lval_num(mpc_ast_t* node)
 {
 	errno = 0;
 	long x = strtol(node->contents, NULL, 10);
-	return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+	return errno != ERANGE ? lval_num(x) : lval_num_big(bignum_parse(node->contents));
 }
 
 lval* read_lval_str(mpc_ast_t* node)
@@ -44,7 +47,18 @@ lval* read_lval_str(mpc_ast_t* node)
 	lval* str = lval_str(unescaped);
 	free(unescaped);
 	
-	return str;
+	return lispyOptions.hashCons ? hashcons_intern(str) : str;
+}
+
+// '#\\a', '#\\space', '#\\newline' or '#\\tab'
+lval* read_lval_char(mpc_ast_t* node)
+{
+	const char* name = node->contents + 2;
+
+	if (strcmp(name, "space") == 0)   return lval_char(' ');
+	if (strcmp(name, "newline") == 0) return lval_char('\n');
+	if (strcmp(name, "tab") == 0)     return lval_char('\t');
+	return lval_char(name[0]);
 }
 
 lval* read_lval(mpc_ast_t* node)
@@ -53,11 +67,13 @@ lval* read_lval(mpc_ast_t* node)
 
 	if (CHECK_NODE("quote"))  
 	{
-		return lval_quote(read_lval(node->children[1]));
+		lval* quoted = read_lval(node->children[1]);
+		return lval_quote(lispyOptions.hashCons ? hashcons_intern(quoted) : quoted);
 	}
 	
 	if (CHECK_NODE("number"))  return read_lval_num(node);
 	if (CHECK_NODE("string"))  return read_lval_str(node);
+	if (CHECK_NODE("character")) return read_lval_char(node);
 	
 	if (CHECK_NODE("symbol"))
 	{
@@ -0,0 +1,59 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <record.h>
+
+static record_type* recordTypes = NULL;
+static unsigned recordTypeCount = 0;
+
+char* record_str_copy(const char* str)
+{
+	char* res = malloc(strlen(str) + 1);
+	DIE_IF_NULL(res);
+	strcpy(res, str);
+	return res;
+}
+
+unsigned record_type_add(const char* name, lval* fields)
+{
+	recordTypes = realloc(recordTypes, sizeof(record_type) * (recordTypeCount + 1));
+	DIE_IF_NULL(recordTypes);
+
+	record_type* type = &recordTypes[recordTypeCount];
+	type->name = record_str_copy(name);
+	type->count = fields->count;
+	type->fields = malloc(sizeof(char*) * fields->count);
+	if (fields->count != 0) DIE_IF_NULL(type->fields);
+
+	for (unsigned i = 0; i < fields->count; i++)
+		type->fields[i] = record_str_copy(fields->cells[i]->sym);
+
+	return recordTypeCount++;
+}
+
+record_type* record_type_get(long id)
+{
+	return id >= 0 && id < recordTypeCount ? &recordTypes[id] : NULL;
+}
@@ -0,0 +1,692 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <recursion.h>
+
+#include <eval.h>
+#include <builtins.h>
+#include <optimizer.h>
+#include <options.h>
+
+typedef enum
+{
+	REC_COND,
+	REC_BASE,
+	REC_RECUR
+} rec_kind;
+
+// Operation, that is applied to the result of the recursive call. 'wrap' is
+// set for builtin 'cons' and cons-like lambdas, whose operand is wrapped into
+// a list and joined. 'cons' is set for the builtin to report its own error
+typedef struct rec_step
+{
+	lval* func;
+	lval* operand;
+	bool operandFirst;
+	bool wrap;
+	bool cons;
+} rec_step;
+
+typedef struct rec_node
+{
+	rec_kind kind;
+	unsigned count;
+
+	// REC_COND
+	lval** tests;
+	struct rec_node** children;
+
+	// REC_BASE
+	lval* expr;
+
+	// REC_RECUR, steps are ordered from the outermost
+	rec_step* steps;
+	lval* args;
+} rec_node;
+
+struct rec_loop
+{
+	rec_node* root;
+	lval* formals;
+};
+
+typedef struct rec_context
+{
+	lenv* env;
+	lenv* frame;
+	lambda_info* info;
+	lval* self;
+	const char* name;
+	bool recursive;
+} rec_context;
+
+typedef enum
+{
+	REC_PENDING_STEP,
+	REC_PENDING_AFFINE,
+	REC_PENDING_CONCAT
+} rec_pending_kind;
+
+// Pending operations of the loop. Affine accumulator stands for A + B * R,
+// concatenation accumulator for (op acc R). The innermost operation and its
+// operand are kept to report the same error, when R is not a Number. 'cons'
+// is set when the innermost operation is builtin 'cons'
+typedef struct rec_pending
+{
+	rec_pending_kind kind;
+	lval* func;
+	lval* a;
+	lval* b;
+	lval* last;
+	bool operandFirst;
+	bool cons;
+} rec_pending;
+
+typedef struct rec_stack
+{
+	rec_pending* items;
+	unsigned count;
+	unsigned capacity;
+} rec_stack;
+
+lval* recursion_lookup(rec_context* ctx, lval* sym)
+{
+	for (unsigned i = 0; i < ctx->frame->count; i++)
+		if (strcmp(ctx->frame->entries[i].key, sym->sym) == 0) return NULL;
+
+	// Bindings of callers are not resolved, see optimizer_is_local
+	if (lenv_shadowed(ctx->env, sym->sym)) return NULL;
+
+	return lenv_lookup(ctx->env, sym);
+}
+
+bool recursion_is_self(rec_context* ctx, lval* sym)
+{
+	if (!IS_SYM(sym)) return false;
+
+	lval* value = recursion_lookup(ctx, sym);
+	if (value == NULL || !IS_LAMBDA(value) || value->info != ctx->info) return false;
+
+	ctx->self = value;
+	ctx->name = sym->sym;
+	return true;
+}
+
+bool recursion_contains_self(rec_context* ctx, lval* expr)
+{
+	if (IS_SYM(expr)) return recursion_is_self(ctx, expr);
+	if (IS_QUOTE(expr)) return recursion_contains_self(ctx, expr->quoted);
+	if (!IS_LIST(expr)) return false;
+
+	for (unsigned i = 0; i < expr->count; i++)
+		if (recursion_contains_self(ctx, expr->cells[i])) return true;
+
+	return false;
+}
+
+// Optimizer may replace names of builtins with their values
+lval* recursion_head(rec_context* ctx, lval* expr)
+{
+	if (!IS_LIST(expr) || expr->count == 0) return NULL;
+
+	lval* head = expr->cells[0];
+	if (IS_BUILTIN(head)) return head;
+
+	return IS_SYM(head) ? recursion_lookup(ctx, head) : NULL;
+}
+
+lbuiltin_func recursion_builtin(rec_context* ctx, lval* expr)
+{
+	lval* value = recursion_head(ctx, expr);
+	return value != NULL && IS_BUILTIN(value) ? value->builtin : NULL;
+}
+
+bool recursion_uses_frame(rec_context* ctx, lval* expr, lval* formals)
+{
+	if (IS_SYM(expr))
+	{
+		for (unsigned i = 0; i < formals->count; i++)
+			if (strcmp(formals->cells[i]->sym, expr->sym) == 0) return false;
+
+		for (unsigned i = 0; i < ctx->frame->count; i++)
+			if (strcmp(ctx->frame->entries[i].key, expr->sym) == 0) return true;
+
+		return false;
+	}
+
+	if (IS_QUOTE(expr)) return recursion_uses_frame(ctx, expr->quoted, formals);
+	if (!IS_LIST(expr)) return false;
+
+	for (unsigned i = 0; i < expr->count; i++)
+		if (recursion_uses_frame(ctx, expr->cells[i], formals)) return true;
+
+	return false;
+}
+
+bool recursion_is_global_builtin(rec_context* ctx, lval* sym, lval* formals, lbuiltin_func func)
+{
+	if (!IS_SYM(sym)) return false;
+
+	for (unsigned i = 0; i < formals->count; i++)
+		if (strcmp(formals->cells[i]->sym, sym->sym) == 0) return false;
+
+	lval* value = recursion_lookup(ctx, sym);
+	return value != NULL && IS_BUILTIN(value) && value->builtin == func;
+}
+
+bool recursion_is(lval* func, lbuiltin_func builtin)
+{
+	return IS_BUILTIN(func) && func->builtin == builtin;
+}
+
+// Lambda with body (join (list x) l)
+bool recursion_is_cons(rec_context* ctx, lval* func)
+{
+	lval* body = func->body;
+	while (IS_LIST(body) && body->count == 1) body = body->cells[0];
+
+	lval* formals = func->formals;
+	if (!IS_LIST(body) || body->count != 3
+		|| !recursion_is_global_builtin(ctx, body->cells[0], formals, builtin_join))
+		return false;
+
+	lval* x = body->cells[1];
+	while (IS_LIST(x) && x->count == 1) x = x->cells[0];
+
+	return IS_LIST(x) && x->count == 2
+		&& recursion_is_global_builtin(ctx, x->cells[0], formals, builtin_list)
+		&& IS_SYM(x->cells[1]) && strcmp(x->cells[1]->sym, formals->cells[0]->sym) == 0
+		&& IS_SYM(body->cells[2]) && strcmp(body->cells[2]->sym, formals->cells[1]->sym) == 0;
+}
+
+// Returns borrowed builtin or lambda, that can be applied after the recursive
+// call. Lambdas are called with the loop frame as a parent, so they must not
+// see formals of the recursive function
+lval* recursion_operation(rec_context* ctx, lval* expr)
+{
+	if (!IS_LIST(expr) || expr->count != 3) return NULL;
+
+	lval* value = recursion_head(ctx, expr);
+	if (value == NULL) return NULL;
+
+	if (IS_BUILTIN(value))
+		return value->builtin == builtin_cond || optimizer_uses_env(value->builtin)
+			|| optimizer_is_case(value->builtin) ? NULL : value;
+
+	if (!IS_LAMBDA(value) || value->info == ctx->info || value->env->count != 0
+		|| value->formals->count != 2)
+		return NULL;
+
+	for (unsigned i = 0; i < 2; i++)
+		if (strcmp(value->formals->cells[i]->sym, "&") == 0) return NULL;
+
+	return recursion_uses_frame(ctx, value->body, value->formals) ? NULL : value;
+}
+
+// Evaluation of the expression shouldn't bind anything in the frame
+bool recursion_uses_env(rec_context* ctx, lval* expr)
+{
+	if (IS_QUOTE(expr)) return recursion_uses_env(ctx, expr->quoted);
+	if (!IS_LIST(expr)) return false;
+
+	lbuiltin_func builtin = recursion_builtin(ctx, expr);
+	if (builtin != NULL && optimizer_uses_env(builtin)) return true;
+
+	for (unsigned i = 0; i < expr->count; i++)
+		if (recursion_uses_env(ctx, expr->cells[i])) return true;
+
+	return false;
+}
+
+bool recursion_is_pure(rec_context* ctx, lval* expr)
+{
+	if (!IS_LIST(expr)) return !IS_ERR(expr);
+	if (expr->count == 0) return true;
+	if (expr->count == 1) return recursion_is_pure(ctx, expr->cells[0]);
+
+	lbuiltin_func builtin = recursion_builtin(ctx, expr);
+	if (builtin == NULL || !optimizer_is_pure(builtin)) return false;
+
+	for (unsigned i = 1; i < expr->count; i++)
+		if (!recursion_is_pure(ctx, expr->cells[i])) return false;
+
+	return true;
+}
+
+void recursion_node_del(rec_node* node)
+{
+	if (node == NULL) return;
+
+	switch (node->kind)
+	{
+	case REC_COND:
+		for (unsigned i = 0; i < node->count; i++)
+		{
+			if (node->tests[i] != NULL) lval_del(node->tests[i]);
+			recursion_node_del(node->children[i]);
+		}
+		free(node->tests);
+		free(node->children);
+		break;
+	case REC_BASE:
+		lval_del(node->expr);
+		break;
+	case REC_RECUR:
+		for (unsigned i = 0; i < node->count; i++)
+		{
+			lval_del(node->steps[i].func);
+			lval_del(node->steps[i].operand);
+		}
+		free(node->steps);
+		if (node->args != NULL) lval_del(node->args);
+		break;
+	}
+
+	free(node);
+}
+
+rec_node* recursion_node_new(rec_kind kind)
+{
+	rec_node* node = calloc(1, sizeof(rec_node));
+	DIE_IF_NULL(node);
+	node->kind = kind;
+	return node;
+}
+
+rec_node* recursion_recur(rec_context* ctx, lval* expr)
+{
+	rec_node* node = recursion_node_new(REC_RECUR);
+
+	for (;;)
+	{
+		if (!IS_LIST(expr) || expr->count == 0) break;
+
+		if (expr->count == 1)
+		{
+			expr = expr->cells[0];
+			continue;
+		}
+
+		if (recursion_is_self(ctx, expr->cells[0]))
+		{
+			if (ctx->self->env->count != 0 || expr->count - 1 != ctx->self->formals->count)
+				break;
+
+			for (unsigned i = 1; i < expr->count; i++)
+				if (recursion_contains_self(ctx, expr->cells[i])
+					|| recursion_uses_env(ctx, expr->cells[i]))
+				{
+					recursion_node_del(node);
+					return NULL;
+				}
+
+			node->args = lval_copy(expr);
+			lval_del(list_pop(node->args, 0));
+			ctx->recursive = true;
+			return node;
+		}
+
+		lval* op = recursion_operation(ctx, expr);
+		if (op == NULL) break;
+
+		bool firstSelf = recursion_contains_self(ctx, expr->cells[1]);
+		bool secondSelf = recursion_contains_self(ctx, expr->cells[2]);
+		if (firstSelf == secondSelf) break;
+
+		// Operand after the call is evaluated before it, so it must be pure
+		lval* operand = firstSelf ? expr->cells[2] : expr->cells[1];
+		if (recursion_uses_env(ctx, operand) || (firstSelf && !recursion_is_pure(ctx, operand)))
+			break;
+
+		node->count++;
+		node->steps = realloc(node->steps, sizeof(rec_step) * node->count);
+		DIE_IF_NULL(node->steps);
+
+		rec_step* step = &node->steps[node->count - 1];
+		step->operand = lval_copy(operand);
+		step->operandFirst = !firstSelf;
+		step->cons = !firstSelf && recursion_is(op, builtin_cons);
+		step->wrap = step->cons || (!firstSelf && IS_LAMBDA(op) && recursion_is_cons(ctx, op));
+		step->func = step->wrap ? lval_builtin(builtin_join) : lval_copy(op);
+
+		expr = firstSelf ? expr->cells[1] : expr->cells[2];
+	}
+
+	recursion_node_del(node);
+	return NULL;
+}
+
+rec_node* recursion_node(rec_context* ctx, lval* expr)
+{
+	if (recursion_builtin(ctx, expr) == builtin_cond)
+	{
+		for (unsigned i = 1; i < expr->count; i++)
+		{
+			lval* x = expr->cells[i];
+			if (!IS_QUOTE(x) || !IS_LIST(x->quoted) || x->quoted->count != 2)
+				return NULL;
+		}
+
+		rec_node* node = recursion_node_new(REC_COND);
+		node->tests = calloc(expr->count, sizeof(lval*));
+		node->children = calloc(expr->count, sizeof(rec_node*));
+		DIE_IF_NULL(node->tests);
+		DIE_IF_NULL(node->children);
+
+		for (unsigned i = 1; i < expr->count; i++)
+		{
+			lval* clause = expr->cells[i]->quoted;
+			node->count++;
+
+			if (recursion_contains_self(ctx, clause->cells[0])
+				|| recursion_uses_env(ctx, clause->cells[0]))
+			{
+				recursion_node_del(node);
+				return NULL;
+			}
+
+			node->tests[i - 1] = lval_copy(clause->cells[0]);
+			node->children[i - 1] = recursion_node(ctx, clause->cells[1]);
+			if (node->children[i - 1] == NULL)
+			{
+				recursion_node_del(node);
+				return NULL;
+			}
+		}
+
+		return node;
+	}
+
+	if (!recursion_contains_self(ctx, expr))
+	{
+		rec_node* node = recursion_node_new(REC_BASE);
+		node->expr = lval_copy(expr);
+		return node;
+	}
+
+	return recursion_recur(ctx, expr);
+}
+
+rec_loop* recursion_analyze(lenv* env, lval* func, lval* body)
+{
+	rec_context ctx;
+	ctx.env = env;
+	ctx.frame = func->env;
+	ctx.info = func->info;
+	ctx.self = NULL;
+	ctx.name = NULL;
+	ctx.recursive = false;
+
+	rec_node* root = recursion_node(&ctx, body);
+	if (root == NULL || !ctx.recursive)
+	{
+		recursion_node_del(root);
+		return NULL;
+	}
+
+	lval* formals = ctx.self->formals;
+	for (unsigned i = 0; i < formals->count; i++)
+		if (strcmp(formals->cells[i]->sym, "&") == 0)
+		{
+			recursion_node_del(root);
+			return NULL;
+		}
+
+	rec_loop* loop = malloc(sizeof(rec_loop));
+	DIE_IF_NULL(loop);
+	loop->root = root;
+	loop->formals = lval_copy(formals);
+
+	if (lispyOptions.loopReport) fprintf(stderr, "loop: %s\n", ctx.name);
+
+	return loop;
+}
+
+void recursion_free(rec_loop* loop)
+{
+	recursion_node_del(loop->root);
+	lval_del(loop->formals);
+	free(loop);
+}
+
+lval* recursion_apply(lenv* env, lbuiltin_func op, lval* x, lval* y)
+{
+	lval* args = lval_list();
+	list_add(args, x);
+	list_add(args, y);
+	return op(env, args);
+}
+
+lval* recursion_call(lenv* env, lval* func, lval* x, lval* y)
+{
+	if (IS_BUILTIN(func)) return recursion_apply(env, func->builtin, x, y);
+
+	lval* args = lval_list();
+	list_add(args, x);
+	list_add(args, y);
+	return eval_func_call(env, lval_copy(func), args);
+}
+
+rec_pending* recursion_push(rec_stack* stack, rec_pending_kind kind, lval* func)
+{
+	if (stack->count == stack->capacity)
+	{
+		stack->capacity = stack->capacity == 0 ? 16 : stack->capacity * 2;
+		stack->items = realloc(stack->items, sizeof(rec_pending) * stack->capacity);
+		DIE_IF_NULL(stack->items);
+	}
+
+	rec_pending* p = &stack->items[stack->count++];
+	p->kind = kind;
+	p->func = func;
+	p->a = NULL;
+	p->b = NULL;
+	p->last = NULL;
+	p->operandFirst = true;
+	p->cons = false;
+	return p;
+}
+
+void recursion_pending(lenv* env, rec_stack* stack, rec_step* step, lval* v)
+{
+	rec_pending* top = stack->count == 0 ? NULL : &stack->items[stack->count - 1];
+	lval* func = step->func;
+
+	if (step->wrap && !IS_ERR(v))
+	{
+		lval* list = lval_list();
+		list_add(list, v);
+		v = list;
+	}
+
+	if (step->operandFirst && IS_NUM(v)
+		&& (recursion_is(func, builtin_add) || recursion_is(func, builtin_mul)))
+	{
+		bool fresh = top == NULL || top->kind != REC_PENDING_AFFINE;
+		lval* a = fresh ? lval_num(0) : lval_copy(top->a);
+		lval* b = fresh ? lval_num(1) : lval_copy(top->b);
+
+		// A + B * (v + R) = (A + B * v) + B * R, A + B * (v * R) = A + (B * v) * R
+		if (recursion_is(func, builtin_add))
+			a = recursion_apply(env, builtin_add, a,
+								recursion_apply(env, builtin_mul, lval_copy(b), lval_copy(v)));
+		else
+			b = recursion_apply(env, builtin_mul, b, lval_copy(v));
+
+		if (fresh) top = recursion_push(stack, REC_PENDING_AFFINE, NULL);
+		else
+		{
+			lval_del(top->a);
+			lval_del(top->b);
+			lval_del(top->last);
+		}
+
+		top->func = func;
+		top->a = a;
+		top->b = b;
+		top->last = v;
+		return;
+	}
+
+	if (step->operandFirst && ((recursion_is(func, builtin_join) && IS_LIST(v))
+							   || (recursion_is(func, builtin_joinstr) && IS_STR(v))))
+	{
+		if (top != NULL && top->kind == REC_PENDING_CONCAT && top->func->builtin == func->builtin)
+			top->a = recursion_apply(env, func->builtin, top->a, v);
+		else
+		{
+			top = recursion_push(stack, REC_PENDING_CONCAT, func);
+			top->a = v;
+		}
+		top->cons = step->cons;
+		return;
+	}
+
+	rec_pending* p = recursion_push(stack, REC_PENDING_STEP, func);
+	p->a = v;
+	p->operandFirst = step->operandFirst;
+}
+
+// Errors are propagated as interpreter does: the first erroneous argument wins
+lval* recursion_combine(lenv* env, rec_pending* p, lval* res)
+{
+	switch (p->kind)
+	{
+	case REC_PENDING_STEP:
+		if (p->operandFirst ? IS_ERR(p->a) : (!IS_ERR(res) && IS_ERR(p->a)))
+		{
+			lval_del(res);
+			return p->a;
+		}
+		if (IS_ERR(res))
+		{
+			lval_del(p->a);
+			return res;
+		}
+		return p->operandFirst
+			? recursion_call(env, p->func, p->a, res)
+			: recursion_call(env, p->func, res, p->a);
+
+	case REC_PENDING_AFFINE:
+		if (IS_NUM(res))
+		{
+			lval_del(p->last);
+			return recursion_apply(env, builtin_add, p->a,
+								   recursion_apply(env, builtin_mul, p->b, res));
+		}
+		lval_del(p->a);
+		lval_del(p->b);
+		if (IS_ERR(res))
+		{
+			lval_del(p->last);
+			return res;
+		}
+		return recursion_call(env, p->func, p->last, res);
+
+	case REC_PENDING_CONCAT:
+		if (IS_ERR(res))
+		{
+			lval_del(p->a);
+			return res;
+		}
+		if (p->cons && !IS_LIST(res))
+		{
+			lval_del(p->a);
+			return recursion_apply(env, builtin_cons, lval_list(), res);
+		}
+		return recursion_call(env, p->func, p->a, res);
+	}
+
+	assert(false && "Unreachable");
+	return res;
+}
+
+lval* recursion_run(lenv* env, rec_loop* loop)
+{
+	rec_stack stack = { NULL, 0, 0 };
+	lval* res = NULL;
+
+	while (res == NULL)
+	{
+		rec_node* node = loop->root;
+
+		// The same as builtin 'cond'
+		while (res == NULL && node->kind == REC_COND)
+		{
+			rec_node* chosen = NULL;
+
+			for (unsigned i = 0; i < node->count && chosen == NULL && res == NULL; i++)
+			{
+				lval* test = eval_lval(env, lval_copy(node->tests[i]));
+				if (IS_ERR(test)) res = test;
+				else if (!IS_BOOL(test))
+				{
+					lval_del(test);
+					res = lval_err("function 'cond' test result for argument %i is not a Boolean", i);
+				}
+				else
+				{
+					if (test->boolean) chosen = node->children[i];
+					lval_del(test);
+				}
+			}
+
+			if (res == NULL && chosen == NULL) res = lval_list();
+			node = chosen;
+		}
+
+		if (res != NULL) break;
+
+		if (node->kind == REC_BASE)
+		{
+			res = eval_lval(env, lval_copy(node->expr));
+			break;
+		}
+
+		for (unsigned i = 0; i < node->count; i++)
+			recursion_pending(env, &stack, &node->steps[i],
+							  eval_lval(env, lval_copy(node->steps[i].operand)));
+
+		lval* args = lval_list();
+		for (unsigned i = 0; i < node->args->count; i++)
+		{
+			lval* arg = eval_lval(env, lval_copy(node->args->cells[i]));
+			list_add(args, arg);
+			if (res == NULL && IS_ERR(arg)) res = lval_copy(arg);
+		}
+
+		if (res == NULL)
+			for (unsigned i = 0; i < args->count; i++)
+				lenv_bind(env, loop->formals->cells[i], args->cells[i]);
+
+		lval_del(args);
+	}
+
+	while (stack.count != 0)
+		res = recursion_combine(env, &stack.items[--stack.count], res);
+
+	free(stack.items);
+	return res;
+}
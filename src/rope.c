@@ -0,0 +1,259 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <rope.h>
+
+rope_text* rope_text_new(char* chars, size_t length)
+{
+	rope_text* text = malloc(sizeof(rope_text));
+	DIE_IF_NULL(text);
+	text->refs = 1;
+	text->length = length;
+	text->chars = chars;
+	return text;
+}
+
+void rope_text_release(rope_text* text)
+{
+	if (--text->refs != 0) return;
+	free(text->chars);
+	free(text);
+}
+
+lrope* rope_alloc(size_t length)
+{
+	lrope* rope = malloc(sizeof(lrope));
+	DIE_IF_NULL(rope);
+	rope->refs = 1;
+	rope->depth = 0;
+	rope->length = length;
+	rope->text = NULL;
+	rope->offset = 0;
+	rope->left = NULL;
+	rope->right = NULL;
+	return rope;
+}
+
+lrope* rope_leaf(rope_text* text, size_t offset, size_t length)
+{
+	lrope* rope = rope_alloc(length);
+	text->refs++;
+	rope->text = text;
+	rope->offset = offset;
+	return rope;
+}
+
+// Takes ownership of both children
+lrope* rope_node(lrope* left, lrope* right)
+{
+	lrope* rope = rope_alloc(left->length + right->length);
+	rope->depth = 1 + (left->depth > right->depth ? left->depth : right->depth);
+	rope->left = left;
+	rope->right = right;
+	return rope;
+}
+
+lrope* rope_new(char* chars, size_t length)
+{
+	lrope* rope = rope_alloc(length);
+	rope->text = rope_text_new(chars, length);
+	return rope;
+}
+
+lrope* rope_new_copy(const char* chars, size_t length)
+{
+	char* copy = malloc(length + 1);
+	DIE_IF_NULL(copy);
+	memcpy(copy, chars, length);
+	copy[length] = '\0';
+	return rope_new(copy, length);
+}
+
+lrope* rope_retain(lrope* rope)
+{
+	rope->refs++;
+	return rope;
+}
+
+void rope_release(lrope* rope)
+{
+	if (--rope->refs != 0) return;
+
+	if (rope->text != NULL) rope_text_release(rope->text);
+	if (rope->left != NULL) rope_release(rope->left);
+	if (rope->right != NULL) rope_release(rope->right);
+	free(rope);
+}
+
+// Node of 'left' and 'right', rotated if their depths differ by 2, like in
+// AVL trees. Takes ownership of both
+lrope* rope_balance(lrope* left, lrope* right)
+{
+	if (right->depth > left->depth + 1)
+	{
+		lrope* rl = rope_retain(right->left);
+		lrope* rr = rope_retain(right->right);
+		rope_release(right);
+
+		if (rl->depth <= rr->depth) return rope_node(rope_node(left, rl), rr);
+
+		lrope* rll = rope_retain(rl->left);
+		lrope* rlr = rope_retain(rl->right);
+		rope_release(rl);
+		return rope_node(rope_node(left, rll), rope_node(rlr, rr));
+	}
+
+	if (left->depth > right->depth + 1)
+	{
+		lrope* ll = rope_retain(left->left);
+		lrope* lr = rope_retain(left->right);
+		rope_release(left);
+
+		if (lr->depth <= ll->depth) return rope_node(ll, rope_node(lr, right));
+
+		lrope* lrl = rope_retain(lr->left);
+		lrope* lrr = rope_retain(lr->right);
+		rope_release(lr);
+		return rope_node(rope_node(ll, lrl), rope_node(lrr, right));
+	}
+
+	return rope_node(left, right);
+}
+
+// Joins the lower tree into the side of the deeper one, so only the path
+// to the place of joining is copied
+lrope* rope_join(lrope* a, lrope* b)
+{
+	if (a->depth > b->depth + 1)
+	{
+		lrope* left = rope_retain(a->left);
+		lrope* right = rope_join(rope_retain(a->right), b);
+		rope_release(a);
+		return rope_balance(left, right);
+	}
+
+	if (b->depth > a->depth + 1)
+	{
+		lrope* left = rope_join(a, rope_retain(b->left));
+		lrope* right = rope_retain(b->right);
+		rope_release(b);
+		return rope_balance(left, right);
+	}
+
+	return rope_node(a, b);
+}
+
+lrope* rope_concat(lrope* a, lrope* b)
+{
+	if (b->length == 0)
+	{
+		rope_release(b);
+		return a;
+	}
+
+	if (a->length == 0)
+	{
+		rope_release(a);
+		return b;
+	}
+
+	if (a->length + b->length <= ROPE_LEAF_LENGTH)
+	{
+		char* chars = malloc(a->length + b->length + 1);
+		DIE_IF_NULL(chars);
+		rope_write(a, chars);
+		rope_write(b, chars + a->length);
+		chars[a->length + b->length] = '\0';
+
+		lrope* rope = rope_new(chars, a->length + b->length);
+		rope_release(a);
+		rope_release(b);
+		return rope;
+	}
+
+	// Short pieces appended one by one are merged into the last leaf
+	if (b->length < ROPE_LEAF_LENGTH && a->depth != 0)
+	{
+		lrope* left = rope_retain(a->left);
+		lrope* right = rope_concat(rope_retain(a->right), b);
+		rope_release(a);
+		return rope_join(left, right);
+	}
+
+	return rope_join(a, b);
+}
+
+lrope* rope_substring(lrope* rope, size_t start, size_t end)
+{
+	assert(start <= end && end <= rope->length);
+
+	if (start == 0 && end == rope->length) return rope_retain(rope);
+	if (rope->depth == 0) return rope_leaf(rope->text, rope->offset + start, end - start);
+
+	size_t middle = rope->left->length;
+	if (end <= middle) return rope_substring(rope->left, start, end);
+	if (start >= middle) return rope_substring(rope->right, start - middle, end - middle);
+
+	return rope_join(rope_substring(rope->left, start, middle),
+					 rope_substring(rope->right, 0, end - middle));
+}
+
+void rope_write(lrope* rope, char* out)
+{
+	// Only the left subtrees are written recursively, so the depth of the
+	// C stack is at most the depth of the rope
+	while (rope->depth != 0)
+	{
+		rope_write(rope->left, out);
+		out += rope->left->length;
+		rope = rope->right;
+	}
+
+	memcpy(out, rope->text->chars + rope->offset, rope->length);
+}
+
+char* rope_flatten(lrope* rope)
+{
+	if (rope->depth == 0 && rope->offset + rope->length == rope->text->length)
+		return rope->text->chars + rope->offset;
+
+	char* chars = malloc(rope->length + 1);
+	DIE_IF_NULL(chars);
+	rope_write(rope, chars);
+	chars[rope->length] = '\0';
+
+	// The content stays the same, so copies sharing the node see a leaf
+	if (rope->text != NULL) rope_text_release(rope->text);
+	if (rope->left != NULL) rope_release(rope->left);
+	if (rope->right != NULL) rope_release(rope->right);
+
+	rope->depth = 0;
+	rope->left = NULL;
+	rope->right = NULL;
+	rope->text = rope_text_new(chars, rope->length);
+	rope->offset = 0;
+	return chars;
+}
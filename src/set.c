@@ -0,0 +1,220 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <set.h>
+
+#define SET_WORDS (SET_BITMAP_SIZE / 64)
+
+lset* set_alloc(hamt_node* elements)
+{
+	lset* set = malloc(sizeof(lset));
+	DIE_IF_NULL(set);
+	set->refs = 1;
+	set->elements = elements;
+	return set;
+}
+
+// Returns NULL, if 'x' is not marked in bitmaps
+uint64_t* set_bitmap(lset* set, lval* x, unsigned* bit)
+{
+	if (IS_NUM(x) && x->big == NULL && x->num >= 0 && x->num < SET_BITMAP_SIZE)
+	{
+		*bit = x->num;
+		return set->nums;
+	}
+
+	// Ropes are long, so they are never in the bitmap
+	if (IS_STR(x) && x->rope == NULL && x->str[0] != '\0' && x->str[1] == '\0')
+	{
+		*bit = (unsigned char) x->str[0];
+		return set->chars;
+	}
+
+	if (IS_CHAR(x) && x->ch != '\0')
+	{
+		*bit = (unsigned char) x->ch;
+		return set->chars;
+	}
+
+	return NULL;
+}
+
+void set_mark(void* data, lval* key, lval* value)
+{
+	unsigned bit;
+	uint64_t* bitmap = set_bitmap(data, key, &bit);
+	if (bitmap != NULL) bitmap[bit / 64] |= 1UL << (bit % 64);
+}
+
+lset* set_new(hamt_node* elements)
+{
+	lset* set = set_alloc(elements);
+	memset(set->nums, 0, sizeof(set->nums));
+	memset(set->chars, 0, sizeof(set->chars));
+	hamt_each(elements, set_mark, set);
+	return set;
+}
+
+lset* set_retain(lset* set)
+{
+	set->refs++;
+	return set;
+}
+
+void set_release(lset* set)
+{
+	if (--set->refs != 0) return;
+
+	hamt_release(set->elements);
+	free(set);
+}
+
+unsigned set_count(lset* set)
+{
+	return hamt_count(set->elements);
+}
+
+bool set_contains(lset* set, lval* x)
+{
+	unsigned bit;
+	uint64_t* bitmap = set_bitmap(set, x, &bit);
+	if (bitmap != NULL) return (bitmap[bit / 64] >> (bit % 64)) & 1;
+
+	return hamt_contains(set->elements, x);
+}
+
+typedef struct set_builder
+{
+	hamt_node* elements;
+	lset* other;
+} set_builder;
+
+void set_builder_put(set_builder* b, lval* key)
+{
+	hamt_node* next = hamt_put(b->elements, lval_copy(key), NULL);
+	hamt_release(b->elements);
+	b->elements = next;
+}
+
+void set_add_new(void* data, lval* key, lval* value)
+{
+	set_builder* b = data;
+	if (!hamt_contains(b->elements, key)) set_builder_put(b, key);
+}
+
+void set_add_common(void* data, lval* key, lval* value)
+{
+	set_builder* b = data;
+	if (set_contains(b->other, key)) set_builder_put(b, key);
+}
+
+void set_add_missing(void* data, lval* key, lval* value)
+{
+	set_builder* b = data;
+	if (!set_contains(b->other, key)) set_builder_put(b, key);
+}
+
+void set_remove(void* data, lval* key, lval* value)
+{
+	set_builder* b = data;
+	hamt_node* next = hamt_del(b->elements, key);
+	hamt_release(b->elements);
+	b->elements = next;
+}
+
+// Elements of the smaller set are added to the larger one
+lset* set_union(lset* a, lset* b)
+{
+	lset* larger = set_count(a) >= set_count(b) ? a : b;
+	lset* smaller = larger == a ? b : a;
+
+	set_builder builder = { hamt_retain(larger->elements), NULL };
+	hamt_each(smaller->elements, set_add_new, &builder);
+
+	lset* res = set_alloc(builder.elements);
+	for (unsigned i = 0; i < SET_WORDS; i++)
+	{
+		res->nums[i] = a->nums[i] | b->nums[i];
+		res->chars[i] = a->chars[i] | b->chars[i];
+	}
+	return res;
+}
+
+lset* set_intersection(lset* a, lset* b)
+{
+	lset* larger = set_count(a) >= set_count(b) ? a : b;
+	lset* smaller = larger == a ? b : a;
+
+	set_builder builder = { NULL, larger };
+	hamt_each(smaller->elements, set_add_common, &builder);
+
+	lset* res = set_alloc(builder.elements);
+	for (unsigned i = 0; i < SET_WORDS; i++)
+	{
+		res->nums[i] = a->nums[i] & b->nums[i];
+		res->chars[i] = a->chars[i] & b->chars[i];
+	}
+	return res;
+}
+
+lset* set_difference(lset* a, lset* b)
+{
+	set_builder builder;
+
+	if (set_count(b) < set_count(a))
+	{
+		builder.elements = hamt_retain(a->elements);
+		hamt_each(b->elements, set_remove, &builder);
+	}
+	else
+	{
+		builder.elements = NULL;
+		builder.other = b;
+		hamt_each(a->elements, set_add_missing, &builder);
+	}
+
+	lset* res = set_alloc(builder.elements);
+	for (unsigned i = 0; i < SET_WORDS; i++)
+	{
+		res->nums[i] = a->nums[i] & ~b->nums[i];
+		res->chars[i] = a->chars[i] & ~b->chars[i];
+	}
+	return res;
+}
+
+bool set_eq(lset* a, lset* b)
+{
+	if (a == b) return true;
+
+	if (memcmp(a->nums, b->nums, sizeof(a->nums)) != 0) return false;
+	if (memcmp(a->chars, b->chars, sizeof(a->chars)) != 0) return false;
+
+	return hamt_eq(a->elements, b->elements);
+}
+
+unsigned long set_hash(lset* set)
+{
+	return hamt_hash(set->elements);
+}
@@ -0,0 +1,348 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <sort.h>
+
+#include <eval.h>
+
+#ifdef LISPY_THREADS_SUPPORTED
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Ranges shorter than this are sorted by insertion
+#define SORT_RUN_LENGTH 16
+
+typedef struct sort_item
+{
+	union
+	{
+		long num;
+		const char* str;
+	};
+	lval* value;
+} sort_item;
+
+typedef struct sort_context sort_context;
+typedef bool (*sort_less_func)(sort_context* ctx, const sort_item* a, const sort_item* b);
+
+// After the first error comparisons return false without calling anything,
+// so sorting finishes quickly
+struct sort_context
+{
+	sort_less_func less;
+	lenv* env;
+	lval* func;
+	lval* error;
+	const char* name;
+};
+
+bool sort_less_fixnums(sort_context* ctx, const sort_item* a, const sort_item* b)
+{
+	return a->num < b->num;
+}
+
+bool sort_less_strings(sort_context* ctx, const sort_item* a, const sort_item* b)
+{
+	return strcmp(a->str, b->str) < 0;
+}
+
+bool sort_less_values(sort_context* ctx, const sort_item* a, const sort_item* b)
+{
+	if (ctx->error != NULL) return false;
+
+	lval* x = a->value;
+	lval* y = b->value;
+
+	if (IS_NUM(x) && IS_NUM(y)) return lval_num_cmp(x, y) < 0;
+	if (IS_CHAR(x) && IS_CHAR(y)) return (unsigned char) x->ch < (unsigned char) y->ch;
+	if ((IS_STR(x) || IS_CHAR(x)) && (IS_STR(y) || IS_CHAR(y)))
+	{
+		char bufX[2], bufY[2];
+		return strcmp(lval_text(x, bufX), lval_text(y, bufY)) < 0;
+	}
+
+	ctx->error = lval_err("function '%s' can't compare %s with %s without comparator",
+						  ctx->name, lval_type_str(x->type), lval_type_str(y->type));
+	return false;
+}
+
+bool sort_less_func_call(sort_context* ctx, const sort_item* a, const sort_item* b)
+{
+	if (ctx->error != NULL) return false;
+
+	lval* args[2] = { a->value, b->value };
+	lval* res = eval_call_argv(ctx->env, ctx->func, 2, args);
+
+	if (IS_BOOL(res))
+	{
+		bool less = res->boolean;
+		lval_del(res);
+		return less;
+	}
+
+	if (!IS_ERR(res))
+	{
+		lval_del(res);
+		res = lval_err("function '%s' comparator result is not a Boolean", ctx->name);
+	}
+
+	ctx->error = res;
+	return false;
+}
+
+void sort_insertion(sort_context* ctx, sort_item* items, unsigned lo, unsigned hi)
+{
+	for (unsigned i = lo + 1; i < hi; i++)
+	{
+		sort_item x = items[i];
+		unsigned j = i;
+
+		while (j > lo && ctx->less(ctx, &x, &items[j - 1]))
+		{
+			items[j] = items[j - 1];
+			j--;
+		}
+
+		items[j] = x;
+	}
+}
+
+// Only the left half is moved to 'tmp', the merged range never overtakes the
+// right half. Equal items are taken from the left half, so the sort is stable
+void sort_merge(sort_context* ctx, sort_item* items, sort_item* tmp,
+				unsigned lo, unsigned mid, unsigned hi)
+{
+	// Halves are already in order
+	if (!ctx->less(ctx, &items[mid], &items[mid - 1])) return;
+
+	memcpy(&tmp[lo], &items[lo], sizeof(sort_item) * (mid - lo));
+
+	unsigned i = lo, j = mid, k = lo;
+	while (i < mid && j < hi)
+		items[k++] = ctx->less(ctx, &items[j], &tmp[i]) ? items[j++] : tmp[i++];
+
+	while (i < mid)
+		items[k++] = tmp[i++];
+}
+
+void sort_range(sort_context* ctx, sort_item* items, sort_item* tmp, unsigned lo, unsigned hi)
+{
+	if (hi - lo <= SORT_RUN_LENGTH)
+	{
+		sort_insertion(ctx, items, lo, hi);
+		return;
+	}
+
+	unsigned mid = lo + (hi - lo) / 2;
+	sort_range(ctx, items, tmp, lo, mid);
+	sort_range(ctx, items, tmp, mid, hi);
+	sort_merge(ctx, items, tmp, lo, mid, hi);
+}
+
+#ifdef LISPY_THREADS_SUPPORTED
+
+typedef struct sort_task
+{
+	sort_context* ctx;
+	sort_item* items;
+	sort_item* tmp;
+	unsigned lo;
+	unsigned hi;
+	unsigned depth;
+} sort_task;
+
+// Halves are sorted by a new thread and the current one, until 'depth' runs
+// out. Merges of different subranges run in parallel too
+void* sort_task_run(void* arg)
+{
+	sort_task* task = arg;
+	unsigned lo = task->lo, hi = task->hi;
+
+	if (task->depth == 0 || hi - lo < SORT_PARALLEL_THRESHOLD / 2)
+	{
+		sort_range(task->ctx, task->items, task->tmp, lo, hi);
+		return NULL;
+	}
+
+	unsigned mid = lo + (hi - lo) / 2;
+	sort_task left = { task->ctx, task->items, task->tmp, lo, mid, task->depth - 1 };
+	sort_task right = { task->ctx, task->items, task->tmp, mid, hi, task->depth - 1 };
+
+	pthread_t thread;
+	bool spawned = pthread_create(&thread, NULL, sort_task_run, &left) == 0;
+	if (!spawned) sort_task_run(&left);
+
+	sort_task_run(&right);
+	if (spawned) pthread_join(thread, NULL);
+
+	sort_merge(task->ctx, task->items, task->tmp, lo, mid, hi);
+	return NULL;
+}
+
+void sort_parallel(sort_context* ctx, sort_item* items, sort_item* tmp, unsigned count)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	unsigned depth = 0;
+	while (depth < 6 && (1L << (depth + 1)) <= cpus)
+		depth++;
+
+	sort_task task = { ctx, items, tmp, 0, count, depth };
+	sort_task_run(&task);
+}
+
+#else
+
+void sort_parallel(sort_context* ctx, sort_item* items, sort_item* tmp, unsigned count)
+{
+	sort_range(ctx, items, tmp, 0, count);
+}
+
+#endif
+
+lval* sort_cells(lenv* env, lval** cells, unsigned count, lval* less, const char* name)
+{
+	if (count < 2) return NULL;
+
+	sort_context ctx = { sort_less_values, env, less, NULL, name };
+
+	bool fixnums = true, strings = true;
+	for (unsigned i = 0; i < count; i++)
+	{
+		fixnums = fixnums && IS_NUM(cells[i]) && cells[i]->big == NULL;
+		strings = strings && IS_STR(cells[i]);
+	}
+
+	if (less != NULL) ctx.less = sort_less_func_call;
+	else if (fixnums) ctx.less = sort_less_fixnums;
+	else if (strings) ctx.less = sort_less_strings;
+
+	sort_item* items = malloc(sizeof(sort_item) * count * 2);
+	DIE_IF_NULL(items);
+	sort_item* tmp = items + count;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		items[i].value = cells[i];
+		if (ctx.less == sort_less_fixnums) items[i].num = cells[i]->num;
+		if (ctx.less == sort_less_strings) items[i].str = lval_str_flat(cells[i]);
+	}
+
+	// Comparisons of unboxed keys don't touch the interpreter
+	bool unboxed = ctx.less == sort_less_fixnums || ctx.less == sort_less_strings;
+	if (unboxed && count >= SORT_PARALLEL_THRESHOLD) sort_parallel(&ctx, items, tmp, count);
+	else sort_range(&ctx, items, tmp, 0, count);
+
+	for (unsigned i = 0; i < count; i++)
+		cells[i] = items[i].value;
+
+	free(items);
+	return ctx.error;
+}
+
+void sort_nums(long* nums, unsigned count)
+{
+	sort_context ctx = { sort_less_fixnums, NULL, NULL, NULL, NULL };
+
+	sort_item* items = malloc(sizeof(sort_item) * count * 2);
+	DIE_IF_NULL(items);
+	sort_item* tmp = items + count;
+
+	for (unsigned i = 0; i < count; i++)
+		items[i].num = nums[i];
+
+	if (count >= SORT_PARALLEL_THRESHOLD) sort_parallel(&ctx, items, tmp, count);
+	else sort_range(&ctx, items, tmp, 0, count);
+
+	for (unsigned i = 0; i < count; i++)
+		nums[i] = items[i].num;
+
+	free(items);
+}
+
+// Equal bytes can't be told apart, so counting is enough
+void sort_bytes(unsigned char* bytes, unsigned count)
+{
+	unsigned counts[UCHAR_MAX + 1] = { 0 };
+
+	for (unsigned i = 0; i < count; i++)
+		counts[bytes[i]]++;
+
+	for (unsigned b = 0, i = 0; b <= UCHAR_MAX; b++)
+		for (unsigned j = 0; j < counts[b]; j++)
+			bytes[i++] = b;
+}
+
+lval* sort_list(lenv* env, lval* lst, lval* less, const char* name)
+{
+	if (less != NULL) list_generalize(lst);
+	if (lst->count < 2) return NULL;
+	lst->hash = 0;
+
+	switch (lst->strategy)
+	{
+	case LIST_NUMS:
+		sort_nums(lst->nums, lst->count);
+		return NULL;
+	case LIST_BYTES:
+		sort_bytes(lst->bytes, lst->count);
+		return NULL;
+	default:
+		return sort_cells(env, lst->cells, lst->count, less, name);
+	}
+}
+
+lval* sort_less(lenv* env, lval* a, lval* b, lval* less, const char* name, bool* res)
+{
+	sort_context ctx = { less != NULL ? sort_less_func_call : sort_less_values, env, less, NULL, name };
+	sort_item x = { .value = a };
+	sort_item y = { .value = b };
+
+	*res = ctx.less(&ctx, &x, &y);
+	return ctx.error;
+}
+
+lval* sort_bound(lenv* env, lval* lst, lval* x, lval* less,
+				 bool upper, const char* name, unsigned* index)
+{
+	sort_context ctx = { less != NULL ? sort_less_func_call : sort_less_values, env, less, NULL, name };
+	sort_item key = { .value = x };
+	unsigned lo = 0, hi = lst->count;
+
+	while (lo < hi && ctx.error == NULL)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		lval view;
+		sort_item item = { .value = list_peek(lst, mid, &view) };
+
+		bool right = upper ? !ctx.less(&ctx, &key, &item) : ctx.less(&ctx, &item, &key);
+		if (right) lo = mid + 1;
+		else hi = mid;
+	}
+
+	*index = lo;
+	return ctx.error;
+}
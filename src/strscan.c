@@ -0,0 +1,136 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2022 Ruslan Popov <ruslanpopov1512@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <strscan.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define STRSCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef const char* (*strscan_func)(const char* hay, size_t length,
+									const char* needle, size_t needleLength);
+
+// 'needleLength' is at least 2 in all variants
+const char* strscan_scalar(const char* hay, size_t length, const char* needle, size_t needleLength)
+{
+	const char* end = hay + length - needleLength + 1;
+
+	while (hay < end)
+	{
+		hay = memchr(hay, needle[0], end - hay);
+		if (hay == NULL) return NULL;
+		if (memcmp(hay + 1, needle + 1, needleLength - 1) == 0) return hay;
+		hay++;
+	}
+
+	return NULL;
+}
+
+#ifdef STRSCAN_X86
+
+// Bit i of 'mask' is set, if the first and the last byte of the needle match
+// at 'hay + i'
+const char* strscan_candidates(const char* hay, unsigned mask, const char* needle, size_t needleLength)
+{
+	while (mask != 0)
+	{
+		unsigned i = __builtin_ctz(mask);
+		if (memcmp(hay + i + 1, needle + 1, needleLength - 2) == 0) return hay + i;
+		mask &= mask - 1;
+	}
+
+	return NULL;
+}
+
+const char* strscan_sse2(const char* hay, size_t length, const char* needle, size_t needleLength)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+	size_t i = 0;
+
+	for (; i + needleLength - 1 + 16 <= length; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*) (hay + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (hay + i + needleLength - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+														_mm_cmpeq_epi8(b, last)));
+
+		const char* found = strscan_candidates(hay + i, mask, needle, needleLength);
+		if (found != NULL) return found;
+	}
+
+	return i + needleLength <= length
+		? strscan_scalar(hay + i, length - i, needle, needleLength)
+		: NULL;
+}
+
+__attribute__((target("avx2")))
+const char* strscan_avx2(const char* hay, size_t length, const char* needle, size_t needleLength)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+	size_t i = 0;
+
+	for (; i + needleLength - 1 + 32 <= length; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*) (hay + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (hay + i + needleLength - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+															  _mm256_cmpeq_epi8(b, last)));
+
+		const char* found = strscan_candidates(hay + i, mask, needle, needleLength);
+		if (found != NULL) return found;
+	}
+
+	return i + needleLength <= length
+		? strscan_sse2(hay + i, length - i, needle, needleLength)
+		: NULL;
+}
+
+#endif
+
+strscan_func strscan_select()
+{
+#ifdef STRSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return strscan_avx2;
+	return strscan_sse2;
+#else
+	return strscan_scalar;
+#endif
+}
+
+const char* strscan_find(const char* hay, size_t length, const char* needle, size_t needleLength)
+{
+	static strscan_func impl = NULL;
+
+	if (needleLength == 0) return hay;
+	if (needleLength > length) return NULL;
+	if (needleLength == 1) return memchr(hay, needle[0], length);
+
+	if (impl == NULL) impl = strscan_select();
+	return impl(hay, length, needle, needleLength);
+}
@@ -25,6 +25,12 @@
 #include <value.h>
 
 #include <environment.h>
+#include <jit.h>
+#include <optimizer.h>
+#include <hamt.h>
+#include <set.h>
+#include <record.h>
+#include <rope.h>
 
 const char* lval_type_str(lval_type type)
 {
@@ -40,6 +46,11 @@ const char* lval_type_str(lval_type type)
 	case LVAL_BOOL:    return "Boolean";
 	case LVAL_QUOTE:   return "Quoted type";
 	case LVAL_MACRO:   return "Macros";
+	case LVAL_MAP:     return "Map";
+	case LVAL_SET:     return "Set";
+	case LVAL_RECORD:  return "Record";
+	case LVAL_CHAR:    return "Character";
+	case LVAL_BUILDER: return "String builder";
 	}
 
 	assert(false);
@@ -50,6 +61,7 @@ lval* alloc_lval(lval_type type)
 	lval* v = malloc(sizeof(lval));
 	DIE_IF_NULL(v);
 	v->type = type;
+	v->hash = 0;
 	return v;
 }
 
@@ -57,6 +69,21 @@ lval* lval_num(long x)
 {
 	lval* v = alloc_lval(LVAL_NUM);
 	v->num = x;
+	v->big = NULL;
+	return v;
+}
+
+lval* lval_num_big(lbig* x)
+{
+	long fixnum;
+	if (bignum_to_long(x, &fixnum))
+	{
+		bignum_free(x);
+		return lval_num(fixnum);
+	}
+
+	lval* v = lval_num(0);
+	v->big = x;
 	return v;
 }
 
@@ -105,6 +132,7 @@ lval* lval_str(const char* str)
 	v->str = malloc(strlen(str) + 1);
 	DIE_IF_NULL(v->str);
 	strcpy(v->str, str);
+	v->rope = NULL;
 	return v;
 
 }
@@ -116,6 +144,23 @@ lval* lval_str_char(const char ch)
 	DIE_IF_NULL(v->str);
 	v->str[0] = ch;
 	v->str[1] = '\0';
+	v->rope = NULL;
+	return v;
+}
+
+lval* lval_char(char ch)
+{
+	lval* v = alloc_lval(LVAL_CHAR);
+	v->ch = ch;
+	return v;
+}
+
+lval* lval_builder()
+{
+	lval* v = alloc_lval(LVAL_BUILDER);
+	v->sbText = NULL;
+	v->sbLength = 0;
+	v->sbCapacity = 0;
 	return v;
 }
 
@@ -123,6 +168,34 @@ lval* lval_str_null()
 {
 	lval* v = alloc_lval(LVAL_STR);
 	v->str = NULL;
+	v->rope = NULL;
+	return v;
+}
+
+lval* lval_str_n(const char* str, size_t length)
+{
+	lval* v = lval_str_null();
+	v->str = malloc(length + 1);
+	DIE_IF_NULL(v->str);
+	memcpy(v->str, str, length);
+	v->str[length] = '\0';
+	return v;
+}
+
+lval* lval_str_rope(lrope* rope)
+{
+	lval* v = lval_str_null();
+
+	if (rope->length < ROPE_MIN_LENGTH)
+	{
+		v->str = malloc(rope->length + 1);
+		DIE_IF_NULL(v->str);
+		rope_write(rope, v->str);
+		v->str[rope->length] = '\0';
+		rope_release(rope);
+	}
+	else v->rope = rope;
+
 	return v;
 }
 
@@ -130,7 +203,9 @@ lval* lval_list()
 {
 	lval* v = alloc_lval(LVAL_LIST);
 	v->count = 0;
+	v->capacity = 0;
 	v->cells = NULL;
+	v->strategy = LIST_CELLS;
 	return v;
 }
 
@@ -140,9 +215,44 @@ lval* lval_lambda(lenv* env, lval* formals, lval* body)
 	v->env = env;
 	v->formals = formals;
 	v->body = body;
+	v->info = lambda_info_new();
 	return v;
 }
 
+lambda_info* lambda_info_new()
+{
+	lambda_info* info = malloc(sizeof(lambda_info));
+	DIE_IF_NULL(info);
+	info->refs = 1;
+	info->calls = 0;
+	info->jit = NULL;
+	info->jitFailed = false;
+	info->optCalls = 0;
+	info->optRetries = 0;
+	info->optimized = NULL;
+	info->constants = NULL;
+	info->specializations = NULL;
+	info->aot = NULL;
+	return info;
+}
+
+lambda_info* lambda_info_retain(lambda_info* info)
+{
+	info->refs++;
+	return info;
+}
+
+void lambda_info_release(lambda_info* info)
+{
+	if (--info->refs != 0) return;
+
+	if (info->jit != NULL) jit_free(info->jit);
+	if (info->optimized != NULL) optimizer_free(info->optimized);
+	if (info->constants != NULL) lval_del(info->constants);
+	optimizer_free_specializations(info->specializations);
+	free(info);
+}
+
 lval* lval_macro(lval* formals, lval* body)
 {
 	lval* v = alloc_lval(LVAL_MACRO);
@@ -155,6 +265,39 @@ lval* lval_builtin(lbuiltin_func func)
 {
 	lval* v = alloc_lval(LVAL_BUILTIN);
 	v->builtin = func;
+	v->argvBuiltin = NULL;
+	return v;
+}
+
+lval* lval_builtin_argv(lbuiltin_func func, lbuiltin_argv_func argvFunc)
+{
+	lval* v = lval_builtin(func);
+	v->argvBuiltin = argvFunc;
+	return v;
+}
+
+lval* lval_map(hamt_node* map)
+{
+	lval* v = alloc_lval(LVAL_MAP);
+	v->map = map;
+	return v;
+}
+
+lval* lval_set(lset* set)
+{
+	lval* v = alloc_lval(LVAL_SET);
+	v->set = set;
+	return v;
+}
+
+lval* lval_record(unsigned recordType)
+{
+	unsigned count = record_type_get(recordType)->count;
+
+	lval* v = alloc_lval(LVAL_RECORD);
+	v->recordType = recordType;
+	v->slots = calloc(count, sizeof(lval*));
+	if (count != 0) DIE_IF_NULL(v->slots);
 	return v;
 }
 
@@ -165,30 +308,147 @@ lval* lval_quote(lval* x)
 	return v;
 }
 
-lval* lval_copy(lval* a)
+// Copying, deleting, comparing, printing and hashing walk nested values with
+// an explicit stack, so deeply nested lists don't exhaust the C stack. Frames
+// of shallow values fit into the stack structure itself, grown arrays of
+// frames up to WALK_SPARE_FRAMES are kept for the next walk
+#define WALK_LOCAL_FRAMES 32
+#define WALK_SPARE_FRAMES 65536
+
+typedef struct walk_frame
+{
+	lval* a;
+	lval* b;
+	unsigned i;
+	unsigned long hash;
+} walk_frame;
+
+typedef struct walk_stack
+{
+	walk_frame* frames;
+	unsigned count;
+	unsigned capacity;
+	walk_frame local[WALK_LOCAL_FRAMES];
+} walk_stack;
+
+static walk_frame* walkSpare = NULL;
+static unsigned walkSpareCapacity = 0;
+
+void walk_init(walk_stack* stack)
+{
+	stack->count = 0;
+	if (walkSpare != NULL)
+	{
+		stack->frames = walkSpare;
+		stack->capacity = walkSpareCapacity;
+		walkSpare = NULL;
+	}
+	else
+	{
+		stack->frames = stack->local;
+		stack->capacity = WALK_LOCAL_FRAMES;
+	}
+}
+
+// Returned frame is valid until the next push
+walk_frame* walk_push(walk_stack* stack, lval* a, lval* b)
+{
+	if (stack->count == stack->capacity)
+	{
+		stack->capacity *= 2;
+		if (stack->frames == stack->local)
+		{
+			stack->frames = malloc(stack->capacity * sizeof(walk_frame));
+			DIE_IF_NULL(stack->frames);
+			memcpy(stack->frames, stack->local, sizeof(stack->local));
+		}
+		else
+		{
+			stack->frames = realloc(stack->frames, stack->capacity * sizeof(walk_frame));
+			DIE_IF_NULL(stack->frames);
+		}
+	}
+
+	walk_frame* frame = &stack->frames[stack->count++];
+	frame->a = a;
+	frame->b = b;
+	frame->i = 0;
+	return frame;
+}
+
+void walk_free(walk_stack* stack)
+{
+	if (stack->frames == stack->local) return;
+
+	// Walks may be nested, the biggest array is kept
+	if (stack->capacity <= WALK_SPARE_FRAMES && (walkSpare == NULL || walkSpareCapacity < stack->capacity))
+	{
+		free(walkSpare);
+		walkSpare = stack->frames;
+		walkSpareCapacity = stack->capacity;
+	}
+	else free(stack->frames);
+}
+
+// Lists of cells, Records and Quotes own values, that are walked by the
+// loops. Lambdas and Macros handle their formals and bodies by calls, code
+// is not nested deeply
+#define WALK_HAS_PARTS(v) (IS_QUOTE(v) || IS_RECORD(v) \
+	|| (IS_LIST(v) && (v)->strategy == LIST_CELLS && (v)->count != 0))
+
+lval** lval_parts(lval* v, unsigned* count)
+{
+	switch (v->type)
+	{
+	case LVAL_LIST:
+		*count = v->count;
+		return v->cells;
+	case LVAL_RECORD:
+		*count = record_type_get(v->recordType)->count;
+		return v->slots;
+	default:
+		assert(IS_QUOTE(v));
+		*count = 1;
+		return &v->quoted;
+	}
+}
+
+// Copy of 'a', whose parts are left to fill
+lval* lval_copy_shallow(lval* a)
 {
 	lval* v = NULL;
 	switch (a->type)
 	{
 	case LVAL_BUILTIN:
-		v = lval_builtin(a->builtin);
+		v = lval_builtin_argv(a->builtin, a->argvBuiltin);
 		break;
 	case LVAL_ERR:
 		v = lval_err(a->err);
 		break;
 	case LVAL_STR:
-		v = lval_str(a->str);
+		if (a->rope == NULL) v = lval_str(a->str);
+		else
+		{
+			v = lval_str_rope(rope_retain(a->rope));
+			v->str = a->str;
+		}
+		v->hash = a->hash;
 		break;
 	case LVAL_BOOL:
 		v = lval_bool(a->boolean);
 		break;
+	case LVAL_CHAR:
+		v = lval_char(a->ch);
+		break;
 	case LVAL_QUOTE:
-		v = lval_quote(lval_copy(a->quoted));
+		v = lval_quote(NULL);
 		break;
 	case LVAL_LAMBDA:
-		v = lval_lambda(lenv_copy(a->env),
-						lval_copy(a->formals),
-						lval_copy(a->body));
+		v = alloc_lval(LVAL_LAMBDA);
+		v->env = lenv_copy(a->env);
+		v->formals = lval_copy(a->formals);
+		v->body = lval_copy(a->body);
+		v->info = lambda_info_retain(a->info);
 		break;
 	case LVAL_MACRO:
 		v = lval_macro(lval_copy(a->formals),
@@ -196,71 +456,307 @@ lval* lval_copy(lval* a)
 		break;
 	case LVAL_NUM:
 		v = lval_num(a->num);
+		if (a->big != NULL) v->big = bignum_copy(a->big);
 		break;
 	case LVAL_LIST:
 		v = lval_list();
+		v->strategy = a->strategy;
+		list_reserve(v, a->count);
 		v->count = a->count;
-		v->cells = malloc(sizeof(lval*) * a->count);
-		DIE_IF_NULL(v->cells);
-		for (unsigned i = 0; i < a->count; i++)
-			v->cells[i] = lval_copy(a->cells[i]);
+		if (a->strategy != LIST_CELLS && a->count != 0)
+			memcpy(v->bytes, a->bytes, list_elem_size(a) * a->count);
+		v->hash = a->hash;
 		break;
 	case LVAL_SYM:
 		v = lval_sym(a->sym);
 		break;
+	case LVAL_MAP:
+		v = lval_map(hamt_retain(a->map));
+		break;
+	case LVAL_SET:
+		v = lval_set(set_retain(a->set));
+		break;
+	case LVAL_BUILDER:
+		v = lval_builder();
+		if (a->sbText != NULL) builder_append(v, a->sbText, a->sbLength);
+		break;
+	case LVAL_RECORD:
+		v = lval_record(a->recordType);
+		break;
 	}
 
 	assert(v != NULL);
 	return v;
 }
 
-void lval_del(lval* v)
+lval* lval_copy(lval* a)
+{
+	lval* v = lval_copy_shallow(a);
+	if (!WALK_HAS_PARTS(a)) return v;
+
+	// Frame holds a value and its copy, whose parts are not copied yet
+	walk_stack stack;
+	walk_init(&stack);
+	walk_push(&stack, a, v);
+
+	while (stack.count != 0)
+	{
+		walk_frame frame = stack.frames[--stack.count];
+		unsigned count;
+		lval** from = lval_parts(frame.a, &count);
+		lval** to = lval_parts(frame.b, &count);
+
+		for (unsigned i = 0; i < count; i++)
+		{
+			to[i] = lval_copy_shallow(from[i]);
+			if (WALK_HAS_PARTS(from[i])) walk_push(&stack, from[i], to[i]);
+		}
+	}
+
+	walk_free(&stack);
+	return v;
+}
+
+// Frees 'v' without its parts
+void lval_del_shallow(lval* v)
 {
-	if (v == NULL) return;
-	
 	switch (v->type)
 	{
 	case LVAL_BOOL:
+	case LVAL_CHAR:
 	case LVAL_BUILTIN:
-	case LVAL_NUM: break;
+	case LVAL_QUOTE: break;
+
+	case LVAL_NUM: if (v->big != NULL) bignum_free(v->big); break;
 
 	case LVAL_ERR: free(v->err); break;
 	case LVAL_SYM: free(v->sym); break;
-	case LVAL_STR: free(v->str); break;
-
-	case LVAL_QUOTE: if (v->quoted != NULL) lval_del(v->quoted); break;
-	
-	case LVAL_LIST:
-		for (unsigned i = 0; i < v->count; i++)
-			lval_del(v->cells[i]);
-		free(v->cells);
+	case LVAL_STR:
+		if (v->rope != NULL) rope_release(v->rope);
+		else free(v->str);
 		break;
+	case LVAL_BUILDER: free(v->sbText); break;
+
+	case LVAL_MAP: hamt_release(v->map); break;
+	case LVAL_SET: set_release(v->set); break;
+
+	case LVAL_RECORD: free(v->slots); break;
+	case LVAL_LIST: free(v->cells); break;
 		
 	case LVAL_LAMBDA:
-		if (v->env     != NULL) lenv_del(v->env);
-		if (v->formals != NULL) lval_del(v->formals);
-		if (v->body    != NULL) lval_del(v->body);
+		if (v->env != NULL) lenv_del(v->env);
+		lval_del(v->formals);
+		lval_del(v->body);
+		lambda_info_release(v->info);
 		break;
-	
+
 	case LVAL_MACRO:
-		if (v->formals != NULL) lval_del(v->formals);
-		if (v->body    != NULL) lval_del(v->body);
+		lval_del(v->formals);
+		lval_del(v->body);
 		break;
 	}
 
 	free(v);
 }
 
+void lval_del(lval* v)
+{
+	if (v == NULL) return;
+	if (!WALK_HAS_PARTS(v))
+	{
+		lval_del_shallow(v);
+		return;
+	}
+
+	walk_stack stack;
+	walk_init(&stack);
+	walk_push(&stack, v, NULL);
+
+	while (stack.count != 0)
+	{
+		lval* x = stack.frames[--stack.count].a;
+		unsigned count;
+		lval** parts = lval_parts(x, &count);
+
+		// Parts may be NULL, when they were taken
+		for (unsigned i = 0; i < count; i++)
+		{
+			if (parts[i] == NULL) continue;
+
+			if (WALK_HAS_PARTS(parts[i])) walk_push(&stack, parts[i], NULL);
+			else lval_del_shallow(parts[i]);
+		}
+
+		lval_del_shallow(x);
+	}
+
+	walk_free(&stack);
+}
+
+list_strategy list_strategy_of(lval* x)
+{
+	if (IS_NUM(x) && x->big == NULL) return LIST_NUMS;
+	if (IS_CHAR(x)) return LIST_BYTES;
+	return LIST_CELLS;
+}
+
+size_t list_elem_size(lval* v)
+{
+	switch (v->strategy)
+	{
+	case LIST_NUMS:  return sizeof(long);
+	case LIST_BYTES: return sizeof(unsigned char);
+	default:         return sizeof(lval*);
+	}
+}
+
+lval* list_generalize(lval* v)
+{
+	assert(IS_LIST(v));
+
+	if (v->strategy == LIST_CELLS) return v;
+
+	lval** cells = malloc(sizeof(lval*) * (v->capacity != 0 ? v->capacity : 1));
+	DIE_IF_NULL(cells);
+
+	for (unsigned i = 0; i < v->count; i++)
+		cells[i] = v->strategy == LIST_NUMS ? lval_num(v->nums[i]) : lval_char(v->bytes[i]);
+
+	free(v->bytes);
+	v->cells = cells;
+	v->strategy = LIST_CELLS;
+	return v;
+}
+
+void lval_walk(lval* v, void (*visit)(lval*))
+{
+	if (!WALK_HAS_PARTS(v))
+	{
+		visit(v);
+		return;
+	}
+
+	walk_stack stack;
+	walk_init(&stack);
+	walk_push(&stack, v, NULL);
+
+	while (stack.count != 0)
+	{
+		walk_frame* frame = &stack.frames[stack.count - 1];
+		unsigned count;
+		lval** parts = lval_parts(frame->a, &count);
+
+		if (frame->i == count)
+		{
+			stack.count--;
+			visit(frame->a);
+			continue;
+		}
+
+		lval* x = parts[frame->i++];
+		if (x == NULL) continue;
+
+		if (WALK_HAS_PARTS(x)) walk_push(&stack, x, NULL);
+		else visit(x);
+	}
+
+	walk_free(&stack);
+}
+
+void list_generalize_visit(lval* v)
+{
+	if (IS_LIST(v)) list_generalize(v);
+}
+
+lval* list_generalize_deep(lval* v)
+{
+	// Packed lists have no nested values
+	lval_walk(v, list_generalize_visit);
+	return v;
+}
+
+// Stores 'x' into free element 'i' of the list
+void list_store(lval* v, unsigned i, lval* x)
+{
+	switch (v->strategy)
+	{
+	case LIST_NUMS:
+		v->nums[i] = x->num;
+		lval_del(x);
+		break;
+	case LIST_BYTES:
+		v->bytes[i] = x->ch;
+		lval_del(x);
+		break;
+	default:
+		v->cells[i] = x;
+		break;
+	}
+}
+
 lval* list_add(lval* v, lval* x)
 {
 	assert(v != NULL);
 	assert(x != NULL);
 	assert(IS_LIST(v));
+	v->hash = 0;
 	
+	if (v->strategy != LIST_CELLS && list_strategy_of(x) != v->strategy)
+		list_generalize(v);
+
+	if (v->count == v->capacity)
+		list_reserve(v, v->capacity < 4 ? 4 : v->capacity * 2);
+	list_store(v, v->count++, x);
+
+	return v;
+}
+
+lval* list_insert(lval* v, unsigned i, lval* x)
+{
+	assert(IS_LIST(v));
+	assert(i <= v->count);
+	v->hash = 0;
+
+	// Packed elements are not bigger than cells, so reserved memory is kept
+	if (v->count == 0 && v->strategy == LIST_CELLS)
+		v->strategy = list_strategy_of(x);
+	else if (v->strategy != LIST_CELLS && list_strategy_of(x) != v->strategy)
+		list_generalize(v);
+
+	if (v->count == v->capacity)
+		list_reserve(v, v->capacity < 4 ? 4 : v->capacity * 2);
+
+	size_t size = list_elem_size(v);
+	memmove(v->bytes + size * (i + 1), v->bytes + size * i, size * (v->count - i));
+	list_store(v, i, x);
 	v->count++;
-	v->cells = realloc(v->cells, sizeof(lval*) * (v->count));
-	DIE_IF_NULL(v->cells);
-	v->cells[v->count - 1] = x;
+
+	return v;
+}
+
+lval* list_set(lval* v, unsigned i, lval* x)
+{
+	assert(IS_LIST(v));
+	assert(i < v->count);
+	v->hash = 0;
+
+	if (v->strategy != LIST_CELLS && list_strategy_of(x) != v->strategy)
+		list_generalize(v);
+
+	if (v->strategy == LIST_CELLS) lval_del(v->cells[i]);
+	list_store(v, i, x);
+	return v;
+}
+
+lval* list_reserve(lval* v, unsigned count)
+{
+	assert(IS_LIST(v));
+
+	if (count <= v->capacity) return v;
+
+	v->bytes = realloc(v->bytes, list_elem_size(v) * count);
+	DIE_IF_NULL(v->bytes);
+	v->capacity = count;
 
 	return v;
 }
@@ -276,29 +772,90 @@ lval* list_pop(lval* v, unsigned i)
 {
 	assert(IS_LIST(v));
 	assert(i < v->count);
+	v->hash = 0;
 	
-	lval* x = v->cells[i];
+	lval* x;
+	switch (v->strategy)
+	{
+	case LIST_NUMS:  x = lval_num(v->nums[i]); break;
+	case LIST_BYTES: x = lval_char(v->bytes[i]); break;
+	default:         x = v->cells[i]; break;
+	}
 
-	memmove(&v->cells[i],
-			&v->cells[i + 1],
-			sizeof(lval*) * (v->count - i - 1));
+	size_t size = list_elem_size(v);
+	memmove(v->bytes + size * i,
+			v->bytes + size * (i + 1),
+			size * (v->count - i - 1));
 
 	v->count--;
-
-	v->cells = realloc(v->cells, sizeof(lval*) * v->count);
-	if (v->count != 0) DIE_IF_NULL(v->cells);
 	return x;
 }
 
 lval* list_join(lval* x, lval* y)
 {
-	while (y->count)
-		x = list_add(x, list_pop(y, 0));
+	if (x->count == 0)
+	{
+		lval_del(x);
+		return y;
+	}
+
+	if (y->count != 0)
+	{
+		if (x->strategy != y->strategy)
+		{
+			list_generalize(x);
+			list_generalize(y);
+		}
+
+		size_t size = list_elem_size(x);
+		list_reserve(x, x->count + y->count);
+		x->hash = 0;
+		memcpy(x->bytes + size * x->count, y->bytes, size * y->count);
+		x->count += y->count;
+		y->count = 0;
+	}
 
 	lval_del(y);
 	return x;
 }
 
+lval* list_reverse(lval* v)
+{
+	v->hash = 0;
+	size_t size = list_elem_size(v);
+	unsigned char tmp[sizeof(long) > sizeof(lval*) ? sizeof(long) : sizeof(lval*)];
+
+	for (unsigned i = 0, j = v->count; i + 1 < j; i++, j--)
+	{
+		memcpy(tmp, v->bytes + size * i, size);
+		memcpy(v->bytes + size * i, v->bytes + size * (j - 1), size);
+		memcpy(v->bytes + size * (j - 1), tmp, size);
+	}
+
+	return v;
+}
+
+lval* list_peek(lval* v, unsigned i, lval* view)
+{
+	assert(IS_LIST(v));
+	assert(i < v->count);
+
+	switch (v->strategy)
+	{
+	case LIST_NUMS:
+		view->type = LVAL_NUM;
+		view->num = v->nums[i];
+		view->big = NULL;
+		return view;
+	case LIST_BYTES:
+		view->type = LVAL_CHAR;
+		view->ch = v->bytes[i];
+		return view;
+	default:
+		return v->cells[i];
+	}
+}
+
 lval* lval_to_str(lval* a)
 {
 	assert(a != NULL);
@@ -314,12 +871,18 @@ lval* lval_to_str(lval* a)
 		res = lval_str(a->sym);
 		break;
 	case LVAL_STR:
-		res = lval_str(a->str);
+		res = lval_str(lval_str_flat(a));
 		break;
 	case LVAL_NUM:
 	{
-		char* str = malloc(MAX_INT_STR_LENGTH);
-		sprintf(str, "%ld", a->num);
+		char* str;
+		if (a->big != NULL) str = bignum_to_str(a->big);
+		else
+		{
+			str = malloc(MAX_INT_STR_LENGTH);
+			DIE_IF_NULL(str);
+			sprintf(str, "%ld", a->num);
+		}
 		res = lval_str_null();
 		res->str = str;
 		break;
@@ -327,6 +890,9 @@ lval* lval_to_str(lval* a)
 	case LVAL_BOOL:
 		res = lval_str(a->boolean ? "true" : "false");
 		break;
+	case LVAL_CHAR:
+		res = lval_str_char(a->ch);
+		break;
 	case LVAL_LAMBDA:
 		res = lval_str("<lambda>");
 		break;
@@ -337,56 +903,195 @@ lval* lval_to_str(lval* a)
 		res = lval_str("<macro>");
 		break;
 	case LVAL_QUOTE:
-	{
-		lval* quoted = lval_to_str(a->quoted);
-		res = lval_str_null();
-		res->str = malloc(strlen(quoted->str) + 1 + 1);
-		DIE_IF_NULL(res->str);
-		res->str[0] = '\'';
-		res->str[1] = '\0';
-		strcat(res->str, quoted->str);
-		lval_del(quoted);
-		break;
-	}
 	case LVAL_LIST:
 		res = list_to_str(a);
 		break;
+	case LVAL_MAP:
+		res = map_to_str(a);
+		break;
+	case LVAL_SET:
+		res = set_to_str(a);
+		break;
+	case LVAL_RECORD:
+		res = record_to_str(a);
+		break;
+	case LVAL_BUILDER:
+		res = lval_str(a->sbText != NULL ? a->sbText : "");
+		break;
 	}
 
 	assert(res != NULL);
 	return res;
 }
 
+// Appends text of a value, that is not a List or a Quote, to builder 'out'
+void list_write_atom(lval* out, lval* x)
+{
+	switch (x->type)
+	{
+	case LVAL_SYM: builder_append(out, x->sym, strlen(x->sym)); break;
+	case LVAL_BOOL: builder_append(out, x->boolean ? "true" : "false", x->boolean ? 4 : 5); break;
+	case LVAL_CHAR: if (x->ch != '\0') builder_append(out, &x->ch, 1); break;
+	case LVAL_STR:
+	{
+		const char* str = lval_str_flat(x);
+		builder_append(out, str, strlen(str));
+		break;
+	}
+	case LVAL_NUM:
+		if (x->big == NULL)
+		{
+			char* end = builder_reserve(out, MAX_INT_STR_LENGTH);
+			out->sbLength += sprintf(end, "%ld", x->num);
+			break;
+		}
+		// Fallthrough
+	default:
+	{
+		lval* str = lval_to_str(x);
+		builder_append(out, str->str, strlen(str->str));
+		lval_del(str);
+		break;
+	}
+	}
+}
+
+// Writes quote marks and the opening bracket of a List, that is pushed
+void list_write_open(lval* out, walk_stack* stack, lval* x)
+{
+	for (; IS_QUOTE(x); x = x->quoted) builder_append(out, "'", 1);
+
+	if (!IS_LIST(x)) list_write_atom(out, x);
+	else
+	{
+		builder_append(out, "(", 1);
+		walk_push(stack, x, NULL);
+	}
+}
+
+// Prints Lists and Quotes into one buffer, frames hold the next element
 lval* list_to_str(lval* v)
 {
 	assert(v != NULL);
 
-	lval* res = lval_str("(");
-	bool inStart = true;
+	lval* out = lval_builder();
+	walk_stack stack;
+	walk_init(&stack);
+	list_write_open(out, &stack, v);
 
-	for (unsigned i = 0; i < v->count; i++)
+	while (stack.count != 0)
 	{
-		lval* x = lval_to_str(v->cells[i]);
-		res->str = realloc(res->str, strlen(res->str) + strlen(x->str) + 1 + (inStart ? 0 : 1));
-		DIE_IF_NULL(res->str);
-		if (!inStart)
+		walk_frame* frame = &stack.frames[stack.count - 1];
+		if (frame->i == frame->a->count)
 		{
-			size_t size = strlen(res->str);
-			res->str[size] = ' ';
-			res->str[size + 1] = '\0';
-		} else inStart = false;
-		strcat(res->str, x->str);
-		lval_del(x);
+			builder_append(out, ")", 1);
+			stack.count--;
+			continue;
+		}
+
+		if (frame->i != 0) builder_append(out, " ", 1);
+
+		lval view;
+		list_write_open(out, &stack, list_peek(frame->a, frame->i++, &view));
 	}
 
+	walk_free(&stack);
+	lval* res = builder_take(out);
+	lval_del(out);
+	return res;
+}
+
+void map_to_str_entry(void* data, lval* key, lval* value)
+{
+	lval* res = data;
+	lval* k = lval_to_str(key);
+	lval* v = lval_to_str(value);
+
+	bool inStart = res->str[1] == '\0';
+	size_t size = strlen(res->str);
+	res->str = realloc(res->str, size + strlen(k->str) + strlen(v->str) + 1 + 1 + (inStart ? 0 : 2));
+	DIE_IF_NULL(res->str);
+	if (!inStart) strcat(res->str, ", ");
+	strcat(res->str, k->str);
+	strcat(res->str, " ");
+	strcat(res->str, v->str);
+
+	lval_del(k);
+	lval_del(v);
+}
+
+lval* map_to_str(lval* v)
+{
+	assert(IS_MAP(v));
+
+	lval* res = lval_str("{");
+	hamt_each(v->map, map_to_str_entry, res);
+
 	size_t size = strlen(res->str);
 	res->str = realloc(res->str, size + 1 + 1);
-	res->str[size] = ')';
+	DIE_IF_NULL(res->str);
+	res->str[size] = '}';
 	res->str[size + 1] = '\0';
 
 	return res;
 }
 
+void set_to_str_element(void* data, lval* key, lval* value)
+{
+	lval* res = data;
+	lval* x = lval_to_str(key);
+
+	bool inStart = res->str[2] == '\0';
+	size_t size = strlen(res->str);
+	res->str = realloc(res->str, size + strlen(x->str) + 1 + (inStart ? 0 : 1));
+	DIE_IF_NULL(res->str);
+	if (!inStart) strcat(res->str, " ");
+	strcat(res->str, x->str);
+
+	lval_del(x);
+}
+
+lval* set_to_str(lval* v)
+{
+	assert(IS_SET(v));
+
+	lval* res = lval_str("#{");
+	hamt_each(v->set->elements, set_to_str_element, res);
+
+	size_t size = strlen(res->str);
+	res->str = realloc(res->str, size + 1 + 1);
+	DIE_IF_NULL(res->str);
+	res->str[size] = '}';
+	res->str[size + 1] = '\0';
+
+	return res;
+}
+
+// Like '#point{x 1, y 2}'
+lval* record_to_str(lval* v)
+{
+	assert(IS_RECORD(v));
+
+	record_type* type = record_type_get(v->recordType);
+	lval* res = lval_str_null();
+	res->str = malloc(1 + strlen(type->name) + 1 + 1);
+	DIE_IF_NULL(res->str);
+	sprintf(res->str, "#%s{", type->name);
+
+	for (unsigned i = 0; i < type->count; i++)
+	{
+		lval* x = lval_to_str(v->slots[i]);
+		size_t size = strlen(res->str);
+		res->str = realloc(res->str, size + strlen(type->fields[i]) + 1 + strlen(x->str) + 2 + 1 + 1);
+		DIE_IF_NULL(res->str);
+		sprintf(res->str + size, "%s%s %s", i == 0 ? "" : ", ", type->fields[i], x->str);
+		lval_del(x);
+	}
+
+	strcat(res->str, "}");
+	return res;
+}
+
 void lval_print(lval* v)
 {
 	assert(v != NULL);
@@ -409,34 +1114,351 @@ void lval_println(lval* v)
 	putchar('\n');
 }
 
-bool lval_eq(lval* a, lval* b)
+const char* lval_text(lval* x, char buf[2])
 {
-	assert(a != NULL);
-	assert(b != NULL);
+	if (IS_STR(x)) return lval_str_flat(x);
+
+	assert(IS_CHAR(x));
+	buf[0] = x->ch;
+	buf[1] = '\0';
+	return buf;
+}
+
+char* lval_str_flat(lval* v)
+{
+	assert(IS_STR(v));
+
+	if (v->str == NULL) v->str = rope_flatten(v->rope);
+	return v->str;
+}
+
+size_t lval_str_length(lval* v)
+{
+	assert(IS_STR(v));
+
+	return v->rope != NULL ? v->rope->length : strlen(v->str);
+}
 
-	if (a->type != b->type) return false;
+lval* lval_str_sub(lval* v, size_t start, size_t end)
+{
+	assert(start <= end && end <= lval_str_length(v));
+
+	if (v->rope != NULL) return lval_str_rope(rope_substring(v->rope, start, end));
+	return lval_str_n(v->str + start, end - start);
+}
+
+// Booleans convert to EQ_FALSE and EQ_TRUE
+typedef enum
+{
+	EQ_FALSE,
+	EQ_TRUE,
+	EQ_PARTS
+} eq_result;
+
+// Compares everything except parts, that lval_eq compares, if the result
+// is EQ_PARTS
+eq_result lval_eq_shallow(lval* a, lval* b)
+{
+	if (a->type != b->type)
+	{
+		if (!(IS_CHAR(a) && IS_STR(b)) && !(IS_STR(a) && IS_CHAR(b))) return EQ_FALSE;
+
+		char bufA[2], bufB[2];
+		return strcmp(lval_text(a, bufA), lval_text(b, bufB)) == 0;
+	}
+
+	if (a == b) return EQ_TRUE;
+
+	// Different cached hashes prove inequality, hash-consed values with equal
+	// hashes are copies of one canonical value
+	if ((IS_LIST(a) || IS_STR(a)) && a->hash != 0 && b->hash != 0)
+	{
+		if (a->hash & b->hash & LVAL_HASH_CONSED) return a->hash == b->hash;
+		if ((a->hash ^ b->hash) & ~LVAL_HASH_CONSED) return EQ_FALSE;
+	}
 
 	switch (a->type)
 	{
-	case LVAL_NUM: return a->num == b->num;
+	case LVAL_NUM: return a->big == NULL && b->big == NULL ? a->num == b->num : lval_num_cmp(a, b) == 0;
 	case LVAL_BOOL: return a->boolean == b->boolean;
 	
 	case LVAL_SYM: return strcmp(a->sym, b->sym) == 0;
 	case LVAL_ERR: return strcmp(a->err, b->err) == 0;
-	case LVAL_STR: return strcmp(a->str, b->str) == 0;
+	case LVAL_STR:
+		if ((a->rope != NULL || b->rope != NULL) && lval_str_length(a) != lval_str_length(b))
+			return false;
+		return strcmp(lval_str_flat(a), lval_str_flat(b)) == 0;
+	case LVAL_CHAR: return a->ch == b->ch;
+	case LVAL_BUILDER:
+		return a->sbLength == b->sbLength
+			&& (a->sbLength == 0 || memcmp(a->sbText, b->sbText, a->sbLength) == 0);
 	
 	case LVAL_BUILTIN: return a->builtin == b->builtin;
-	case LVAL_LAMBDA: return lval_eq(a->formals, b->formals) && lval_eq(a->body, b->body);
+	case LVAL_LAMBDA:
 	case LVAL_MACRO: return lval_eq(a->formals, b->formals) && lval_eq(a->body, b->body);
+	case LVAL_QUOTE: return EQ_PARTS;
+	case LVAL_MAP: return hamt_eq(a->map, b->map);
+	case LVAL_SET: return set_eq(a->set, b->set);
+
+	case LVAL_RECORD:
+		return a->recordType == b->recordType ? EQ_PARTS : EQ_FALSE;
 
 	case LVAL_LIST:
-		if (a->count != b->count) return false;
+		if (a->count != b->count) return EQ_FALSE;
+		if (a->strategy == b->strategy)
+		{
+			if (a->strategy == LIST_CELLS) return EQ_PARTS;
+			return memcmp(a->bytes, b->bytes, list_elem_size(a) * a->count) == 0;
+		}
+
+		// Elements of a packed list are Numbers or Characters, they have
+		// no parts
 		for (unsigned i = 0; i < a->count; i++)
-			if (!lval_eq(a->cells[i], b->cells[i])) return false;
-		return true;
+		{
+			lval viewA, viewB;
+			if (lval_eq_shallow(list_peek(a, i, &viewA), list_peek(b, i, &viewB)) != EQ_TRUE)
+				return EQ_FALSE;
+		}
+		return EQ_TRUE;
 	default:
-		return false;
+		return EQ_FALSE;
+	}
+}
+
+bool lval_eq(lval* a, lval* b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	eq_result res = lval_eq_shallow(a, b);
+	if (res != EQ_PARTS) return res == EQ_TRUE;
+
+	walk_stack stack;
+	walk_init(&stack);
+	walk_push(&stack, a, b);
+
+	while (res != EQ_FALSE && stack.count != 0)
+	{
+		walk_frame frame = stack.frames[--stack.count];
+		unsigned count;
+		lval** xs = lval_parts(frame.a, &count);
+		lval** ys = lval_parts(frame.b, &count);
+
+		for (unsigned i = 0; i < count && res != EQ_FALSE; i++)
+		{
+			res = lval_eq_shallow(xs[i], ys[i]);
+			if (res == EQ_PARTS) walk_push(&stack, xs[i], ys[i]);
+		}
+	}
+
+	walk_free(&stack);
+	return res != EQ_FALSE;
+}
+
+unsigned long hash_mix(unsigned long x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdUL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53UL;
+	x ^= x >> 33;
+	return x;
+}
+
+// FNV-1a
+unsigned long hash_str(const char* str)
+{
+	unsigned long hash = 0xcbf29ce484222325UL;
+	for (; *str != '\0'; str++)
+	{
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3UL;
+	}
+	return hash;
+}
+
+unsigned long hash_combine(unsigned long seed, unsigned long x)
+{
+	return seed ^ (x + 0x9e3779b97f4a7c15UL + (seed << 6) + (seed >> 2));
+}
+
+// Zero marks a hash, that is not computed
+unsigned hash_cache_bits(unsigned long hash)
+{
+	unsigned bits = hash & ~LVAL_HASH_CONSED;
+	return bits != 0 ? bits : 1;
+}
+
+// Hash of 'v' without its parts, 'hash' is combined hash of the parts
+unsigned long lval_hash_finish(lval* v, unsigned long hash)
+{
+	hash = hash_mix(hash ^ ((unsigned long) v->type << 56));
+	if (!IS_LIST(v) && !IS_STR(v)) return hash;
+
+	v->hash = hash_cache_bits(hash);
+	return v->hash;
+}
+
+// Hash of parts of 'v' before combining them
+unsigned long lval_hash_seed(lval* v)
+{
+	if (IS_LIST(v)) return v->count;
+	if (IS_RECORD(v)) return v->recordType;
+	return 0;
+}
+
+unsigned long lval_hash_part(lval* v, unsigned long hash, unsigned long part)
+{
+	return IS_QUOTE(v) ? part : hash_combine(hash, part);
+}
+
+// Frame holds a value and combined hash of its parts, that are hashed
+unsigned long lval_hash_parts(lval* v)
+{
+	walk_stack stack;
+	walk_init(&stack);
+	walk_push(&stack, v, NULL)->hash = lval_hash_seed(v);
+	unsigned long hash = 0;
+
+	while (stack.count != 0)
+	{
+		walk_frame* frame = &stack.frames[stack.count - 1];
+		unsigned count;
+		lval** parts = lval_parts(frame->a, &count);
+
+		if (frame->i == count)
+		{
+			hash = lval_hash_finish(frame->a, frame->hash);
+			if (--stack.count != 0)
+			{
+				frame = &stack.frames[stack.count - 1];
+				frame->hash = lval_hash_part(frame->a, frame->hash, hash);
+			}
+			continue;
+		}
+
+		lval* x = parts[frame->i++];
+		if (WALK_HAS_PARTS(x) && !(IS_LIST(x) && x->hash != 0))
+			walk_push(&stack, x, NULL)->hash = lval_hash_seed(x);
+		else frame->hash = lval_hash_part(frame->a, frame->hash, lval_hash(x));
 	}
+
+	walk_free(&stack);
+	return hash;
+}
+
+unsigned long lval_hash(lval* v)
+{
+	assert(v != NULL);
+
+	if ((IS_LIST(v) || IS_STR(v)) && v->hash != 0) return v->hash & ~LVAL_HASH_CONSED;
+
+	unsigned long hash = 0;
+
+	switch (v->type)
+	{
+	case LVAL_NUM:
+		if (v->big == NULL) hash = (unsigned long) v->num;
+		else
+		{
+			hash = v->big->negative;
+			for (unsigned i = 0; i < v->big->count; i++)
+				hash = hash_combine(hash, v->big->digits[i]);
+		}
+		break;
+	case LVAL_BOOL: hash = v->boolean; break;
+
+	case LVAL_SYM: hash = hash_str(v->sym); break;
+	case LVAL_ERR: hash = hash_str(v->err); break;
+	case LVAL_STR: hash = hash_str(lval_str_flat(v)); break;
+	case LVAL_BUILDER: hash = hash_str(v->sbText != NULL ? v->sbText : ""); break;
+
+	case LVAL_CHAR:
+	{
+		// Characters are equal to strings, so they are hashed like them
+		char buf[2];
+		return hash_cache_bits(hash_mix(hash_str(lval_text(v, buf)) ^ ((unsigned long) LVAL_STR << 56)));
+	}
+
+	case LVAL_BUILTIN: hash = (unsigned long) v->builtin; break;
+	case LVAL_LAMBDA:
+	case LVAL_MACRO: hash = hash_combine(lval_hash(v->formals), lval_hash(v->body)); break;
+	case LVAL_MAP: hash = hamt_hash(v->map); break;
+	case LVAL_SET: hash = set_hash(v->set); break;
+
+	case LVAL_QUOTE:
+	case LVAL_RECORD:
+	case LVAL_LIST:
+		if (WALK_HAS_PARTS(v)) return lval_hash_parts(v);
+
+		// Packed and empty lists
+		hash = v->count;
+		for (unsigned i = 0; i < v->count; i++)
+		{
+			lval view;
+			hash = hash_combine(hash, lval_hash(list_peek(v, i, &view)));
+		}
+		break;
+	}
+
+	return lval_hash_finish(v, hash);
+}
+
+int lval_num_cmp(lval* a, lval* b)
+{
+	assert(IS_NUM(a) && IS_NUM(b));
+
+	if (a->big == NULL && b->big == NULL)
+		return a->num < b->num ? -1 : a->num > b->num;
+
+	lbig viewA, viewB;
+	uint32_t digitsA[BIGNUM_LONG_DIGITS], digitsB[BIGNUM_LONG_DIGITS];
+	return bignum_cmp(lval_num_bignum(a, &viewA, digitsA), lval_num_bignum(b, &viewB, digitsB));
+}
+
+const lbig* lval_num_bignum(lval* x, lbig* view, uint32_t digits[BIGNUM_LONG_DIGITS])
+{
+	if (x->big != NULL) return x->big;
+
+	bignum_view_long(view, digits, x->num);
+	return view;
+}
+
+char* builder_reserve(lval* v, size_t length)
+{
+	if (v->sbLength + length + 1 > v->sbCapacity)
+	{
+		size_t capacity = v->sbCapacity < 16 ? 16 : v->sbCapacity;
+		while (capacity < v->sbLength + length + 1) capacity *= 2;
+
+		v->sbText = realloc(v->sbText, capacity);
+		DIE_IF_NULL(v->sbText);
+		v->sbCapacity = capacity;
+	}
+
+	return v->sbText + v->sbLength;
+}
+
+void builder_append(lval* v, const char* str, size_t length)
+{
+	char* end = builder_reserve(v, length);
+	memcpy(end, str, length);
+	v->sbLength += length;
+	v->sbText[v->sbLength] = '\0';
+}
+
+lval* builder_take(lval* v)
+{
+	builder_reserve(v, 0);
+	v->sbText[v->sbLength] = '\0';
+
+	lval* res = lval_str_null();
+	res->str = v->sbText;
+
+	v->sbText = NULL;
+	v->sbLength = 0;
+	v->sbCapacity = 0;
+	return res;
 }
 
 lval* lval_unquote(lval* a)